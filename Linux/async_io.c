@@ -0,0 +1,416 @@
+#include "stdio_internal.h"
+#include <string.h>
+
+#define ASYNC_MAXLEN	0x7ffff000
+
+/* Raw io_uring system calls, so no external library is needed */
+static int so_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int so_uring_enter(int fd, unsigned int to_submit,
+	unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		flags, NULL, 0);
+}
+
+/* Maps the submission queue, completion queue and SQE array
+ * of a freshly created io_uring
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_ring_map(SO_RING *ring, struct io_uring_params *p)
+{
+	unsigned char *sq = NULL;
+	unsigned char *cq = NULL;
+
+	ring->sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	ring->cq_len = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = 0;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED)
+		return -1;
+	if (ring->cq_len == 0) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			munmap(ring->sq_ptr, ring->sq_len);
+			return -1;
+		}
+	}
+
+	ring->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_len != 0)
+			munmap(ring->cq_ptr, ring->cq_len);
+		munmap(ring->sq_ptr, ring->sq_len);
+		return -1;
+	}
+
+	sq = ring->sq_ptr;
+	cq = ring->cq_ptr;
+	ring->sq_tail = (unsigned int *)(sq + p->sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + p->sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + p->sq_off.array);
+	ring->cq_head = (unsigned int *)(cq + p->cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + p->cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + p->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+	return 0;
+}
+
+/* Allocates a new SO_RING able to keep up to entries reads and
+ * writes in flight over any number of SO_FILE structures
+ * Uses io_uring; when the kernel does not provide it, requests
+ * are carried out with pread/pwrite at so_submit instead
+ * Returns NULL in case of error
+ */
+SO_RING *so_ring_create(unsigned int entries)
+{
+	struct io_uring_params params;
+	SO_RING *ring = NULL;
+	unsigned int i = 0;
+
+	if (entries == 0)
+		return NULL;
+
+	ring = calloc(1, sizeof(SO_RING));
+	if (ring == NULL)
+		return NULL;
+
+	memset(&params, 0, sizeof(params));
+	ring->fd = so_uring_setup(entries, &params);
+	if (ring->fd != -1 && so_ring_map(ring, &params) == -1) {
+		close(ring->fd);
+		ring->fd = -1;
+	}
+
+	/* in-flight requests are bounded by the size of the queues */
+	if (ring->fd != -1)
+		ring->entries = params.sq_entries;
+	else
+		ring->entries = entries;
+
+	ring->reqs = calloc(ring->entries, sizeof(struct so_async_req));
+	ring->emu_queue = calloc(ring->entries, sizeof(int));
+	ring->emu_done = calloc(ring->entries, sizeof(int));
+	if (ring->reqs == NULL || ring->emu_queue == NULL ||
+		ring->emu_done == NULL) {
+		so_ring_destroy(ring);
+		return NULL;
+	}
+	for (i = 0; i < ring->entries; i++)
+		ring->reqs[i].next = i + 1 < ring->entries ? (int)i + 1 : -1;
+	ring->free_head = 0;
+	return ring;
+}
+
+/* Frees the SO_RING, closing its io_uring
+ * Requests still in flight are waited for first
+ * Returns 0 at succes, -1 in case of error
+ */
+int so_ring_destroy(SO_RING *ring)
+{
+	struct so_completion event;
+	int ret = 0;
+
+	while (ring->reqs != NULL && (ring->inflight > 0 || ring->queued > 0))
+		if (so_reap(ring, &event, 1, 1) < 0) {
+			ret = -1;
+			break;
+		}
+
+	if (ring->fd != -1) {
+		munmap(ring->sqes, ring->sqes_len);
+		if (ring->cq_len != 0)
+			munmap(ring->cq_ptr, ring->cq_len);
+		munmap(ring->sq_ptr, ring->sq_len);
+		ret |= close(ring->fd);
+	}
+	free(ring->emu_done);
+	free(ring->emu_queue);
+	free(ring->reqs);
+	free(ring);
+	return ret;
+}
+
+/* Reserves count bytes at the current position of the SO_FILE for
+ * an asynchronous operation, flushing or discarding its buffer
+ * and moving its internal pointer past the reserved range, so
+ * that several requests on the same SO_FILE never overlap
+ * Non-seekable SO_FILEs use their current position (offset -1);
+ * "r+" so_popen SO_FILEs, with two file descrs, compressed and
+ * direct I/O SO_FILEs and SO_FILEs keeping a checksum are not
+ * supported
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_async_reserve(SO_FILE *stream, size_t count, long *offset)
+{
+	if (stream->duplex != NULL || stream->z != NULL ||
+		stream->dio != NULL || stream->csum_on)
+		return -1;
+	if (!so_seekable(stream)) {
+		if (stream->last_op == LASTWRITE &&
+			so_fflush_unlocked(stream) == SO_EOF)
+			return -1;
+		/* buffered bytes would be read out of order */
+		if (stream->buff_pos != stream->buff_size || stream->ra != NULL)
+			return -1;
+		*offset = -1;
+		return 0;
+	}
+
+	*offset = so_ftell_unlocked(stream);
+	return so_fseek_unlocked(stream, *offset + count, SEEK_SET);
+}
+
+/* Queues one read or write of count bytes at offset of the file
+ * descr of the SO_FILE (-1 for its current position, which moves)
+ * on the SO_RING, leaving the SO_FILE itself alone
+ * Nothing reaches the kernel until so_submit or so_reap
+ * Returns 0 at succes, -1 if the SO_RING is already full
+ */
+int so_ring_push(SO_RING *ring, int opcode, void *ptr, size_t count,
+	SO_FILE *stream, void *user_data, long offset)
+{
+	struct so_async_req *req = NULL;
+	struct io_uring_sqe *sqe = NULL;
+	unsigned int tail = 0;
+	unsigned int index = 0;
+	int slot = ring->free_head;
+
+	if (slot == -1)
+		return -1;
+	req = &ring->reqs[slot];
+	ring->free_head = req->next;
+	req->stream = stream;
+	req->user_data = user_data;
+	req->opcode = opcode;
+	req->buf = ptr;
+	req->len = count;
+	req->offset = offset;
+	req->result = 0;
+	req->next = -1;
+
+	if (ring->fd == -1) {
+		ring->emu_queue[ring->queued++] = slot;
+		return 0;
+	}
+
+	tail = *ring->sq_tail;
+	index = tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = stream->fd;
+	sqe->addr = (unsigned long)ptr;
+	sqe->len = count;
+	sqe->off = (__u64)offset;
+	sqe->user_data = slot;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+	return 0;
+}
+
+/* Queues one read or write of the SO_FILE on the SO_RING, at its
+ * current position, which moves past the request
+ * Returns 0 at succes, -1 in case of error or if the SO_RING
+ * is already full
+ */
+static int so_queue_async(SO_RING *ring, int opcode, void *ptr,
+	size_t count, SO_FILE *stream, void *user_data)
+{
+	long offset = -1;
+
+	if (ring->free_head == -1 || count > ASYNC_MAXLEN)
+		return -1;
+	so_flockfile(stream);
+	if (so_ferror_unlocked(stream) ||
+		so_async_reserve(stream, count, &offset) == -1) {
+		so_funlockfile(stream);
+		return -1;
+	}
+	so_funlockfile(stream);
+	return so_ring_push(ring, opcode, ptr, count, stream, user_data,
+		offset);
+}
+
+/* Queues an asynchronous read of count bytes from the current
+ * position of the SO_FILE into ptr; the SO_FILE pointer moves
+ * past them immediately
+ * ptr must stay valid until the request is reaped
+ * Returns 0 at succes, -1 in case of error
+ */
+int so_fread_async(SO_RING *ring, void *ptr, size_t count,
+	SO_FILE *stream, void *user_data)
+{
+	return so_queue_async(ring, IORING_OP_READ, ptr, count,
+		stream, user_data);
+}
+
+/* Queues an asynchronous write of count bytes from ptr at the
+ * current position of the SO_FILE; the SO_FILE pointer moves
+ * past them immediately
+ * ptr must stay valid until the request is reaped
+ * Returns 0 at succes, -1 in case of error
+ */
+int so_fwrite_async(SO_RING *ring, const void *ptr, size_t count,
+	SO_FILE *stream, void *user_data)
+{
+	return so_queue_async(ring, IORING_OP_WRITE, (void *)ptr, count,
+		stream, user_data);
+}
+
+/* Carries out the queued requests of a SO_RING without io_uring */
+static void so_emu_run(SO_RING *ring)
+{
+	struct so_async_req *req = NULL;
+	unsigned int i = 0;
+	unsigned int tail = 0;
+	ssize_t ret = 0;
+
+	for (i = 0; i < ring->queued; i++) {
+		req = &ring->reqs[ring->emu_queue[i]];
+		if (req->opcode == IORING_OP_READ && req->offset == -1)
+			ret = read(req->stream->fd, req->buf, req->len);
+		else if (req->opcode == IORING_OP_READ)
+			ret = pread(req->stream->fd, req->buf, req->len,
+				req->offset);
+		else if (req->offset == -1)
+			ret = write(req->stream->fd, req->buf, req->len);
+		else
+			ret = pwrite(req->stream->fd, req->buf, req->len,
+				req->offset);
+		req->result = ret == -1 ? -errno : ret;
+
+		tail = (ring->emu_done_head + ring->emu_done_count) %
+			ring->entries;
+		ring->emu_done[tail] = ring->emu_queue[i];
+		ring->emu_done_count++;
+	}
+	ring->inflight += ring->queued;
+	ring->queued = 0;
+}
+
+/* Hands all queued requests of the SO_RING to the kernel with
+ * a single io_uring_enter call
+ * Returns the number of requests submitted or -1 in case of error
+ */
+int so_submit(SO_RING *ring)
+{
+	int ret = 0;
+
+	if (ring->queued == 0)
+		return 0;
+
+	if (ring->fd == -1) {
+		ret = ring->queued;
+		so_emu_run(ring);
+		return ret;
+	}
+
+	do {
+		ret = so_uring_enter(ring->fd, ring->queued, 0, 0);
+	} while (ret == -1 && errno == EINTR);
+	if (ret == -1)
+		return -1;
+	ring->queued -= ret;
+	ring->inflight += ret;
+	return ret;
+}
+
+/* Fills a so_completion from a finished request, updates the
+ * error and EOF flags of its SO_FILE, drops the cached blocks a
+ * write changed and recycles the slot
+ */
+static void so_complete(SO_RING *ring, int slot, long result,
+	struct so_completion *event)
+{
+	struct so_async_req *req = &ring->reqs[slot];
+
+	so_flockfile(req->stream);
+	if (result < 0)
+		req->stream->found_error = 1;
+	else if (result == 0 && req->opcode == IORING_OP_READ)
+		req->stream->found_eof = true;
+	else if (req->opcode == IORING_OP_WRITE)
+		so_bc_wrote(req->stream, req->offset, result);
+	so_funlockfile(req->stream);
+
+	event->stream = req->stream;
+	event->user_data = req->user_data;
+	event->result = result;
+
+	req->next = ring->free_head;
+	ring->free_head = slot;
+	ring->inflight--;
+}
+
+/* Collects up to max finished requests of the SO_RING into events,
+ * submitting anything still queued and waiting until at least
+ * min_complete of them are available
+ * Returns the number of completions or -1 in case of error
+ */
+int so_reap(SO_RING *ring, struct so_completion *events,
+	int max, int min_complete)
+{
+	unsigned int head = 0;
+	unsigned int tail = 0;
+	struct io_uring_cqe *cqe = NULL;
+	int count = 0;
+	int slot = 0;
+	int ret = 0;
+
+	if (ring->queued > 0 && so_submit(ring) == -1)
+		return -1;
+	if (min_complete > (int)ring->inflight)
+		min_complete = ring->inflight;
+	if (min_complete > max)
+		min_complete = max;
+
+	if (ring->fd == -1) {
+		while (count < max && ring->emu_done_count > 0) {
+			slot = ring->emu_done[ring->emu_done_head];
+			so_complete(ring, slot, ring->reqs[slot].result,
+				&events[count++]);
+			ring->emu_done_head = (ring->emu_done_head + 1) %
+				ring->entries;
+			ring->emu_done_count--;
+		}
+		return count;
+	}
+
+	while (count < max) {
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail && count < max) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			so_complete(ring, cqe->user_data, cqe->res,
+				&events[count++]);
+			head++;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		if (count >= min_complete)
+			break;
+		ret = so_uring_enter(ring->fd, 0, min_complete - count,
+			IORING_ENTER_GETEVENTS);
+		if (ret == -1 && errno != EINTR)
+			return count > 0 ? count : -1;
+	}
+	return count;
+}
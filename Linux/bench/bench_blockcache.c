@@ -0,0 +1,113 @@
+/*
+ * Block cache: threads, each with its own SO_FILE on the same file,
+ * looking up 512 byte records at random offsets of a 16 MiB hot
+ * region with so_fseek + so_fread, without (so) and with (so_cache)
+ * a 32 MiB block cache of 64 KiB blocks, and with glibc stdio
+ * (libc)
+ * blockcache reports the lookups per second of all the threads
+ */
+#include <pthread.h>
+
+#include "bench_common.h"
+
+#define FILE_BYTES	(64L << 20)
+#define HOT_BYTES	(16L << 20)
+#define RECORD		512
+#define LOOKUPS		(1 << 18)
+#define MAX_THREADS	4
+#define CACHE_BUDGET	(32 << 20)
+
+struct reader {
+	const char *path;
+	int impl;
+	unsigned int seed;
+	long lookups;
+};
+
+static void *reader_main(void *arg)
+{
+	struct reader *r = arg;
+	char record[RECORD];
+	SO_FILE *so = NULL;
+	FILE *libc = NULL;
+	long offset = 0;
+	long i = 0;
+	long sum = 0;
+
+	if (r->impl == 2)
+		libc = fopen(r->path, "r");
+	else
+		so = so_fopen(r->path, "r");
+	for (i = 0; i < r->lookups; i++) {
+		r->seed = r->seed * 1103515245 + 12345;
+		offset = (r->seed >> 4) % (HOT_BYTES / RECORD) * RECORD;
+		if (libc != NULL) {
+			fseek(libc, offset, SEEK_SET);
+			fread(record, 1, RECORD, libc);
+		} else {
+			so_fseek(so, offset, SEEK_SET);
+			so_fread(record, 1, RECORD, so);
+		}
+		sum += record[0];
+	}
+	if (libc != NULL)
+		fclose(libc);
+	else
+		so_fclose(so);
+	bench_sink = sum;
+	return NULL;
+}
+
+static double run_blockcache(const char *path, int impl, int threads,
+	long lookups)
+{
+	struct reader readers[MAX_THREADS];
+	pthread_t tids[MAX_THREADS];
+	double start = 0;
+	int i = 0;
+
+	so_setblockcache(0, impl == 1 ? CACHE_BUDGET : 0);
+	start = bench_now();
+	for (i = 0; i < threads; i++) {
+		readers[i].path = path;
+		readers[i].impl = impl;
+		readers[i].seed = 2463534242u + i;
+		readers[i].lookups = lookups / threads;
+		pthread_create(&tids[i], NULL, reader_main, &readers[i]);
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	return bench_now() - start;
+}
+
+int main(void)
+{
+	static const char *impls[] = { "so", "so_cache", "libc" };
+	long lookups = (long)(LOOKUPS * bench_scale());
+	char path[256];
+	double best = 0;
+	double elapsed = 0;
+	int threads = 0;
+	int impl = 0;
+	int rep = 0;
+
+	bench_path(path, sizeof(path), "blockcache");
+	bench_make_file(path, FILE_BYTES);
+	for (threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		for (impl = 0; impl < 3; impl++) {
+			best = 1e30;
+			for (rep = 0; rep < BENCH_REPS; rep++) {
+				elapsed = run_blockcache(path, impl, threads,
+					lookups);
+				if (elapsed < best)
+					best = elapsed;
+			}
+			bench_report("blockcache", impls[impl], threads,
+				lookups / threads * threads / best * 1e3,
+				"Mlookups/s");
+		}
+	}
+	so_setblockcache(0, 0);
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,113 @@
+/*
+ * Bulk I/O: so_fread/so_fwrite against fread/fwrite and read/write,
+ * for request sizes from 1 B to 16 MiB (powers of 4)
+ */
+#include "bench_common.h"
+
+#define TOTAL_BYTES	(64L << 20)
+#define SMALL_BYTES	(8L << 20)
+#define MAX_REQUEST	(16L << 20)
+
+static char path[256];
+
+static double run_write(int impl, char *buf, long size, long total)
+{
+	double start = bench_now();
+	SO_FILE *so = NULL;
+	FILE *libc = NULL;
+	long done = 0;
+	int fd = -1;
+
+	if (impl == 0) {
+		so = so_fopen(path, "w");
+		for (done = 0; done < total; done += size)
+			so_fwrite(buf, 1, size, so);
+		so_fclose(so);
+	} else if (impl == 1) {
+		libc = fopen(path, "w");
+		for (done = 0; done < total; done += size)
+			fwrite(buf, 1, size, libc);
+		fclose(libc);
+	} else {
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		for (done = 0; done < total; done += size)
+			if (write(fd, buf, size) != size)
+				break;
+		close(fd);
+	}
+	return bench_now() - start;
+}
+
+static double run_read(int impl, char *buf, long size, long total)
+{
+	double start = bench_now();
+	SO_FILE *so = NULL;
+	FILE *libc = NULL;
+	long done = 0;
+	int fd = -1;
+
+	if (impl == 0) {
+		so = so_fopen(path, "r");
+		for (done = 0; done < total; done += size)
+			so_fread(buf, 1, size, so);
+		so_fclose(so);
+	} else if (impl == 1) {
+		libc = fopen(path, "r");
+		for (done = 0; done < total; done += size)
+			if (fread(buf, 1, size, libc) != (size_t)size)
+				break;
+		fclose(libc);
+	} else {
+		fd = open(path, O_RDONLY);
+		for (done = 0; done < total; done += size)
+			if (read(fd, buf, size) <= 0)
+				break;
+		close(fd);
+	}
+	return bench_now() - start;
+}
+
+int main(void)
+{
+	static const char *impls[] = { "so", "libc", "raw" };
+	char *buf = malloc(MAX_REQUEST);
+	double best = 0;
+	double elapsed = 0;
+	long size = 0;
+	long total = 0;
+	int impl = 0;
+	int rep = 0;
+
+	bench_path(path, sizeof(path), "bulk");
+	memset(buf, 'x', MAX_REQUEST);
+	for (size = 1; size <= MAX_REQUEST; size *= 4) {
+		/* keep per-call overhead of tiny requests bounded */
+		total = (size < 64 ? SMALL_BYTES : TOTAL_BYTES) * bench_scale();
+		if (total < size)
+			total = size;
+		for (impl = 0; impl < 3; impl++) {
+			if (impl == 2 && size < 64)
+				continue;
+			best = 1e30;
+			for (rep = 0; rep < BENCH_REPS; rep++) {
+				elapsed = run_write(impl, buf, size, total);
+				if (elapsed < best)
+					best = elapsed;
+			}
+			bench_report("fwrite", impls[impl], size,
+				total / best * 1e3, "MB/s");
+
+			best = 1e30;
+			for (rep = 0; rep < BENCH_REPS; rep++) {
+				elapsed = run_read(impl, buf, size, total);
+				if (elapsed < best)
+					best = elapsed;
+			}
+			bench_report("fread", impls[impl], size,
+				total / best * 1e3, "MB/s");
+		}
+	}
+	remove(path);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Per-byte I/O: so_fgetc/so_fputc against getc/putc and one-byte
+ * read/write system calls
+ */
+#include "bench_common.h"
+
+#define BYTE_OPS	(8L << 20)
+#define RAW_OPS		(256L << 10)
+
+static char path[256];
+
+static void bench_putc(long ops)
+{
+	double best[3] = { 1e30, 1e30, 1e30 };
+	double start = 0;
+	SO_FILE *so = NULL;
+	FILE *libc = NULL;
+	long raw_ops = RAW_OPS;
+	long i = 0;
+	int fd = -1;
+	int rep = 0;
+	char c = 'x';
+
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		so = so_fopen(path, "w");
+		start = bench_now();
+		for (i = 0; i < ops; i++)
+			so_fputc('a' + i % 26, so);
+		so_fclose(so);
+		if (bench_now() - start < best[0])
+			best[0] = bench_now() - start;
+
+		libc = fopen(path, "w");
+		start = bench_now();
+		for (i = 0; i < ops; i++)
+			putc('a' + i % 26, libc);
+		fclose(libc);
+		if (bench_now() - start < best[1])
+			best[1] = bench_now() - start;
+
+		fd = open(path, O_WRONLY | O_TRUNC);
+		start = bench_now();
+		for (i = 0; i < raw_ops; i++)
+			if (write(fd, &c, 1) != 1)
+				break;
+		close(fd);
+		if (bench_now() - start < best[2])
+			best[2] = bench_now() - start;
+	}
+	bench_report("fputc", "so", 1, best[0] / ops, "ns/op");
+	bench_report("fputc", "libc", 1, best[1] / ops, "ns/op");
+	bench_report("fputc", "raw", 1, best[2] / raw_ops, "ns/op");
+}
+
+static void bench_getc(long ops)
+{
+	double best[3] = { 1e30, 1e30, 1e30 };
+	double start = 0;
+	SO_FILE *so = NULL;
+	FILE *libc = NULL;
+	long raw_ops = RAW_OPS;
+	long sum = 0;
+	long i = 0;
+	int fd = -1;
+	int rep = 0;
+	char c = 0;
+
+	bench_make_file(path, ops);
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		so = so_fopen(path, "r");
+		start = bench_now();
+		for (i = 0; i < ops; i++)
+			sum += so_fgetc(so);
+		if (bench_now() - start < best[0])
+			best[0] = bench_now() - start;
+		so_fclose(so);
+
+		libc = fopen(path, "r");
+		start = bench_now();
+		for (i = 0; i < ops; i++)
+			sum += getc(libc);
+		if (bench_now() - start < best[1])
+			best[1] = bench_now() - start;
+		fclose(libc);
+
+		fd = open(path, O_RDONLY);
+		start = bench_now();
+		for (i = 0; i < raw_ops; i++)
+			if (read(fd, &c, 1) == 1)
+				sum += c;
+		if (bench_now() - start < best[2])
+			best[2] = bench_now() - start;
+		close(fd);
+	}
+	bench_sink = sum;
+	bench_report("fgetc", "so", 1, best[0] / ops, "ns/op");
+	bench_report("fgetc", "libc", 1, best[1] / ops, "ns/op");
+	bench_report("fgetc", "raw", 1, best[2] / raw_ops, "ns/op");
+}
+
+int main(void)
+{
+	long ops = BYTE_OPS * bench_scale();
+
+	bench_path(path, sizeof(path), "bytes");
+	bench_putc(ops);
+	bench_getc(ops);
+	remove(path);
+	return 0;
+}
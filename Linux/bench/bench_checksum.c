@@ -0,0 +1,68 @@
+/*
+ * Checksummed writes: writing a file in 64 KiB requests plainly
+ * (so), with the stream checksum on (so_crc), and plainly then
+ * reading it back with the checksum on to verify it (so_reread),
+ * as callers had to before; throughput is that of the data written
+ * The implementations take turns, so they share the same writeback
+ * of earlier runs
+ */
+#include "bench_common.h"
+
+#define TOTAL_BYTES	(64L << 20)
+#define REQUEST		(64 << 10)
+
+static char path[256];
+
+static double run_checksum(int impl, char *data, long total)
+{
+	double start = bench_now();
+	SO_FILE *so = so_fopen(path, "w");
+	long done = 0;
+
+	if (impl == 1)
+		so_setchecksum(so, 1);
+	for (done = 0; done < total; done += REQUEST)
+		so_fwrite(data + done, 1, REQUEST, so);
+	bench_sink = so_fchecksum(so);
+	so_fclose(so);
+
+	if (impl == 2) {
+		so = so_fopen(path, "r");
+		so_setchecksum(so, 1);
+		for (done = 0; done < total; done += REQUEST)
+			so_fread(data + done, 1, REQUEST, so);
+		bench_sink = so_fchecksum(so);
+		so_fclose(so);
+	}
+	return bench_now() - start;
+}
+
+int main(void)
+{
+	static const char *impls[] = { "so", "so_crc", "so_reread" };
+	long total = (long)(TOTAL_BYTES * bench_scale()) / REQUEST * REQUEST;
+	char *data = malloc(total);
+	double best[3] = { 1e30, 1e30, 1e30 };
+	double elapsed = 0;
+	long i = 0;
+	int impl = 0;
+	int rep = 0;
+
+	for (i = 0; i < total; i++)
+		data[i] = i * 2654435761u >> 24;
+
+	bench_path(path, sizeof(path), "checksum");
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		for (impl = 0; impl < 3; impl++) {
+			elapsed = run_checksum(impl, data, total);
+			if (elapsed < best[impl])
+				best[impl] = elapsed;
+		}
+	}
+	for (impl = 0; impl < 3; impl++)
+		bench_report("checksum", impls[impl], REQUEST,
+			total / (best[impl] / 1e9) / (1 << 20), "MB/s");
+	unlink(path);
+	free(data);
+	return 0;
+}
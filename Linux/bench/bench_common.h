@@ -0,0 +1,79 @@
+/*
+ * Helpers shared by the so_stdio benchmarks
+ *
+ * Every benchmark prints one CSV line per measurement,
+ * benchmark,implementation,parameter,value,unit
+ * where implementation is one of so (so_stdio), libc (glibc FILE*)
+ * or raw (plain system calls). Timings are the best of BENCH_REPS
+ * runs; BENCH_SCALE (environment, default 1) multiplies data sizes.
+ */
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "so_stdio.h"
+
+#define BENCH_REPS	3
+#define BENCH_DIR	"/tmp"
+
+static volatile long bench_sink;
+
+static inline double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline double bench_scale(void)
+{
+	const char *scale = getenv("BENCH_SCALE");
+
+	return scale != NULL && atof(scale) > 0 ? atof(scale) : 1;
+}
+
+static inline void bench_report(const char *bench, const char *impl,
+	long param, double value, const char *unit)
+{
+	printf("%s,%s,%ld,%.3f,%s\n", bench, impl, param, value, unit);
+	fflush(stdout);
+}
+
+/* Builds BENCH_DIR/so_bench_<name> into path */
+static inline void bench_path(char *path, size_t len, const char *name)
+{
+	snprintf(path, len, "%s/so_bench_%s", BENCH_DIR, name);
+}
+
+/* Writes size bytes of reproducible pseudo-random text to path */
+static inline void bench_make_file(const char *path, size_t size)
+{
+	static char block[1 << 16];
+	unsigned int state = 2463534242u;
+	size_t chunk = 0;
+	size_t i = 0;
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	for (i = 0; i < sizeof(block); i++) {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		block[i] = (state % 64 == 0) ? '\n' : 'a' + state % 26;
+	}
+	while (size > 0) {
+		chunk = size < sizeof(block) ? size : sizeof(block);
+		if (write(fd, block, chunk) != (ssize_t)chunk)
+			break;
+		size -= chunk;
+	}
+	close(fd);
+}
+
+#endif /* BENCH_COMMON_H */
@@ -0,0 +1,71 @@
+/*
+ * File to file copy: so_fcopy against a so_fread/so_fwrite loop and
+ * a fread/fwrite loop, both through a 64 KiB user buffer
+ */
+#include "bench_common.h"
+
+#define COPY_BYTES	(128L << 20)
+#define COPY_BUF	(64L << 10)
+
+static char src_path[256];
+static char dst_path[256];
+
+static double run_copy(int impl, char *buf)
+{
+	double start = bench_now();
+	SO_FILE *so_src = NULL;
+	SO_FILE *so_dst = NULL;
+	FILE *src = NULL;
+	FILE *dst = NULL;
+	size_t n = 0;
+
+	if (impl == 2) {
+		src = fopen(src_path, "r");
+		dst = fopen(dst_path, "w");
+		while ((n = fread(buf, 1, COPY_BUF, src)) > 0)
+			fwrite(buf, 1, n, dst);
+		fclose(src);
+		fclose(dst);
+		return bench_now() - start;
+	}
+
+	so_src = so_fopen(src_path, "r");
+	so_dst = so_fopen(dst_path, "w");
+	if (impl == 0)
+		so_fcopy(so_dst, so_src, (size_t)-1);
+	else
+		while ((n = so_fread(buf, 1, COPY_BUF, so_src)) > 0)
+			so_fwrite(buf, 1, n, so_dst);
+	so_fclose(so_src);
+	so_fclose(so_dst);
+	return bench_now() - start;
+}
+
+int main(void)
+{
+	static const char *impls[] = { "so", "so_rw", "libc" };
+	long total = COPY_BYTES * bench_scale();
+	char *buf = malloc(COPY_BUF);
+	double best = 0;
+	double elapsed = 0;
+	int impl = 0;
+	int rep = 0;
+
+	bench_path(src_path, sizeof(src_path), "copy_src");
+	bench_path(dst_path, sizeof(dst_path), "copy_dst");
+	bench_make_file(src_path, total);
+	for (impl = 0; impl < 3; impl++) {
+		best = 1e30;
+		for (rep = 0; rep < BENCH_REPS; rep++) {
+			elapsed = run_copy(impl, buf);
+			if (elapsed < best)
+				best = elapsed;
+		}
+		bench_report("fcopy", impls[impl], COPY_BUF,
+			total / best * 1e3, "MB/s");
+	}
+	remove(src_path);
+	remove(dst_path);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * Direct I/O: writing then reading back a file in 64 KiB requests,
+ * through plain "w"/"r" (so) and O_DIRECT "wd"/"rd" (so_direct)
+ * SO_FILEs
+ * Writes are timed until the data is on disk (fdatasync), and the
+ * file is dropped from the page cache before it is read, so both
+ * paths pay for the device; the buffered one also for the cache
+ */
+#include "bench_common.h"
+
+#define TOTAL_BYTES	(256L << 20)
+#define REQUEST		(64 << 10)
+
+static char path[256];
+
+static void drop_cache(void)
+{
+	int fd = open(path, O_RDONLY);
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+static double run_direct(int impl, int writing, char *data, long total)
+{
+	static const char *modes[2][2] = { { "r", "w" }, { "rd", "wd" } };
+	double start = 0;
+	SO_FILE *so = NULL;
+	long done = 0;
+
+	if (!writing)
+		drop_cache();
+	start = bench_now();
+	so = so_fopen(path, modes[impl][writing]);
+	for (done = 0; done < total; done += REQUEST) {
+		if (writing)
+			so_fwrite(data + done, 1, REQUEST, so);
+		else
+			so_fread(data + done, 1, REQUEST, so);
+	}
+	if (writing) {
+		so_fflush(so);
+		fdatasync(so_fileno(so));
+	}
+	so_fclose(so);
+	return bench_now() - start;
+}
+
+int main(void)
+{
+	static const char *impls[] = { "so", "so_direct" };
+	long total = (long)(TOTAL_BYTES * bench_scale()) / REQUEST * REQUEST;
+	char *data = malloc(total);
+	double best[2][2] = { { 1e30, 1e30 }, { 1e30, 1e30 } };
+	double elapsed = 0;
+	long i = 0;
+	int writing = 0;
+	int impl = 0;
+	int rep = 0;
+
+	for (i = 0; i < total; i++)
+		data[i] = i * 2654435761u >> 24;
+
+	bench_path(path, sizeof(path), "direct");
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		for (impl = 0; impl < 2; impl++) {
+			for (writing = 1; writing >= 0; writing--) {
+				elapsed = run_direct(impl, writing, data,
+					total);
+				if (elapsed < best[impl][writing])
+					best[impl][writing] = elapsed;
+			}
+		}
+	}
+	for (impl = 0; impl < 2; impl++) {
+		for (writing = 1; writing >= 0; writing--)
+			bench_report(writing ? "direct_write" : "direct_read",
+				impls[impl], REQUEST, total /
+				(best[impl][writing] / 1e9) / (1 << 20),
+				"MB/s");
+	}
+	unlink(path);
+	free(data);
+	return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * Fan-out: starting N children, the first of which sleeps before
+ * printing, and reading all of their output, multiplexed with
+ * so_popen_many and so_pgroup_next (so), or child after child with
+ * so_popen and so_fread (so_seq) or popen and fread (libc)
+ * fanout_mean is the mean time until the output of a child has
+ * been fully read, fanout_total the time until all of it was
+ */
+#include "bench_common.h"
+
+#define MAX_CHILDREN	128
+#define SEQ_COUNT	2000
+#define SLOW_MS		200
+
+static char chunk[1 << 16];
+static double done_sum;
+
+static double run_fanout(int impl, const char **cmds, int count)
+{
+	double start = bench_now();
+	SO_PGROUP *group = NULL;
+	SO_FILE *so[MAX_CHILDREN];
+	FILE *libc[MAX_CHILDREN];
+	size_t avail = 0;
+	size_t got = 0;
+	long total = 0;
+	int i = 0;
+
+	if (impl == 0) {
+		group = so_popen_many(cmds, count, "r");
+		while ((i = so_pgroup_next(group, -1, &avail)) != -1) {
+			total += so_fread(chunk, 1, avail,
+				so_pgroup_stream(group, i));
+			if (avail == 0)
+				done_sum += bench_now() - start;
+		}
+		so_pclose_all(group, NULL);
+	} else if (impl == 1) {
+		for (i = 0; i < count; i++)
+			so[i] = so_popen(cmds[i], "r");
+		for (i = 0; i < count; i++) {
+			while ((got = so_fread(chunk, 1, sizeof(chunk),
+				so[i])) > 0)
+				total += got;
+			done_sum += bench_now() - start;
+			so_pclose(so[i]);
+		}
+	} else {
+		for (i = 0; i < count; i++)
+			libc[i] = popen(cmds[i], "r");
+		for (i = 0; i < count; i++) {
+			while ((got = fread(chunk, 1, sizeof(chunk),
+				libc[i])) > 0)
+				total += got;
+			done_sum += bench_now() - start;
+			pclose(libc[i]);
+		}
+	}
+	bench_sink = total;
+	return bench_now() - start;
+}
+
+int main(void)
+{
+	static const char *impls[] = { "so", "so_seq", "libc" };
+	static char slow[96];
+	static char cmd[64];
+	const char *cmds[MAX_CHILDREN];
+	double best = 0;
+	double best_mean = 0;
+	double elapsed = 0;
+	int count = 0;
+	int impl = 0;
+	int rep = 0;
+	int i = 0;
+
+	snprintf(cmd, sizeof(cmd), "seq 1 %ld",
+		(long)(SEQ_COUNT * bench_scale()));
+	snprintf(slow, sizeof(slow), "sleep 0.%03d; %s", SLOW_MS, cmd);
+	cmds[0] = slow;
+	for (i = 1; i < MAX_CHILDREN; i++)
+		cmds[i] = cmd;
+
+	for (count = 8; count <= MAX_CHILDREN; count *= 4) {
+		for (impl = 0; impl < 3; impl++) {
+			best = 1e30;
+			best_mean = 1e30;
+			for (rep = 0; rep < BENCH_REPS; rep++) {
+				done_sum = 0;
+				elapsed = run_fanout(impl, cmds, count);
+				if (elapsed < best)
+					best = elapsed;
+				if (done_sum / count < best_mean)
+					best_mean = done_sum / count;
+			}
+			bench_report("fanout_mean", impls[impl], count,
+				best_mean / 1e6, "ms");
+			bench_report("fanout_total", impls[impl], count,
+				best / 1e6, "ms");
+		}
+	}
+	return 0;
+}
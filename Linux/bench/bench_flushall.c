@@ -0,0 +1,77 @@
+/*
+ * Checkpoints: N output files each get a 2 KiB record, then all of
+ * them are flushed, with so_fflush_all (so, one io_uring batch on
+ * machines with several processors) or so_fflush on each in turn
+ * (so_seq)
+ * flushall reports the time of one checkpoint flush
+ */
+#include "bench_common.h"
+
+#define MAX_FILES	256
+#define CHECKPOINTS	50
+#define RECORD		2048
+
+static SO_FILE *files[MAX_FILES];
+
+static double run_flushall(int impl, int count, const char *record)
+{
+	double total = 0;
+	double start = 0;
+	int round = 0;
+	int i = 0;
+
+	for (round = 0; round < CHECKPOINTS; round++) {
+		for (i = 0; i < count; i++)
+			so_fwrite(record, 1, RECORD, files[i]);
+		start = bench_now();
+		if (impl == 0) {
+			so_fflush_all();
+		} else {
+			for (i = 0; i < count; i++)
+				so_fflush(files[i]);
+		}
+		total += bench_now() - start;
+	}
+	return total / CHECKPOINTS;
+}
+
+int main(void)
+{
+	static const char *impls[] = { "so", "so_seq" };
+	static char record[RECORD];
+	char path[256];
+	char name[32];
+	double best[2] = { 0, 0 };
+	double elapsed = 0;
+	int count = 0;
+	int impl = 0;
+	int rep = 0;
+	int i = 0;
+
+	memset(record, 'r', RECORD);
+	for (count = 16; count <= MAX_FILES; count *= 16) {
+		for (i = 0; i < count; i++) {
+			snprintf(name, sizeof(name), "flushall_%d", i);
+			bench_path(path, sizeof(path), name);
+			files[i] = so_fopen(path, "w");
+		}
+		best[0] = best[1] = 1e30;
+		for (rep = 0; rep < BENCH_REPS; rep++) {
+			for (impl = 0; impl < 2; impl++) {
+				elapsed = run_flushall(impl, count, record);
+				if (elapsed < best[impl])
+					best[impl] = elapsed;
+			}
+		}
+		for (impl = 0; impl < 2; impl++)
+			bench_report("flushall", impls[impl], count,
+				best[impl] / 1e3, "us");
+		for (i = 0; i < count; i++) {
+			so_fclose(files[i]);
+			snprintf(name, sizeof(name), "flushall_%d", i);
+			bench_path(path, sizeof(path), name);
+			unlink(path);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,123 @@
+/*
+ * Cost of the per-stream lock: single-threaded locked vs _unlocked
+ * calls, then several threads appending records to one shared
+ * SO_FILE, checking that no record was torn
+ */
+#include <pthread.h>
+
+#include "bench_common.h"
+
+#define BYTE_OPS	(16 << 20)
+#define RECORD_SIZE	64
+#define RECORDS		(1 << 18)
+#define MAX_THREADS	8
+
+static char path[256];
+
+static void bench_bytes(int unlocked)
+{
+	const char *impl = unlocked ? "so_unlocked" : "so_locked";
+	SO_FILE *f = so_fopen(path, "w+");
+	double start = 0;
+	long i = 0;
+	int sum = 0;
+
+	start = bench_now();
+	for (i = 0; i < BYTE_OPS; i++)
+		if (unlocked)
+			so_fputc_unlocked(i, f);
+		else
+			so_fputc(i, f);
+	bench_report("fputc", impl, 1, (bench_now() - start) / BYTE_OPS,
+		"ns/op");
+
+	so_fseek(f, 0, SEEK_SET);
+	start = bench_now();
+	for (i = 0; i < BYTE_OPS; i++)
+		sum += unlocked ? so_fgetc_unlocked(f) : so_fgetc(f);
+	bench_report("fgetc", impl, 1, (bench_now() - start) / BYTE_OPS,
+		"ns/op");
+
+	so_fclose(f);
+	bench_sink = sum;
+}
+
+struct writer {
+	SO_FILE *f;
+	int id;
+	int records;
+};
+
+static void *writer_main(void *arg)
+{
+	struct writer *w = arg;
+	char record[RECORD_SIZE];
+	int i = 0;
+
+	memset(record, 'a' + w->id, RECORD_SIZE - 1);
+	record[RECORD_SIZE - 1] = '\n';
+	for (i = 0; i < w->records; i++)
+		so_fwrite(record, 1, RECORD_SIZE, w->f);
+	return NULL;
+}
+
+/* Returns the number of torn records in the file */
+static long check_records(long expected)
+{
+	SO_FILE *f = so_fopen(path, "r");
+	char record[RECORD_SIZE];
+	long count = 0;
+	long torn = 0;
+	int i = 0;
+
+	while (so_fread(record, 1, RECORD_SIZE, f) == RECORD_SIZE) {
+		for (i = 1; i < RECORD_SIZE - 1; i++)
+			if (record[i] != record[0])
+				break;
+		if (i != RECORD_SIZE - 1 || record[RECORD_SIZE - 1] != '\n')
+			torn++;
+		count++;
+	}
+	so_fclose(f);
+	return torn + (expected - count);
+}
+
+static void bench_threads(int threads)
+{
+	struct writer writers[MAX_THREADS];
+	pthread_t tids[MAX_THREADS];
+	SO_FILE *f = so_fopen(path, "w");
+	double start = 0;
+	double elapsed = 0;
+	int i = 0;
+
+	start = bench_now();
+	for (i = 0; i < threads; i++) {
+		writers[i].f = f;
+		writers[i].id = i;
+		writers[i].records = RECORDS / threads;
+		pthread_create(&tids[i], NULL, writer_main, &writers[i]);
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	so_fclose(f);
+	elapsed = bench_now() - start;
+
+	bench_report("shared_fwrite", "so_locked", threads,
+		(RECORDS / threads * threads) / elapsed * 1e3, "Mrecords/s");
+	bench_report("shared_fwrite_torn", "so_locked", threads,
+		check_records(RECORDS / threads * threads), "records");
+}
+
+int main(void)
+{
+	int threads = 0;
+
+	bench_path(path, sizeof(path), "lock");
+	bench_bytes(0);
+	bench_bytes(1);
+	for (threads = 1; threads <= MAX_THREADS; threads *= 2)
+		bench_threads(threads);
+	remove(path);
+	return 0;
+}
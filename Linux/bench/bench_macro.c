@@ -0,0 +1,111 @@
+/*
+ * Whole-task workloads: counting lines of a text file character by
+ * character, and copying a file in 64 KiB chunks
+ */
+#include "bench_common.h"
+
+#define FILE_BYTES	(64L << 20)
+#define CHUNK		(64L << 10)
+
+static char src[256];
+static char dst[256];
+
+static double run_wc(int impl)
+{
+	double start = bench_now();
+	SO_FILE *so = NULL;
+	FILE *libc = NULL;
+	long lines = 0;
+	int c = 0;
+
+	if (impl == 0) {
+		so = so_fopen(src, "r");
+		while ((c = so_fgetc(so)) != SO_EOF)
+			lines += c == '\n';
+		so_fclose(so);
+	} else {
+		libc = fopen(src, "r");
+		while ((c = getc(libc)) != EOF)
+			lines += c == '\n';
+		fclose(libc);
+	}
+	bench_sink = lines;
+	return bench_now() - start;
+}
+
+static double run_copy(int impl, char *buf)
+{
+	double start = bench_now();
+	SO_FILE *so_in = NULL;
+	SO_FILE *so_out = NULL;
+	FILE *in = NULL;
+	FILE *out = NULL;
+	ssize_t n = 0;
+	int fd_in = -1;
+	int fd_out = -1;
+
+	if (impl == 0) {
+		so_in = so_fopen(src, "r");
+		so_out = so_fopen(dst, "w");
+		while ((n = so_fread(buf, 1, CHUNK, so_in)) > 0)
+			so_fwrite(buf, 1, n, so_out);
+		so_fclose(so_out);
+		so_fclose(so_in);
+	} else if (impl == 1) {
+		in = fopen(src, "r");
+		out = fopen(dst, "w");
+		while ((n = fread(buf, 1, CHUNK, in)) > 0)
+			fwrite(buf, 1, n, out);
+		fclose(out);
+		fclose(in);
+	} else {
+		fd_in = open(src, O_RDONLY);
+		fd_out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		while ((n = read(fd_in, buf, CHUNK)) > 0)
+			if (write(fd_out, buf, n) != n)
+				break;
+		close(fd_out);
+		close(fd_in);
+	}
+	return bench_now() - start;
+}
+
+int main(void)
+{
+	static const char *impls[] = { "so", "libc", "raw" };
+	long size = FILE_BYTES * bench_scale();
+	char *buf = malloc(CHUNK);
+	double best = 0;
+	double elapsed = 0;
+	int impl = 0;
+	int rep = 0;
+
+	bench_path(src, sizeof(src), "macro_src");
+	bench_path(dst, sizeof(dst), "macro_dst");
+	bench_make_file(src, size);
+	for (impl = 0; impl < 3; impl++) {
+		if (impl < 2) {
+			best = 1e30;
+			for (rep = 0; rep < BENCH_REPS; rep++) {
+				elapsed = run_wc(impl);
+				if (elapsed < best)
+					best = elapsed;
+			}
+			bench_report("wc_lines", impls[impl], size,
+				size / best * 1e3, "MB/s");
+		}
+
+		best = 1e30;
+		for (rep = 0; rep < BENCH_REPS; rep++) {
+			elapsed = run_copy(impl, buf);
+			if (elapsed < best)
+				best = elapsed;
+		}
+		bench_report("copy", impls[impl], size,
+			size / best * 1e3, "MB/s");
+	}
+	remove(dst);
+	remove(src);
+	free(buf);
+	return 0;
+}
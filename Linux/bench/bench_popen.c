@@ -0,0 +1,108 @@
+/*
+ * Pipe throughput: stream data to and from a child process with
+ * so_popen, popen, and read/write on the pipe of a popen stream
+ * so_pipe is so_popen with a PIPE_SIZE pipe set by so_setpipe,
+ * writing with vmsplice and reading by splicing into /dev/null
+ * through so_fcopy
+ */
+#include "bench_common.h"
+
+#define PIPE_BYTES	(256L << 20)
+#define CHUNK		(64L << 10)
+#define PIPE_SIZE	(1L << 20)
+
+static double run_write(int impl, char *buf, long total)
+{
+	const char *cmd = "cat > /dev/null";
+	double start = bench_now();
+	SO_FILE *so = NULL;
+	FILE *libc = NULL;
+	long done = 0;
+
+	if (impl == 0 || impl == 3) {
+		so = so_popen(cmd, "w");
+		if (impl == 3)
+			so_setpipe(so, PIPE_SIZE, SO_PIPE_VMSPLICE);
+		for (done = 0; done < total; done += CHUNK)
+			so_fwrite(buf, 1, CHUNK, so);
+		so_pclose(so);
+	} else {
+		libc = popen(cmd, "w");
+		for (done = 0; done < total; done += CHUNK)
+			if (impl == 1)
+				fwrite(buf, 1, CHUNK, libc);
+			else if (write(fileno(libc), buf, CHUNK) != CHUNK)
+				break;
+		pclose(libc);
+	}
+	return bench_now() - start;
+}
+
+static double run_read(int impl, char *buf, long total)
+{
+	char cmd[128];
+	double start = bench_now();
+	SO_FILE *so = NULL;
+	SO_FILE *sink = NULL;
+	FILE *libc = NULL;
+	ssize_t ret = 0;
+
+	snprintf(cmd, sizeof(cmd), "head -c %ld /dev/zero", total);
+	if (impl == 0) {
+		so = so_popen(cmd, "r");
+		while (so_fread(buf, 1, CHUNK, so) > 0)
+			;
+		so_pclose(so);
+	} else if (impl == 3) {
+		so = so_popen(cmd, "r");
+		sink = so_fopen("/dev/null", "w");
+		so_setpipe(so, PIPE_SIZE, 0);
+		so_fcopy(sink, so, (size_t)-1);
+		so_fclose(sink);
+		so_pclose(so);
+	} else {
+		libc = popen(cmd, "r");
+		do {
+			if (impl == 1)
+				ret = fread(buf, 1, CHUNK, libc);
+			else
+				ret = read(fileno(libc), buf, CHUNK);
+		} while (ret > 0);
+		pclose(libc);
+	}
+	return bench_now() - start;
+}
+
+int main(void)
+{
+	static const char *impls[] = { "so", "libc", "raw", "so_pipe" };
+	long total = PIPE_BYTES * bench_scale();
+	char *buf = malloc(CHUNK);
+	double best = 0;
+	double elapsed = 0;
+	int impl = 0;
+	int rep = 0;
+
+	memset(buf, 'x', CHUNK);
+	for (impl = 0; impl < 4; impl++) {
+		best = 1e30;
+		for (rep = 0; rep < BENCH_REPS; rep++) {
+			elapsed = run_write(impl, buf, total);
+			if (elapsed < best)
+				best = elapsed;
+		}
+		bench_report("popen_write", impls[impl], CHUNK,
+			total / best * 1e3, "MB/s");
+
+		best = 1e30;
+		for (rep = 0; rep < BENCH_REPS; rep++) {
+			elapsed = run_read(impl, buf, total);
+			if (elapsed < best)
+				best = elapsed;
+		}
+		bench_report("popen_read", impls[impl], CHUNK,
+			total / best * 1e3, "MB/s");
+	}
+	free(buf);
+	return 0;
+}
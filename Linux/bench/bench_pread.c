@@ -0,0 +1,107 @@
+/*
+ * Random access: threads looking up 4 KiB records at random offsets
+ * of one shared 64 MiB SO_FILE, with so_fpread on "r" (so) and "rm"
+ * (so_map) SO_FILEs, with so_fseek + so_fread under so_flockfile
+ * (so_seek), and with pread on a file descr (raw)
+ * pread reports the lookups per second of all the threads
+ */
+#include <pthread.h>
+
+#include "bench_common.h"
+
+#define FILE_BYTES	(64L << 20)
+#define RECORD		4096
+#define LOOKUPS		(1 << 16)
+#define MAX_THREADS	8
+
+struct reader {
+	SO_FILE *f;
+	int fd;
+	int impl;
+	unsigned int seed;
+	long lookups;
+};
+
+static void *reader_main(void *arg)
+{
+	struct reader *r = arg;
+	char record[RECORD];
+	long records = FILE_BYTES / RECORD;
+	long offset = 0;
+	long i = 0;
+	long sum = 0;
+
+	for (i = 0; i < r->lookups; i++) {
+		r->seed = r->seed * 1103515245 + 12345;
+		offset = (r->seed >> 8) % records * RECORD;
+		if (r->impl == 2) {
+			so_flockfile(r->f);
+			so_fseek(r->f, offset, SEEK_SET);
+			so_fread(record, 1, RECORD, r->f);
+			so_funlockfile(r->f);
+		} else if (r->impl == 3) {
+			pread(r->fd, record, RECORD, offset);
+		} else {
+			so_fpread(r->f, record, RECORD, offset);
+		}
+		sum += record[0];
+	}
+	bench_sink = sum;
+	return NULL;
+}
+
+static double run_pread(const char *path, int impl, int threads,
+	long lookups)
+{
+	struct reader readers[MAX_THREADS];
+	pthread_t tids[MAX_THREADS];
+	SO_FILE *f = so_fopen(path, impl == 1 ? "rm" : "r");
+	double start = 0;
+	int i = 0;
+
+	start = bench_now();
+	for (i = 0; i < threads; i++) {
+		readers[i].f = f;
+		readers[i].fd = so_fileno(f);
+		readers[i].impl = impl;
+		readers[i].seed = 2463534242u + i;
+		readers[i].lookups = lookups / threads;
+		pthread_create(&tids[i], NULL, reader_main, &readers[i]);
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	start = bench_now() - start;
+	so_fclose(f);
+	return start;
+}
+
+int main(void)
+{
+	static const char *impls[] = { "so", "so_map", "so_seek", "raw" };
+	long lookups = (long)(LOOKUPS * bench_scale());
+	char path[256];
+	double best = 0;
+	double elapsed = 0;
+	int threads = 0;
+	int impl = 0;
+	int rep = 0;
+
+	bench_path(path, sizeof(path), "pread");
+	bench_make_file(path, FILE_BYTES);
+	for (threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		for (impl = 0; impl < 4; impl++) {
+			best = 1e30;
+			for (rep = 0; rep < BENCH_REPS; rep++) {
+				elapsed = run_pread(path, impl, threads,
+					lookups);
+				if (elapsed < best)
+					best = elapsed;
+			}
+			bench_report("pread", impls[impl], threads,
+				lookups / threads * threads / best * 1e3,
+				"Mlookups/s");
+		}
+	}
+	unlink(path);
+	return 0;
+}
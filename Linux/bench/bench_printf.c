@@ -0,0 +1,67 @@
+/*
+ * Formatted output: metrics lines written with so_fprintf against
+ * fprintf and against the snprintf + so_fwrite pattern (reported
+ * as implementation so_copy)
+ */
+#include "bench_common.h"
+
+#define LINE_OPS	(2L << 20)
+#define LINE_FMT	"metric_%d{host=\"%s\"} %ld %.3f\n"
+
+static char path[256];
+
+static void bench_lines(long ops)
+{
+	double best[3] = { 1e30, 1e30, 1e30 };
+	double start = 0;
+	SO_FILE *so = NULL;
+	FILE *libc = NULL;
+	char line[128];
+	long i = 0;
+	int len = 0;
+	int rep = 0;
+
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		so = so_fopen(path, "w");
+		start = bench_now();
+		for (i = 0; i < ops; i++)
+			so_fprintf(so, LINE_FMT, (int)(i % 64), "node-7",
+				i * 7919, i / 1024.0);
+		so_fclose(so);
+		if (bench_now() - start < best[0])
+			best[0] = bench_now() - start;
+
+		libc = fopen(path, "w");
+		start = bench_now();
+		for (i = 0; i < ops; i++)
+			fprintf(libc, LINE_FMT, (int)(i % 64), "node-7",
+				i * 7919, i / 1024.0);
+		fclose(libc);
+		if (bench_now() - start < best[1])
+			best[1] = bench_now() - start;
+
+		so = so_fopen(path, "w");
+		start = bench_now();
+		for (i = 0; i < ops; i++) {
+			len = snprintf(line, sizeof(line), LINE_FMT,
+				(int)(i % 64), "node-7", i * 7919, i / 1024.0);
+			so_fwrite(line, 1, len, so);
+		}
+		so_fclose(so);
+		if (bench_now() - start < best[2])
+			best[2] = bench_now() - start;
+	}
+	bench_report("fprintf", "so", 1, best[0] / ops, "ns/op");
+	bench_report("fprintf", "libc", 1, best[1] / ops, "ns/op");
+	bench_report("fprintf", "so_copy", 1, best[2] / ops, "ns/op");
+}
+
+int main(void)
+{
+	long ops = LINE_OPS * bench_scale();
+
+	bench_path(path, sizeof(path), "printf");
+	bench_lines(ops);
+	remove(path);
+	return 0;
+}
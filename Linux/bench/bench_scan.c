@@ -0,0 +1,98 @@
+/*
+ * Formatted input: numeric text parsed with so_fscanf against
+ * fscanf and against pulling each byte through so_fgetc and
+ * parsing by hand (reported as implementation so_fgetc)
+ */
+#include "bench_common.h"
+
+#define SCAN_LINES	(1L << 20)
+
+static char path[256];
+
+static void make_numbers(long lines)
+{
+	FILE *out = fopen(path, "w");
+	unsigned int state = 2463534242u;
+	long i = 0;
+
+	for (i = 0; i < lines; i++) {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		fprintf(out, "%u %ld %.4f\n", state % 100000,
+			(long)state * 7919, (state % 1000000) / 997.0);
+	}
+	fclose(out);
+}
+
+/* Parses an unsigned decimal number, skipping leading whitespace */
+static long parse_fgetc(SO_FILE *so)
+{
+	long value = 0;
+	int c = 0;
+
+	do {
+		c = so_fgetc(so);
+	} while (c == ' ' || c == '\n');
+	while (c >= '0' && c <= '9') {
+		value = value * 10 + c - '0';
+		c = so_fgetc(so);
+	}
+	return value;
+}
+
+static void bench_numbers(long lines)
+{
+	double best[3] = { 1e30, 1e30, 1e30 };
+	double start = 0;
+	double d = 0;
+	SO_FILE *so = NULL;
+	FILE *libc = NULL;
+	long sum = 0;
+	long l = 0;
+	long i = 0;
+	int rep = 0;
+	int u = 0;
+
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		so = so_fopen(path, "r");
+		start = bench_now();
+		while (so_fscanf(so, "%d %ld %lf", &u, &l, &d) == 3)
+			sum += u + l + (long)d;
+		if (bench_now() - start < best[0])
+			best[0] = bench_now() - start;
+		so_fclose(so);
+
+		libc = fopen(path, "r");
+		start = bench_now();
+		while (fscanf(libc, "%d %ld %lf", &u, &l, &d) == 3)
+			sum += u + l + (long)d;
+		if (bench_now() - start < best[1])
+			best[1] = bench_now() - start;
+		fclose(libc);
+
+		/* integers only: the fractional part is read as two */
+		so = so_fopen(path, "r");
+		start = bench_now();
+		for (i = 0; i < 4 * lines; i++)
+			sum += parse_fgetc(so);
+		if (bench_now() - start < best[2])
+			best[2] = bench_now() - start;
+		so_fclose(so);
+	}
+	bench_sink = sum;
+	bench_report("fscanf", "so", 3, best[0] / lines, "ns/line");
+	bench_report("fscanf", "libc", 3, best[1] / lines, "ns/line");
+	bench_report("fscanf", "so_fgetc", 3, best[2] / lines, "ns/line");
+}
+
+int main(void)
+{
+	long lines = SCAN_LINES * bench_scale();
+
+	bench_path(path, sizeof(path), "scan");
+	make_numbers(lines);
+	bench_numbers(lines);
+	remove(path);
+	return 0;
+}
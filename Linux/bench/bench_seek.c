@@ -0,0 +1,86 @@
+/*
+ * Random access: seek to a pseudo-random offset, then read a small
+ * record, with so_fseek/so_fread, fseek/fread and pread
+ */
+#include "bench_common.h"
+
+#define FILE_BYTES	(64L << 20)
+#define LOOKUPS		(256L << 10)
+#define RECORD		64
+
+static char path[256];
+
+static double run(int impl, long lookups, long file_size)
+{
+	unsigned long state = 88172645463325252UL;
+	char record[RECORD];
+	double start = 0;
+	SO_FILE *so = NULL;
+	FILE *libc = NULL;
+	long offset = 0;
+	long sum = 0;
+	long i = 0;
+	int fd = -1;
+
+	if (impl == 0)
+		so = so_fopen(path, "r");
+	else if (impl == 1)
+		libc = fopen(path, "r");
+	else
+		fd = open(path, O_RDONLY);
+
+	start = bench_now();
+	for (i = 0; i < lookups; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		offset = state % (file_size - RECORD);
+		if (impl == 0) {
+			so_fseek(so, offset, SEEK_SET);
+			so_fread(record, 1, RECORD, so);
+		} else if (impl == 1) {
+			fseek(libc, offset, SEEK_SET);
+			if (fread(record, 1, RECORD, libc) != RECORD)
+				break;
+		} else if (pread(fd, record, RECORD, offset) != RECORD) {
+			break;
+		}
+		sum += record[0];
+	}
+	start = bench_now() - start;
+
+	if (impl == 0)
+		so_fclose(so);
+	else if (impl == 1)
+		fclose(libc);
+	else
+		close(fd);
+	bench_sink = sum;
+	return start;
+}
+
+int main(void)
+{
+	static const char *impls[] = { "so", "libc", "raw" };
+	long file_size = FILE_BYTES * bench_scale();
+	long lookups = LOOKUPS * bench_scale();
+	double best = 0;
+	double elapsed = 0;
+	int impl = 0;
+	int rep = 0;
+
+	bench_path(path, sizeof(path), "seek");
+	bench_make_file(path, file_size);
+	for (impl = 0; impl < 3; impl++) {
+		best = 1e30;
+		for (rep = 0; rep < BENCH_REPS; rep++) {
+			elapsed = run(impl, lookups, file_size);
+			if (elapsed < best)
+				best = elapsed;
+		}
+		bench_report("seek_read", impls[impl], RECORD,
+			best / lookups, "ns/op");
+	}
+	remove(path);
+	return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ * Spawn latency: so_popen (posix_spawn of /bin/sh), so_popenv
+ * (posix_spawn of the program itself, reported as so_argv), popen,
+ * and the fork + execl of /bin/sh so_popen used to do (raw), each
+ * followed by the matching pclose, while the parent holds a growing
+ * amount of touched memory
+ */
+#include "bench_common.h"
+#include <sys/wait.h>
+
+#define SPAWNS		200
+#define MAX_RSS_MB	1024
+
+static double run_spawn(int impl, long spawns)
+{
+	static char *argv[] = { "true", NULL };
+	double start = bench_now();
+	SO_FILE *so = NULL;
+	FILE *libc = NULL;
+	pid_t pid = -1;
+	long i = 0;
+
+	for (i = 0; i < spawns; i++) {
+		if (impl == 0) {
+			so = so_popen("true", "r");
+			so_pclose(so);
+		} else if (impl == 1) {
+			so = so_popenv("true", argv, "r");
+			so_pclose(so);
+		} else if (impl == 2) {
+			libc = popen("true", "r");
+			pclose(libc);
+		} else {
+			pid = fork();
+			if (pid == 0) {
+				execl("/bin/sh", "/bin/sh", "-c", "true", NULL);
+				_exit(127);
+			}
+			waitpid(pid, NULL, 0);
+		}
+	}
+	return bench_now() - start;
+}
+
+int main(void)
+{
+	static const char *impls[] = { "so", "so_argv", "libc", "raw" };
+	long spawns = SPAWNS * bench_scale();
+	char *ballast = NULL;
+	double best = 0;
+	double elapsed = 0;
+	long rss = 0;
+	int impl = 0;
+	int rep = 0;
+
+	for (rss = 0; rss <= MAX_RSS_MB; rss = rss == 0 ? 64 : rss * 4) {
+		/* touch every page, so fork has page tables to copy */
+		free(ballast);
+		ballast = malloc((rss << 20) + 1);
+		memset(ballast, 1, (rss << 20) + 1);
+		for (impl = 0; impl < 4; impl++) {
+			best = 1e30;
+			for (rep = 0; rep < BENCH_REPS; rep++) {
+				elapsed = run_spawn(impl, spawns);
+				if (elapsed < best)
+					best = elapsed;
+			}
+			bench_report("spawn", impls[impl], rss,
+				best / spawns / 1e3, "us/spawn");
+		}
+	}
+	bench_sink = ballast[0];
+	free(ballast);
+	return 0;
+}
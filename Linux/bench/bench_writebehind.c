@@ -0,0 +1,80 @@
+/*
+ * Write-behind: a request thread logging 100 byte lines at about
+ * 5 MB/s into a device that stalls, played by a pipe to a child
+ * that drains 512 KiB every 50 ms, through a 64 KiB buffer written
+ * on the caller thread (so) or by the write-behind thread (so_wb)
+ * writebehind_p99 and writebehind_max are the latencies of single
+ * so_fwrite calls, the tail the logging request sees
+ */
+#include "bench_common.h"
+
+#define LINES		20000
+#define LINE		100
+#define BURST		50
+#define BUFFER		(64 << 10)
+
+static const char *consumer =
+	"while sleep 0.05; do "
+	"[ \"$(head -c 524288 | wc -c)\" -gt 0 ] || exit 0; done";
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void run_writebehind(int impl, double *lat, long lines)
+{
+	static char buf[BUFFER];
+	struct timespec pause = { 0, 1000000 };
+	char line[LINE];
+	SO_FILE *so = so_popen(consumer, "w");
+	double start = 0;
+	long i = 0;
+
+	memset(line, 'x', LINE - 1);
+	line[LINE - 1] = '\n';
+	so_setvbuf(so, buf, SO_IOFBF, BUFFER);
+	if (impl == 1)
+		so_setwritebehind(so, 1);
+	for (i = 0; i < lines; i++) {
+		if (i % BURST == 0)
+			nanosleep(&pause, NULL);
+		start = bench_now();
+		so_fwrite(line, 1, LINE, so);
+		lat[i] = bench_now() - start;
+	}
+	so_pclose(so);
+}
+
+int main(void)
+{
+	static const char *impls[] = { "so", "so_wb" };
+	long lines = (long)(LINES * bench_scale());
+	double *lat = malloc(lines * sizeof(*lat));
+	double p99[2] = { 1e30, 1e30 };
+	double max[2] = { 1e30, 1e30 };
+	int impl = 0;
+	int rep = 0;
+
+	for (rep = 0; rep < BENCH_REPS; rep++) {
+		for (impl = 0; impl < 2; impl++) {
+			run_writebehind(impl, lat, lines);
+			qsort(lat, lines, sizeof(*lat), cmp_double);
+			if (lat[lines * 99 / 100] < p99[impl])
+				p99[impl] = lat[lines * 99 / 100];
+			if (lat[lines - 1] < max[impl])
+				max[impl] = lat[lines - 1];
+		}
+	}
+	for (impl = 0; impl < 2; impl++) {
+		bench_report("writebehind_p99", impls[impl], LINE,
+			p99[impl] / 1e3, "us");
+		bench_report("writebehind_max", impls[impl], LINE,
+			max[impl] / 1e3, "us");
+	}
+	free(lat);
+	return 0;
+}
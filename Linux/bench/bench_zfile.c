@@ -0,0 +1,71 @@
+/*
+ * Compressed streams: writing then reading back spill-like records
+ * (key=value lines) in 4 KiB requests, through plain "w"/"r" (so)
+ * and block compressed "wz"/"rz" (so_z) SO_FILEs
+ * zfile_size reports the bytes on disk per MiB of records, the
+ * only figure that matters where the disk is the bottleneck
+ */
+#include "bench_common.h"
+#include <sys/stat.h>
+
+#define TOTAL_BYTES	(64L << 20)
+#define REQUEST		4096
+
+static char path[256];
+
+static double run_zfile(int impl, int writing, char *data, long total)
+{
+	static const char *modes[2][2] = { { "r", "w" }, { "rz", "wz" } };
+	double start = bench_now();
+	SO_FILE *so = so_fopen(path, modes[impl][writing]);
+	long done = 0;
+
+	for (done = 0; done < total; done += REQUEST) {
+		if (writing)
+			so_fwrite(data + done, 1, REQUEST, so);
+		else
+			so_fread(data + done, 1, REQUEST, so);
+	}
+	so_fclose(so);
+	return bench_now() - start;
+}
+
+int main(void)
+{
+	static const char *impls[] = { "so", "so_z" };
+	long total = (long)(TOTAL_BYTES * bench_scale()) / REQUEST * REQUEST;
+	char *data = malloc(total + 64);
+	struct stat st;
+	double best = 0;
+	double elapsed = 0;
+	long done = 0;
+	int writing = 0;
+	int impl = 0;
+	int rep = 0;
+
+	for (done = 0; done < total; )
+		done += sprintf(data + done, "key=%08ld value=%ld state=%s\n",
+			done, done % 977, done % 3 ? "clean" : "dirty");
+
+	bench_path(path, sizeof(path), "zfile");
+	for (impl = 0; impl < 2; impl++) {
+		for (writing = 1; writing >= 0; writing--) {
+			best = 1e30;
+			for (rep = 0; rep < BENCH_REPS; rep++) {
+				elapsed = run_zfile(impl, writing, data, total);
+				if (elapsed < best)
+					best = elapsed;
+			}
+			bench_report(writing ? "zfile_write" : "zfile_read",
+				impls[impl], REQUEST,
+				total / (best / 1e9) / (1 << 20), "MB/s");
+		}
+		stat(path, &st);
+		bench_report("zfile_size", impls[impl], REQUEST,
+			(double)st.st_size / (total >> 20) / 1024,
+			"KB/MB");
+	}
+	unlink(path);
+	free(data);
+	return 0;
+}
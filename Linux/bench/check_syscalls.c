@@ -0,0 +1,208 @@
+/*
+ * Checks the exact number of read and lseek calls so_fstats counts
+ * for so_fopen, EOF detection and seeks inside the read buffer, and
+ * that seeking inside the buffer keeps the data right: after a
+ * large direct read, on a SO_FILE writing next, and once the
+ * block cache is no longer used after a seek through it; and the
+ * write calls of so_fprintf on an unbuffered SO_FILE
+ * Prints one line per check; exits with 1 if any failed
+ */
+#include "bench_common.h"
+
+#define FILE_BYTES	16384
+
+static char path[256];
+static unsigned char ref[FILE_BYTES];
+static int failed;
+
+static void check(const char *name, int ok)
+{
+	printf("%s: %s\n", name, ok ? "ok" : "FAILED");
+	if (!ok)
+		failed = 1;
+}
+
+static void write_ref(long size)
+{
+	SO_FILE *f = so_fopen(path, "w");
+
+	so_fwrite(ref, 1, size, f);
+	so_fclose(f);
+}
+
+static void check_fopen(void)
+{
+	SO_FILE *f = so_fopen(path, "r");
+	struct so_stats st;
+
+	so_fstats(f, &st);
+	check("fopen makes no read or lseek",
+		st.read_calls == 0 && st.seeks == 0);
+	so_fclose(f);
+}
+
+static void check_eof(void)
+{
+	unsigned char buf[100];
+	SO_FILE *f = NULL;
+	struct so_stats st;
+	int ok = 0;
+
+	write_ref(100);
+	f = so_fopen(path, "r");
+	ok = so_fread(buf, 1, 100, f) == 100 && !so_feof(f);
+	so_fstats(f, &st);
+	check("reading the whole file takes one read",
+		ok && st.read_calls == 1);
+	ok = so_fgetc(f) == SO_EOF && so_feof(f);
+	so_fstats(f, &st);
+	check("EOF is found by one more read returning 0",
+		ok && st.read_calls == 2 && st.seeks == 0);
+	so_fclose(f);
+}
+
+static void check_window(void)
+{
+	SO_FILE *f = NULL;
+	struct so_stats st;
+	int ok = 1;
+	int i = 0;
+
+	write_ref(FILE_BYTES);
+	f = so_fopen(path, "r");
+	so_fgetc(f);
+	so_fgetc(f);
+	for (i = 0; i < 1000; i++) {
+		so_fseek(f, -1, SEEK_CUR);
+		if (so_fgetc(f) != ref[1])
+			ok = 0;
+	}
+	if (so_fseek(f, 4000, SEEK_SET) != 0 || so_fgetc(f) != ref[4000] ||
+		so_fseek(f, 0, SEEK_SET) != 0 || so_fgetc(f) != ref[0])
+		ok = 0;
+	so_fstats(f, &st);
+	check("seeks inside the buffer make no read or lseek",
+		ok && st.read_calls == 1 && st.seeks == 0);
+
+	ok = so_fseek(f, 5000, SEEK_SET) == 0 && so_fgetc(f) == ref[5000];
+	so_fstats(f, &st);
+	check("a seek past the buffer makes one lseek and one read",
+		ok && st.read_calls == 2 && st.seeks == 1);
+	so_fclose(f);
+}
+
+static void check_after_direct_read(void)
+{
+	unsigned char buf[8192];
+	SO_FILE *f = so_fopen(path, "r");
+	int ok = 0;
+
+	ok = so_fread(buf, 1, 10, f) == 10 &&
+		so_fread(buf, 1, sizeof(buf), f) == sizeof(buf) &&
+		!memcmp(buf, ref + 10, sizeof(buf)) &&
+		so_fseek(f, 5000, SEEK_SET) == 0 &&
+		so_fgetc(f) == ref[5000];
+	check("a seek after a direct read finds the right byte", ok);
+	so_fclose(f);
+}
+
+static void check_write_after_seek(void)
+{
+	unsigned char buf[FILE_BYTES];
+	unsigned char got[FILE_BYTES + 1];
+	SO_FILE *f = NULL;
+	struct so_stats st;
+	int fd = -1;
+	long len = 0;
+
+	write_ref(FILE_BYTES);
+	f = so_fopen(path, "r+");
+	so_fread(buf, 1, 10, f);
+	so_fseek(f, 10, SEEK_SET);
+	so_fputc('X', f);
+	so_fstats(f, &st);
+	so_fclose(f);
+
+	fd = open(path, O_RDONLY);
+	len = read(fd, got, sizeof(got));
+	close(fd);
+	memcpy(buf, ref, FILE_BYTES);
+	buf[10] = 'X';
+	check("a write after a seek in the buffer of \"r+\" lands there",
+		len == FILE_BYTES && !memcmp(got, buf, FILE_BYTES) &&
+		st.seeks == 1);
+}
+
+/* Reads 4 bytes at 140000 of a file of 64 KiB blocks of 'a', 'b'
+ * and 'c', after a seek made through the block cache, which either
+ * the cache going off or an unbuffered SO_FILE then bypasses
+ */
+static void check_cache_bypass(const char *name, int unbuffered)
+{
+	unsigned char block[65536];
+	char got[5] = "";
+	SO_FILE *f = NULL;
+	int ok = 0;
+	int i = 0;
+
+	f = so_fopen(path, "w");
+	for (i = 0; i < 3; i++) {
+		memset(block, 'a' + i, sizeof(block));
+		so_fwrite(block, 1, sizeof(block), f);
+	}
+	so_fclose(f);
+
+	so_setblockcache(0, 1 << 20);
+	f = so_fopen(path, "r");
+	ok = so_fgetc(f) == 'a' && so_fseek(f, 140000, SEEK_SET) == 0;
+	if (unbuffered)
+		ok = ok && so_setvbuf(f, NULL, SO_IONBF, 0) == 0;
+	else
+		so_setblockcache(0, 0);
+	ok = ok && so_fread(got, 1, 4, f) == 4 && !strcmp(got, "cccc");
+	check(name, ok);
+	so_fclose(f);
+	so_setblockcache(0, 0);
+}
+
+static void check_unbuffered_printf(void)
+{
+	char got[64] = "";
+	SO_FILE *f = so_fopen(path, "w");
+	struct so_stats st;
+	int fd = -1;
+	int ok = 0;
+
+	ok = so_setvbuf(f, NULL, SO_IONBF, 0) == 0 &&
+		so_fprintf(f, "hello %d world %s\n", 123456, "!") == 21;
+	so_fstats(f, &st);
+	so_fclose(f);
+	fd = open(path, O_RDONLY);
+	ok = ok && read(fd, got, sizeof(got)) == 21 &&
+		!strcmp(got, "hello 123456 world !\n");
+	close(fd);
+	check("so_fprintf on an unbuffered SO_FILE makes one write",
+		ok && st.write_calls == 1);
+}
+
+int main(void)
+{
+	long i = 0;
+
+	for (i = 0; i < FILE_BYTES; i++)
+		ref[i] = i % 251;
+	bench_path(path, sizeof(path), "check_syscalls");
+	write_ref(FILE_BYTES);
+	check_fopen();
+	check_eof();
+	check_window();
+	check_after_direct_read();
+	check_write_after_seek();
+	check_cache_bypass("a read after turning the cache off follows "
+		"its seek", 0);
+	check_cache_bypass("an unbuffered read follows a seek through "
+		"the cache", 1);
+	check_unbuffered_printf();
+	unlink(path);
+	return failed;
+}
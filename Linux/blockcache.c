@@ -0,0 +1,515 @@
+#include "stdio_internal.h"
+#include <limits.h>
+#include <string.h>
+
+#define BC_SHARDS	16
+#define BC_BLOCK	(64 << 10)
+#define BC_SCAN		64
+#define BC_FREE		0
+#define BC_USED		1
+#define BC_BUSY		2
+
+/* One block of the cache: len bytes of the file (dev, ino) from
+ * block * so_bc_block, fewer than a block only at its end
+ * A BC_BUSY slot is being filled by a thread that missed, outside
+ * the lock of its shard; it is neither found nor evicted
+ */
+struct so_bc_slot {
+	dev_t dev;
+	ino_t ino;
+	long block;
+	size_t len;
+	unsigned char *data;
+	size_t bucket;
+	int next;
+	int state;
+	bool ref;
+};
+
+/* A part of the cache with its own lock, hash table and CLOCK hand
+ * gen moves at every invalidation, so a block read while one ran
+ * is not kept
+ */
+struct so_bc_shard {
+	pthread_mutex_t lock;
+	struct so_bc_slot *slots;
+	int *heads;
+	size_t nslots;
+	size_t hand;
+	unsigned long gen;
+	struct so_blockcache_stats stats;
+};
+
+/* Shards and block size only change with the write lock held */
+static pthread_rwlock_t so_bc_config = PTHREAD_RWLOCK_INITIALIZER;
+static struct so_bc_shard *so_bc_shards;
+static size_t so_bc_nshards;
+static size_t so_bc_block;
+static int so_bc_enabled;
+
+/* Mixes the key of a block; the shard comes from the low bits, the
+ * bucket from the others
+ */
+static unsigned long long so_bc_hash(dev_t dev, ino_t ino, long block)
+{
+	unsigned long long h = (unsigned long long)dev * 0x9e3779b97f4a7c15ULL;
+
+	h ^= (unsigned long long)ino * 0xc2b2ae3d27d4eb4fULL + (h >> 31);
+	h ^= (unsigned long long)block * 0x165667b19e3779f9ULL + (h >> 29);
+	return h ^ (h >> 32);
+}
+
+/* Picks the shard of a block, and its bucket there */
+static struct so_bc_shard *so_bc_shard(dev_t dev, ino_t ino, long block,
+	size_t *bucket)
+{
+	unsigned long long h = so_bc_hash(dev, ino, block);
+	struct so_bc_shard *shard = &so_bc_shards[h % so_bc_nshards];
+
+	*bucket = h / so_bc_nshards % shard->nslots;
+	return shard;
+}
+
+/* Returns the slot holding the block in the shard, NULL if none;
+ * lock must be held
+ */
+static struct so_bc_slot *so_bc_find(struct so_bc_shard *shard,
+	size_t bucket, dev_t dev, ino_t ino, long block)
+{
+	struct so_bc_slot *slot = NULL;
+	int i = shard->heads[bucket];
+
+	for (; i != -1; i = slot->next) {
+		slot = &shard->slots[i];
+		if (slot->block == block && slot->ino == ino &&
+			slot->dev == dev)
+			return slot;
+	}
+	return NULL;
+}
+
+/* Takes a used slot out of the hash table of its shard, leaving it
+ * BC_FREE; lock must be held
+ */
+static void so_bc_unlink(struct so_bc_shard *shard, struct so_bc_slot *slot)
+{
+	int index = slot - shard->slots;
+	int *link = &shard->heads[slot->bucket];
+
+	while (*link != index)
+		link = &shard->slots[*link].next;
+	*link = slot->next;
+	slot->next = -1;
+	slot->state = BC_FREE;
+}
+
+/* Finds a slot for a new block with CLOCK: the hand clears the
+ * reference bit of recently used blocks and evicts the first block
+ * found without it
+ * Returns a BC_FREE slot, NULL if all of them are busy
+ */
+static struct so_bc_slot *so_bc_victim(struct so_bc_shard *shard)
+{
+	struct so_bc_slot *slot = NULL;
+	size_t i = 0;
+
+	for (i = 0; i < 2 * shard->nslots; i++) {
+		slot = &shard->slots[shard->hand];
+		shard->hand = (shard->hand + 1) % shard->nslots;
+		if (slot->state == BC_FREE)
+			return slot;
+		if (slot->state == BC_BUSY)
+			continue;
+		if (slot->ref) {
+			slot->ref = false;
+			continue;
+		}
+		so_bc_unlink(shard, slot);
+		shard->stats.evictions++;
+		return slot;
+	}
+	return NULL;
+}
+
+/* Tells whether refills of the SO_FILE go through the block cache:
+ * it must be on, and the SO_FILE a plain buffered one opened on a
+ * regular file while it was
+ */
+bool so_bc_usable(SO_FILE *stream)
+{
+	return stream->cached &&
+		__atomic_load_n(&so_bc_enabled, __ATOMIC_RELAXED) &&
+		stream->mode_type != READMAP &&
+		stream->buff_mode != SO_IONBF && stream->ra == NULL &&
+		stream->wb == NULL && stream->duplex == NULL &&
+		stream->z == NULL && stream->dio == NULL;
+}
+
+/* Records the file of a SO_FILE being opened, when the block cache
+ * is on and it is a regular file, so the SO_FILE reads through the
+ * cache and its writes keep it coherent
+ */
+void so_bc_probe(SO_FILE *stream)
+{
+	struct stat st;
+
+	if (!__atomic_load_n(&so_bc_enabled, __ATOMIC_RELAXED) ||
+		fstat(stream->fd, &st) == -1 || !S_ISREG(st.st_mode))
+		return;
+	stream->cached = true;
+	stream->bc_dev = st.st_dev;
+	stream->bc_ino = st.st_ino;
+}
+
+/* Reads up to len bytes at off of the file of the SO_FILE into buf,
+ * accounting for the call
+ * Returns the number of bytes read, 0 at EOF, -1 in case of error
+ */
+static long so_bc_pread(SO_FILE *stream, unsigned char *buf, size_t len,
+	long off)
+{
+	unsigned long long start = so_clock_ns();
+	long bytes_read = pread(stream->fd, buf, len, off);
+
+	stream->stats.read_calls++;
+	if (bytes_read > 0)
+		stream->stats.bytes_read += bytes_read;
+	stream->stats.syscall_ns += so_clock_ns() - start;
+	return bytes_read;
+}
+
+/* Copies into the buffer of the SO_FILE the bytes of the block
+ * in slot from skip on, at most buff_capacity of them
+ * Returns the number of bytes copied
+ */
+static long so_bc_copy(SO_FILE *stream, struct so_bc_slot *slot,
+	size_t skip)
+{
+	size_t len = slot->len - skip;
+
+	if (len > stream->buff_capacity)
+		len = stream->buff_capacity;
+	memcpy(stream->buffer, slot->data + skip, len);
+	return len;
+}
+
+/* Reads the block of the cache holding the SO_FILE pointer, from
+ * memory when it is there, otherwise from the file with one pread
+ * of the whole block, which is then kept
+ * A cached block shorter than the others ended the file when it
+ * was read; asking for bytes past it reads it again, so the file
+ * may have grown since
+ * The file descr is not moved, see so_bc_sync
+ * Returns the number of bytes read into the buffer, 0 at EOF or
+ * -1 in case of error
+ */
+long so_bc_read(SO_FILE *stream)
+{
+	struct so_bc_shard *shard = NULL;
+	struct so_bc_slot *slot = NULL;
+	long off = stream->pointer;
+	long block = 0;
+	long got = 0;
+	size_t skip = 0;
+	size_t bucket = 0;
+	unsigned long gen = 0;
+
+	stream->fd_stale = true;
+	pthread_rwlock_rdlock(&so_bc_config);
+	if (so_bc_shards == NULL) {
+		pthread_rwlock_unlock(&so_bc_config);
+		return so_bc_pread(stream, stream->buffer,
+			stream->buff_capacity, off);
+	}
+	block = off / so_bc_block;
+	skip = off % so_bc_block;
+	shard = so_bc_shard(stream->bc_dev, stream->bc_ino, block, &bucket);
+
+	pthread_mutex_lock(&shard->lock);
+	slot = so_bc_find(shard, bucket, stream->bc_dev, stream->bc_ino,
+		block);
+	if (slot != NULL && skip < slot->len) {
+		slot->ref = true;
+		shard->stats.hits++;
+		got = so_bc_copy(stream, slot, skip);
+		pthread_mutex_unlock(&shard->lock);
+		pthread_rwlock_unlock(&so_bc_config);
+		return got;
+	}
+	if (slot != NULL)
+		so_bc_unlink(shard, slot);
+	else
+		slot = so_bc_victim(shard);
+	shard->stats.misses++;
+	if (slot != NULL) {
+		slot->state = BC_BUSY;
+		slot->len = 0;
+	}
+	gen = shard->gen;
+	pthread_mutex_unlock(&shard->lock);
+
+	if (slot != NULL && slot->data == NULL)
+		slot->data = malloc(so_bc_block);
+	if (slot == NULL || slot->data == NULL) {
+		/* every slot is being filled, or out of memory */
+		got = so_bc_pread(stream, stream->buffer,
+			stream->buff_capacity, off);
+	} else {
+		got = so_bc_pread(stream, slot->data, so_bc_block,
+			block * so_bc_block);
+		slot->len = got > 0 ? got : 0;
+		if (got > (long)skip)
+			got = so_bc_copy(stream, slot, skip);
+		else if (got != -1)
+			got = 0;
+	}
+
+	if (slot != NULL) {
+		pthread_mutex_lock(&shard->lock);
+		slot->state = BC_FREE;
+		if (slot->len > 0 && gen == shard->gen &&
+			so_bc_find(shard, bucket, stream->bc_dev,
+			stream->bc_ino, block) == NULL) {
+			slot->dev = stream->bc_dev;
+			slot->ino = stream->bc_ino;
+			slot->block = block;
+			slot->bucket = bucket;
+			slot->next = shard->heads[bucket];
+			slot->state = BC_USED;
+			slot->ref = true;
+			shard->heads[bucket] = slot - shard->slots;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	pthread_rwlock_unlock(&so_bc_config);
+	return got;
+}
+
+/* Moves the SO_FILE pointer of a read-only SO_FILE reading through
+ * the block cache without lseek, which the next refill does not
+ * need
+ * Returns 0 at succes, -1 in case of error
+ */
+int so_bc_seek(SO_FILE *stream, long offset)
+{
+	if (offset < 0) {
+		errno = EINVAL;
+		stream->found_error = 1;
+		return -1;
+	}
+	stream->pointer = offset;
+	stream->fd_stale = true;
+	stream->found_eof = false;
+	return 0;
+}
+
+/* Brings the file descr of a SO_FILE that read through the block
+ * cache to the end of its buffered data, where the code handing it
+ * to the kernel expects it
+ * Returns 0 at succes, -1 in case of error
+ */
+int so_bc_sync(SO_FILE *stream)
+{
+	long end = stream->pointer + stream->buff_size - stream->buff_pos;
+
+	if (!stream->fd_stale)
+		return 0;
+	stream->stats.seeks++;
+	if (lseek(stream->fd, end, SEEK_SET) == -1)
+		return -1;
+	stream->fd_stale = false;
+	return 0;
+}
+
+/* Drops the cached blocks of the file (dev, ino) from first to last
+ * A short range is looked up block by block; a longer one, as left
+ * by a truncation, walks every slot
+ */
+static void so_bc_drop(dev_t dev, ino_t ino, long first, long last)
+{
+	struct so_bc_shard *shard = NULL;
+	struct so_bc_slot *slot = NULL;
+	size_t bucket = 0;
+	size_t i = 0;
+	size_t j = 0;
+	long block = 0;
+
+	if (last - first < BC_SCAN) {
+		for (block = first; block <= last; block++) {
+			shard = so_bc_shard(dev, ino, block, &bucket);
+			pthread_mutex_lock(&shard->lock);
+			slot = so_bc_find(shard, bucket, dev, ino, block);
+			if (slot != NULL) {
+				so_bc_unlink(shard, slot);
+				shard->stats.invalidations++;
+			}
+			shard->gen++;
+			pthread_mutex_unlock(&shard->lock);
+		}
+		return;
+	}
+	for (i = 0; i < so_bc_nshards; i++) {
+		shard = &so_bc_shards[i];
+		pthread_mutex_lock(&shard->lock);
+		for (j = 0; j < shard->nslots; j++) {
+			slot = &shard->slots[j];
+			if (slot->state == BC_USED && slot->dev == dev &&
+				slot->ino == ino && slot->block >= first &&
+				slot->block <= last) {
+				so_bc_unlink(shard, slot);
+				shard->stats.invalidations++;
+			}
+		}
+		shard->gen++;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+/* Keeps the block cache coherent after len bytes were written at
+ * off of the file of the SO_FILE; off -1 stands for the position
+ * of the file descr, which moved past them, and len -1 for all the
+ * file from off, as after a truncation
+ * Appending needs nothing: cached blocks stop where the file ended
+ */
+void so_bc_wrote(SO_FILE *stream, long off, long len)
+{
+	long last = 0;
+
+	if (!stream->cached || len == 0 || stream->mode_type == APPEND ||
+		stream->mode_type == APPENDPLUS)
+		return;
+	if (off == -1) {
+		off = lseek(stream->fd, 0, SEEK_CUR) - len;
+		if (off < 0) {
+			off = 0;
+			len = -1;
+		}
+	}
+	pthread_rwlock_rdlock(&so_bc_config);
+	if (so_bc_shards != NULL) {
+		last = len == -1 ? LONG_MAX : (off + len - 1) / so_bc_block;
+		so_bc_drop(stream->bc_dev, stream->bc_ino, off / so_bc_block,
+			last);
+	}
+	pthread_rwlock_unlock(&so_bc_config);
+}
+
+/* Frees the shards and every cached block; config write lock held */
+static void so_bc_free(void)
+{
+	size_t i = 0;
+	size_t j = 0;
+
+	for (i = 0; i < so_bc_nshards; i++) {
+		for (j = 0; j < so_bc_shards[i].nslots; j++)
+			free(so_bc_shards[i].slots[j].data);
+		free(so_bc_shards[i].slots);
+		free(so_bc_shards[i].heads);
+		pthread_mutex_destroy(&so_bc_shards[i].lock);
+	}
+	free(so_bc_shards);
+	so_bc_shards = NULL;
+	so_bc_nshards = 0;
+}
+
+/* Allocates nshards shards of nslots empty slots each, whose blocks
+ * are only allocated when first filled; config write lock held
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_bc_alloc(size_t nshards, size_t nslots)
+{
+	struct so_bc_shard *shard = NULL;
+	size_t i = 0;
+	size_t j = 0;
+
+	so_bc_shards = calloc(nshards, sizeof(struct so_bc_shard));
+	if (so_bc_shards == NULL)
+		return -1;
+	for (i = 0; i < nshards; i++) {
+		shard = &so_bc_shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		so_bc_nshards++;
+		shard->slots = calloc(nslots, sizeof(struct so_bc_slot));
+		shard->heads = malloc(nslots * sizeof(int));
+		if (shard->slots == NULL || shard->heads == NULL)
+			return -1;
+		shard->nslots = nslots;
+		for (j = 0; j < nslots; j++) {
+			shard->heads[j] = -1;
+			shard->slots[j].next = -1;
+		}
+	}
+	return 0;
+}
+
+/* Sets up the process-wide block cache shared by the SO_FILEs
+ * opened on the same file: refills read whole blocks of block_size
+ * bytes (a power of two, 0 for 64 KiB) with pread, keeping as many
+ * as fit in budget bytes, so other SO_FILEs, or the same one after
+ * a seek, find them in memory
+ * The blocks are spread over BC_SHARDS shards, each with its own
+ * lock and a CLOCK hand that evicts blocks not used since it last
+ * went by. Writes through any SO_FILE on the file drop the blocks
+ * they touch; changes made to the file outside so_stdio are not seen
+ * Only SO_FILEs opened while the cache is on use it, and keep it
+ * coherent. A zero budget turns the cache off; changing it drops
+ * all blocks
+ * Returns 0 at succes, -1 in case of error, with errno set
+ */
+int so_setblockcache(size_t block_size, size_t budget)
+{
+	size_t blocks = 0;
+	size_t nshards = 0;
+	int ret = 0;
+
+	if (block_size == 0)
+		block_size = BC_BLOCK;
+	blocks = budget / block_size;
+	if (block_size < 512 || (block_size & (block_size - 1)) != 0 ||
+		(budget > 0 && blocks == 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+	nshards = blocks < BC_SHARDS ? blocks : BC_SHARDS;
+
+	pthread_rwlock_wrlock(&so_bc_config);
+	so_bc_free();
+	so_bc_block = block_size;
+	if (blocks > 0 && so_bc_alloc(nshards, blocks / nshards) == -1) {
+		so_bc_free();
+		errno = ENOMEM;
+		ret = -1;
+	}
+	__atomic_store_n(&so_bc_enabled, so_bc_shards != NULL,
+		__ATOMIC_RELAXED);
+	pthread_rwlock_unlock(&so_bc_config);
+	return ret;
+}
+
+/* Fills stats with the counters of the block cache, summed over its
+ * shards since it was last set up
+ * Returns 0 at succes, -1 if the cache is off
+ */
+int so_blockcache_stats(struct so_blockcache_stats *stats)
+{
+	struct so_bc_shard *shard = NULL;
+	size_t i = 0;
+	int ret = -1;
+
+	pthread_rwlock_rdlock(&so_bc_config);
+	if (so_bc_shards != NULL) {
+		memset(stats, 0, sizeof(*stats));
+		for (i = 0; i < so_bc_nshards; i++) {
+			shard = &so_bc_shards[i];
+			pthread_mutex_lock(&shard->lock);
+			stats->hits += shard->stats.hits;
+			stats->misses += shard->stats.misses;
+			stats->evictions += shard->stats.evictions;
+			stats->invalidations += shard->stats.invalidations;
+			pthread_mutex_unlock(&shard->lock);
+		}
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&so_bc_config);
+	return ret;
+}
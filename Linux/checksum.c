@@ -0,0 +1,279 @@
+#include "stdio_internal.h"
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/* CRC32C (Castagnoli) polynomial, bit-reflected */
+#define CRC32C_POLY	0x82f63b78u
+
+/* Length of each of the three strips checksummed side by side */
+#define CRC_STRIP	4096
+
+static unsigned int so_crc_table[8][256];
+static unsigned int so_crc_shift_table[4][256];
+static unsigned int (*so_crc_update)(unsigned int crc,
+	const unsigned char *p, size_t len);
+static pthread_once_t so_crc_once = PTHREAD_ONCE_INIT;
+
+/* Updates crc (not inverted) with len bytes from p, 8 at a time:
+ * each of the 8 tables gives the contribution of one byte lane
+ * ("slicing-by-8"), so a step costs 8 independent lookups
+ */
+static unsigned int so_crc_sliced(unsigned int crc, const unsigned char *p,
+	size_t len)
+{
+	unsigned int lo = 0;
+	unsigned int hi = 0;
+
+	while (len > 0 && ((uintptr_t)p & 7) != 0) {
+		crc = so_crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 |
+			(unsigned int)p[3] << 24);
+		hi = p[4] | p[5] << 8 | p[6] << 16 | (unsigned int)p[7] << 24;
+		crc = so_crc_table[7][lo & 0xff] ^
+			so_crc_table[6][(lo >> 8) & 0xff] ^
+			so_crc_table[5][(lo >> 16) & 0xff] ^
+			so_crc_table[4][lo >> 24] ^
+			so_crc_table[3][hi & 0xff] ^
+			so_crc_table[2][(hi >> 8) & 0xff] ^
+			so_crc_table[1][(hi >> 16) & 0xff] ^
+			so_crc_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		crc = so_crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+/* Returns crc (not inverted) updated with CRC_STRIP zero bytes,
+ * which is how the CRC of some data moves when CRC_STRIP more
+ * bytes follow it
+ */
+static unsigned int so_crc_shift(unsigned int crc)
+{
+	return so_crc_shift_table[0][crc & 0xff] ^
+		so_crc_shift_table[1][(crc >> 8) & 0xff] ^
+		so_crc_shift_table[2][(crc >> 16) & 0xff] ^
+		so_crc_shift_table[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+/* Same as so_crc_sliced, with the SSE4.2 crc32 instruction
+ * One instruction only starts once the previous one is done, so
+ * long data is cut in three strips whose CRCs are computed side by
+ * side, then joined with so_crc_shift
+ */
+__attribute__((target("sse4.2")))
+static unsigned int so_crc_hw(unsigned int crc, const unsigned char *p,
+	size_t len)
+{
+	unsigned long long c = crc;
+	unsigned long long c1 = 0;
+	unsigned long long c2 = 0;
+	unsigned long long word = 0;
+	unsigned long long word1 = 0;
+	unsigned long long word2 = 0;
+	size_t i = 0;
+
+	while (len > 0 && ((uintptr_t)p & 7) != 0) {
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+	while (len >= 3 * CRC_STRIP) {
+		c1 = 0;
+		c2 = 0;
+		for (i = 0; i < CRC_STRIP; i += 8) {
+			memcpy(&word, p + i, 8);
+			memcpy(&word1, p + CRC_STRIP + i, 8);
+			memcpy(&word2, p + 2 * CRC_STRIP + i, 8);
+			c = _mm_crc32_u64(c, word);
+			c1 = _mm_crc32_u64(c1, word1);
+			c2 = _mm_crc32_u64(c2, word2);
+		}
+		c = so_crc_shift(so_crc_shift(c) ^ c1) ^ c2;
+		p += 3 * CRC_STRIP;
+		len -= 3 * CRC_STRIP;
+	}
+	while (len >= 8) {
+		memcpy(&word, p, 8);
+		c = _mm_crc32_u64(c, word);
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		c = _mm_crc32_u8(c, *p++);
+	return c;
+}
+
+static bool so_crc_hw_present(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+/* Same as the SSE4.2 version, with the ARMv8 crc32c instructions */
+__attribute__((target("+crc")))
+static unsigned int so_crc_hw(unsigned int crc, const unsigned char *p,
+	size_t len)
+{
+	unsigned int c1 = 0;
+	unsigned int c2 = 0;
+	unsigned long long word = 0;
+	unsigned long long word1 = 0;
+	unsigned long long word2 = 0;
+	size_t i = 0;
+
+	while (len > 0 && ((uintptr_t)p & 7) != 0) {
+		crc = __crc32cb(crc, *p++);
+		len--;
+	}
+	while (len >= 3 * CRC_STRIP) {
+		c1 = 0;
+		c2 = 0;
+		for (i = 0; i < CRC_STRIP; i += 8) {
+			memcpy(&word, p + i, 8);
+			memcpy(&word1, p + CRC_STRIP + i, 8);
+			memcpy(&word2, p + 2 * CRC_STRIP + i, 8);
+			crc = __crc32cd(crc, word);
+			c1 = __crc32cd(c1, word1);
+			c2 = __crc32cd(c2, word2);
+		}
+		crc = so_crc_shift(so_crc_shift(crc) ^ c1) ^ c2;
+		p += 3 * CRC_STRIP;
+		len -= 3 * CRC_STRIP;
+	}
+	while (len >= 8) {
+		memcpy(&word, p, 8);
+		crc = __crc32cd(crc, word);
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+
+static bool so_crc_hw_present(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+/* Builds the tables of so_crc_sliced and so_crc_shift, and picks
+ * the instructions of the processor when it has them
+ * Moving a CRC over zero bytes is linear, so the shift of each
+ * byte of it is tabulated from the shifts of its 32 bits
+ */
+static void so_crc_init(void)
+{
+	static const unsigned char zeros[CRC_STRIP];
+	unsigned int bits[32];
+	unsigned int crc = 0;
+	int i = 0;
+	int j = 0;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		so_crc_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			so_crc_table[j][i] = so_crc_table[0][
+				so_crc_table[j - 1][i] & 0xff] ^
+				(so_crc_table[j - 1][i] >> 8);
+
+	for (i = 0; i < 32; i++)
+		bits[i] = so_crc_sliced(1u << i, zeros, CRC_STRIP);
+	for (i = 0; i < 4; i++)
+		for (j = 0; j < 256; j++)
+			for (crc = 0; crc < 8; crc++)
+				if (j & (1 << crc))
+					so_crc_shift_table[i][j] ^=
+						bits[i * 8 + crc];
+
+	so_crc_update = so_crc_sliced;
+#if defined(__x86_64__) || defined(__aarch64__)
+	if (so_crc_hw_present())
+		so_crc_update = so_crc_hw;
+#endif
+}
+
+/* Extends crc, the CRC32C of some data (0 for none), with len
+ * bytes from ptr
+ * Returns the CRC32C of the whole data
+ */
+unsigned int so_crc32c(unsigned int crc, const void *ptr, size_t len)
+{
+	pthread_once(&so_crc_once, so_crc_init);
+	return ~so_crc_update(~crc, ptr, len);
+}
+
+/* Turns the checksum of the SO_FILE on (restarting it) or off
+ * While on, every byte read from the file into the buffer, or
+ * written from the buffer (or straight from the caller) to the
+ * file, extends a CRC32C, computed while the data is in cache;
+ * reading a file to its end thus gives the checksum of the file,
+ * and writing one the checksum of what was written, without a
+ * second pass over it
+ * Pending writes are flushed first, so only data given to the
+ * SO_FILE from now on is counted
+ * Memory-mapped SO_FILEs are not supported; while it is on,
+ * so_fcopy moves data through the buffer instead of the kernel,
+ * and SO_RING requests, which bypass the buffer, are refused
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_setchecksum_unlocked(SO_FILE *stream, int enable)
+{
+	if (stream->mode_type == READMAP)
+		return -1;
+	if (stream->last_op == LASTWRITE &&
+		so_fflush_unlocked(stream) == SO_EOF)
+		return -1;
+	if (enable)
+		pthread_once(&so_crc_once, so_crc_init);
+	stream->csum_on = enable ? true : false;
+	stream->csum = 0;
+	return 0;
+}
+
+/* Same as so_setchecksum_unlocked, holding the lock of the SO_FILE */
+int so_setchecksum(SO_FILE *stream, int enable)
+{
+	int ret;
+
+	so_flockfile(stream);
+	ret = so_setchecksum_unlocked(stream, enable);
+	so_funlockfile(stream);
+	return ret;
+}
+
+/* Returns the CRC32C of the data read or written since the
+ * checksum of the SO_FILE was turned on, including data still
+ * waiting in the buffer to be written, or 0 if it is off
+ */
+unsigned int so_fchecksum(SO_FILE *stream)
+{
+	unsigned int crc = 0;
+
+	so_flockfile(stream);
+	crc = stream->csum;
+	/* a direct I/O flush counts the tail it leaves in the buffer */
+	if (stream->csum_on && stream->last_op == LASTWRITE)
+		crc = so_crc32c(crc, stream->buffer + so_dio_synced(stream),
+			stream->buff_size - so_dio_synced(stream));
+	so_funlockfile(stream);
+	return crc;
+}
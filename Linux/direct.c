@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include "stdio_internal.h"
+#include <string.h>
+#include <stdint.h>
+
+/* Buffer of a SO_FILE opened in "rd" or "wd" mode */
+#define DIO_BUFFER	(1 << 20)
+/* Alignment used when the file system does not report one */
+#define DIO_ALIGN	4096
+
+/* Returns the alignment O_DIRECT transfers on fd need, for both
+ * the memory buffer and the file offset, as a power of two
+ */
+static size_t so_dio_align(int fd)
+{
+	size_t align = DIO_ALIGN;
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+
+	if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+		(stx.stx_mask & STATX_DIOALIGN) &&
+		stx.stx_dio_offset_align > 0) {
+		align = stx.stx_dio_offset_align;
+		if (stx.stx_dio_mem_align > align)
+			align = stx.stx_dio_mem_align;
+	}
+#endif
+	return align;
+}
+
+/* Opens pathname for "rd" (reading) or "wd" (writing) with
+ * O_DIRECT; file systems refusing it (tmpfs, for one) get the
+ * file opened without it, the SO_FILE then behaving the same
+ * through the page cache
+ * Returns the file descr, -1 in case of error
+ */
+int so_dio_open_fd(const char *pathname, bool writing)
+{
+	int flags = writing ? O_WRONLY | O_TRUNC | O_CREAT : O_RDONLY;
+	int fd = open(pathname, flags | O_DIRECT, 0644);
+
+	if (fd == -1 && errno == EINVAL)
+		fd = open(pathname, flags, 0644);
+	return fd;
+}
+
+/* Sets up a SO_FILE opened in "rd" or "wd" mode: its buffer is
+ * DIO_BUFFER bytes, aligned for O_DIRECT, and always starts at
+ * an aligned file offset
+ * Returns 0 at succes, -1 in case of error, with errno set
+ */
+int so_dio_open(SO_FILE *stream, bool writing)
+{
+	struct so_direct *dio = calloc(1, sizeof(*dio));
+	void *buf = NULL;
+	int err = 0;
+
+	if (dio == NULL)
+		return -1;
+	stream->dio = dio;
+	dio->writing = writing;
+	dio->align = so_dio_align(stream->fd);
+	err = posix_memalign(&buf, dio->align, DIO_BUFFER);
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	stream->buffer = buf;
+	stream->buff_owned = true;
+	stream->buff_capacity = DIO_BUFFER;
+	stream->seekable = 1;
+	return 0;
+}
+
+/* Writes len bytes from buf at file offset off, resuming partial
+ * writes
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_dio_pwrite(SO_FILE *stream, const unsigned char *buf,
+	size_t len, long long off)
+{
+	unsigned long long start = 0;
+	ssize_t bytes_written = 0;
+
+	while (len > 0) {
+		start = so_clock_ns();
+		bytes_written = pwrite(stream->fd, buf, len, off);
+		stream->stats.write_calls++;
+		stream->stats.syscall_ns += so_clock_ns() - start;
+		if (bytes_written <= 0)
+			return -1;
+		if ((size_t)bytes_written < len)
+			stream->stats.short_writes++;
+		stream->stats.bytes_written += bytes_written;
+		so_bc_wrote(stream, off, bytes_written);
+		buf += bytes_written;
+		len -= bytes_written;
+		off += bytes_written;
+	}
+	return 0;
+}
+
+/* Writes the buffer of a full "wd" SO_FILE at its aligned offset
+ * and empties it
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_dio_spill(SO_FILE *stream)
+{
+	struct so_direct *dio = stream->dio;
+
+	so_csum(stream, stream->buffer + dio->synced,
+		stream->buff_size - dio->synced);
+	if (so_dio_pwrite(stream, stream->buffer, stream->buff_size,
+		stream->pointer))
+		return -1;
+	stream->pointer += stream->buff_size;
+	stream->buff_size = 0;
+	dio->synced = 0;
+	return 0;
+}
+
+/* Writes the partial buffer of a "wd" SO_FILE, padded with zeros
+ * to the alignment, then cuts the file back to its real size
+ * The unaligned tail stays in the buffer, so later writes extend
+ * it and the block holding it is written again, whole
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_dio_sync_tail(SO_FILE *stream)
+{
+	struct so_direct *dio = stream->dio;
+	size_t mask = dio->align - 1;
+	size_t padded = (stream->buff_size + mask) & ~mask;
+	size_t head = stream->buff_size & ~mask;
+	long long end = stream->pointer + stream->buff_size;
+
+	if (stream->buff_size == dio->synced)
+		return 0;
+	so_csum(stream, stream->buffer + dio->synced,
+		stream->buff_size - dio->synced);
+	memset(stream->buffer + stream->buff_size, 0,
+		padded - stream->buff_size);
+	if (so_dio_pwrite(stream, stream->buffer, padded, stream->pointer))
+		return -1;
+	if (padded != stream->buff_size) {
+		if (ftruncate(stream->fd, end) == -1)
+			return -1;
+		so_bc_wrote(stream, end, -1);
+	}
+
+	if (head > 0)
+		memmove(stream->buffer, stream->buffer + head,
+			stream->buff_size - head);
+	stream->pointer += head;
+	stream->buff_size -= head;
+	dio->synced = stream->buff_size;
+	return 0;
+}
+
+/* Writes the buffer of a "wd" SO_FILE, followed by len bytes from
+ * ptr, in aligned blocks
+ * As with "wz", the buffer is topped up from ptr so its writes
+ * stay whole; ptr is written in place when it is aligned itself,
+ * and otherwise copied through the buffer. Flushing (len 0) also
+ * writes the unaligned tail, see so_dio_sync_tail
+ * Returns 0 at succes, SO_EOF in case of error
+ */
+int so_dio_write_out(SO_FILE *stream, const void *ptr, size_t len)
+{
+	struct so_direct *dio = stream->dio;
+	const unsigned char *src = ptr;
+	size_t mask = dio->align - 1;
+	size_t fill = 0;
+	int ret = 0;
+
+	if (!dio->writing) {
+		stream->found_error = 1;
+		return SO_EOF;
+	}
+	if (stream->buff_size + len > dio->synced)
+		stream->stats.flushes++;
+
+	while (ret == 0 && len > 0) {
+		if (stream->buff_size == 0 && len >= stream->buff_capacity &&
+			((uintptr_t)src & mask) == 0) {
+			fill = len / stream->buff_capacity *
+				stream->buff_capacity;
+			so_csum(stream, src, fill);
+			ret = so_dio_pwrite(stream, src, fill, stream->pointer);
+			stream->pointer += fill;
+		} else {
+			fill = stream->buff_capacity - stream->buff_size;
+			if (fill > len)
+				fill = len;
+			memcpy(stream->buffer + stream->buff_size, src, fill);
+			stream->buff_size += fill;
+			if (stream->buff_size == stream->buff_capacity)
+				ret = so_dio_spill(stream);
+		}
+		src += fill;
+		len -= fill;
+	}
+	if (ret == 0 && ptr == NULL) {
+		if (stream->buff_size == stream->buff_capacity)
+			ret = so_dio_spill(stream);
+		else
+			ret = so_dio_sync_tail(stream);
+	}
+
+	stream->buff_pos = stream->buff_size;
+	if (ret != 0) {
+		stream->found_error = 1;
+		return SO_EOF;
+	}
+	return 0;
+}
+
+/* Fills the buffer of a "rd" SO_FILE with a single aligned pread
+ * A short read leaves the offset on the block holding the end of
+ * the file, which the next refill reads again, so data appended
+ * meanwhile is still found; the bytes already handed out are
+ * dropped from its front
+ * Returns the number of bytes placed in the buffer, 0 at EOF or
+ * -1 in case of error
+ */
+long so_dio_read(SO_FILE *stream)
+{
+	struct so_direct *dio = stream->dio;
+	ssize_t got = 0;
+	size_t head = 0;
+	long ret = 0;
+
+	if (dio->writing) {
+		errno = EBADF;
+		return -1;
+	}
+	got = pread(stream->fd, stream->buffer, stream->buff_capacity,
+		dio->off);
+	if (got == -1)
+		return -1;
+	if ((size_t)got <= dio->skip)
+		return 0;
+
+	ret = got - dio->skip;
+	if (dio->skip > 0)
+		memmove(stream->buffer, stream->buffer + dio->skip, ret);
+	head = got & ~(dio->align - 1);
+	dio->off += head;
+	dio->skip = got - head;
+	return ret;
+}
+
+/* Moves the position of a "rd" or "wd" SO_FILE
+ * When reading, the next refill starts at the aligned offset
+ * below the target and drops the bytes before it; when writing,
+ * as with "wz", only the current position is accepted
+ * Returns 0 at succes, -1 in case of error
+ */
+int so_dio_seek(SO_FILE *stream, long offset, int whence)
+{
+	struct so_direct *dio = stream->dio;
+	long long target = offset;
+	struct stat st;
+
+	if (dio->writing) {
+		if (whence == SEEK_SET && offset == so_ftell_unlocked(stream))
+			return 0;
+		errno = ESPIPE;
+		return -1;
+	}
+	if (whence == SEEK_END) {
+		if (fstat(stream->fd, &st) == -1) {
+			stream->found_error = 1;
+			return -1;
+		}
+		target += st.st_size;
+	} else if (whence != SEEK_SET) {
+		target = -1;
+	}
+	if (target < 0) {
+		stream->found_error = 1;
+		return -1;
+	}
+
+	stream->stats.seeks++;
+	if (stream->buff_pos != stream->buff_size)
+		stream->stats.discarding_seeks++;
+	stream->buff_pos = 0;
+	stream->buff_size = 0;
+	dio->off = target & ~(long long)(dio->align - 1);
+	dio->skip = target - dio->off;
+	stream->pointer = target;
+	stream->found_eof = false;
+	return 0;
+}
+
+/* Returns the number of bytes at the front of the buffer of a
+ * "wd" SO_FILE already written, padded, by a flush; they are
+ * written again with the rest of their block
+ */
+size_t so_dio_synced(SO_FILE *stream)
+{
+	return stream->dio != NULL ? stream->dio->synced : 0;
+}
+
+/* Frees the direct I/O state of a SO_FILE that is being closed */
+void so_dio_free(SO_FILE *stream)
+{
+	free(stream->dio);
+	stream->dio = NULL;
+}
@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+#include "stdio_internal.h"
+#include <string.h>
+#include <sys/sendfile.h>
+
+/* Largest chunk handed to the kernel in one call */
+#define COPY_CHUNK	0x7ffff000
+
+#define COPY_RANGE	0
+#define COPY_SPLICE	1
+#define COPY_SENDFILE	2
+#define COPY_USER	3
+
+/* Writes up to n bytes from the buffer of src to dst, refilling it
+ * only if refill is set, so that without it this only drains data
+ * already read
+ * Returns the number of bytes copied, or -1 in case of error
+ */
+static ssize_t so_copy_buffered(SO_FILE *dst, SO_FILE *src, size_t n,
+	bool refill)
+{
+	size_t done = 0;
+	size_t chunk = 0;
+
+	while (done < n) {
+		if (src->buff_pos == src->buff_size) {
+			if (!refill || so_feof_unlocked(src) ||
+				so_refill(src) <= 0)
+				break;
+		}
+		chunk = src->buff_size - src->buff_pos;
+		if (chunk > n - done)
+			chunk = n - done;
+		if (so_fwrite_unlocked(src->buffer + src->buff_pos, 1, chunk,
+			dst) != chunk)
+			return -1;
+		src->last_op = LASTREAD;
+		src->buff_pos += chunk;
+		src->pointer += chunk;
+		done += chunk;
+	}
+	return so_ferror_unlocked(src) ? -1 : (ssize_t)done;
+}
+
+/* Brings the file descr of dst to its logical position, writing out
+ * pending data or dropping data read ahead of it
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_copy_sync_dst(SO_FILE *dst)
+{
+	if (dst->mode_type == READMAP) {
+		dst->found_error = 1;
+		return -1;
+	}
+	if (dst->last_op == LASTWRITE)
+		return so_fflush_unlocked(dst) == SO_EOF ? -1 : 0;
+	if (dst->ra != NULL)
+		so_ra_cancel(dst);
+	if (so_bc_sync(dst)) {
+		dst->found_error = 1;
+		return -1;
+	}
+	if (dst->buff_pos != dst->buff_size) {
+		dst->stats.discarding_seeks++;
+		dst->stats.seeks++;
+		if (lseek(dst->fd, dst->pointer, SEEK_SET) == -1) {
+			dst->found_error = 1;
+			return -1;
+		}
+	}
+	dst->buff_pos = 0;
+	dst->buff_size = 0;
+	return 0;
+}
+
+/* Picks how the kernel can move data between the two file descrs:
+ * copy_file_range between regular files, splice when either side
+ * is a pipe, sendfile from any other regular file
+ */
+static int so_copy_method(struct stat *dst_st, struct stat *src_st)
+{
+	if (S_ISFIFO(src_st->st_mode) || S_ISFIFO(dst_st->st_mode))
+		return COPY_SPLICE;
+	if (S_ISREG(src_st->st_mode) && S_ISREG(dst_st->st_mode))
+		return COPY_RANGE;
+	if (S_ISREG(src_st->st_mode))
+		return COPY_SENDFILE;
+	return COPY_USER;
+}
+
+/* Moves up to len bytes from the current offset of src to the
+ * current offset of dst with one system call of the given method
+ * Returns the number of bytes moved, 0 at EOF or -1 with errno set
+ */
+static ssize_t so_copy_call(int method, int dst_fd, int src_fd, size_t len)
+{
+	if (len > COPY_CHUNK)
+		len = COPY_CHUNK;
+	if (method == COPY_RANGE)
+		return copy_file_range(src_fd, NULL, dst_fd, NULL, len, 0);
+	if (method == COPY_SPLICE)
+		return splice(src_fd, NULL, dst_fd, NULL, len, SPLICE_F_MOVE);
+	return sendfile(dst_fd, src_fd, NULL, len);
+}
+
+/* Returns true if the error means the method does not apply to
+ * these files, so a more generic one should be tried
+ */
+static bool so_copy_unsupported(int err)
+{
+	return err == EINVAL || err == EXDEV || err == ENOSYS ||
+		err == EOPNOTSUPP || err == EBADF;
+}
+
+/* Finds the next extent of data at or after offset off in the file
+ * descr, and leaves the offset of the file descr at its start
+ * Sets *len to the length of the extent, or -1 if the file system
+ * cannot tell where it ends
+ * Returns the number of hole bytes before it, running to EOF when
+ * there is no data left, or -1 in case of error
+ */
+static off_t so_copy_extent(int fd, off_t off, off_t size, off_t *len)
+{
+	off_t data = lseek(fd, off, SEEK_DATA);
+	off_t end = 0;
+
+	*len = -1;
+	if (data == -1) {
+		if (errno != ENXIO)
+			return 0;
+		*len = 0;
+		return size > off ? size - off : 0;
+	}
+	end = lseek(fd, data, SEEK_HOLE);
+	if (end != -1)
+		*len = end - data;
+	if (lseek(fd, data, SEEK_SET) == -1)
+		return -1;
+	return data - off;
+}
+
+/* Moves up to n bytes from src to dst inside the kernel, starting
+ * at the current offsets of their file descrs
+ * On a sparse regular source, holes are not copied: the offsets of
+ * both files simply jump over them, as long as dst is a regular
+ * file being extended, where skipped bytes read back as zeros
+ * Returns the number of bytes copied, -1 in case of error, or -2 if
+ * no kernel method applies and nothing was copied
+ */
+static ssize_t so_copy_kernel(SO_FILE *dst, SO_FILE *src, size_t n)
+{
+	struct stat src_st;
+	struct stat dst_st;
+	unsigned long long start = 0;
+	off_t src_off = 0;
+	off_t dst_off = 0;
+	off_t hole = 0;
+	off_t extent = -1;
+	size_t want = 0;
+	ssize_t moved = 0;
+	size_t done = 0;
+	bool sparse = false;
+	int method = 0;
+
+	/* the fd of a duplex SO_FILE is only its read side, and the one
+	 * of a compressed SO_FILE holds compressed blocks; checksums
+	 * need the data to pass through memory, and direct I/O needs
+	 * aligned offsets and buffers
+	 */
+	if (src->duplex != NULL || dst->duplex != NULL || src->z != NULL ||
+		dst->z != NULL || src->dio != NULL || dst->dio != NULL ||
+		src->csum_on || dst->csum_on)
+		return -2;
+	if (fstat(src->fd, &src_st) == -1 || fstat(dst->fd, &dst_st) == -1)
+		return -1;
+	method = so_copy_method(&dst_st, &src_st);
+	if (method == COPY_USER)
+		return -2;
+
+	sparse = method == COPY_RANGE && dst->mode_type != APPEND &&
+		dst->mode_type != APPENDPLUS;
+	if (sparse) {
+		src_off = lseek(src->fd, 0, SEEK_CUR);
+		dst_off = lseek(dst->fd, 0, SEEK_CUR);
+		sparse = src_off != -1 && dst_off != -1 &&
+			dst_off >= dst_st.st_size;
+	}
+
+	while (done < n) {
+		want = n - done;
+		if (sparse && extent <= 0) {
+			hole = so_copy_extent(src->fd, src_off,
+				src_st.st_size, &extent);
+			if (hole == -1)
+				return -1;
+			if ((size_t)hole > n - done)
+				hole = n - done;
+			if (hole > 0) {
+				src_off = lseek(src->fd, src_off + hole,
+					SEEK_SET);
+				dst_off = lseek(dst->fd, dst_off + hole,
+					SEEK_SET);
+				if (src_off == -1 || dst_off == -1)
+					return -1;
+				done += hole;
+				continue;
+			}
+		}
+		/* stop at the next hole, so the kernel does not fill it */
+		if (sparse && extent > 0 && (size_t)extent < want)
+			want = extent;
+
+		start = so_clock_ns();
+		moved = so_copy_call(method, dst->fd, src->fd, want);
+		if (moved == -1 && done == 0 && so_copy_unsupported(errno)) {
+			if (method == COPY_RANGE) {
+				/* e.g. across file systems on older kernels */
+				method = COPY_SENDFILE;
+				continue;
+			}
+			return -2;
+		}
+		dst->stats.write_calls++;
+		dst->stats.syscall_ns += so_clock_ns() - start;
+		if (moved == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (moved == 0)
+			break;
+		so_bc_wrote(dst, -1, moved);
+		src->stats.bytes_read += moved;
+		dst->stats.bytes_written += moved;
+		src_off += moved;
+		dst_off += moved;
+		done += moved;
+		if (extent > 0)
+			extent -= moved;
+	}
+
+	/* a hole at the very end still has to make the file longer */
+	if (sparse && dst_off > dst_st.st_size &&
+		fstat(dst->fd, &dst_st) == 0 && dst_off > dst_st.st_size &&
+		ftruncate(dst->fd, dst_off) == -1)
+		return -1;
+	return done;
+}
+
+/* Copies up to n bytes from the current position of src to the
+ * current position of dst, as so_fread followed by so_fwrite would
+ * Data already buffered in src is written out first, and data
+ * pending in dst is flushed; the rest then moves inside the kernel
+ * with copy_file_range, splice (pipes) or sendfile, skipping holes
+ * of sparse files, and through the buffer of src only when none of
+ * them applies
+ * Both SO_FILE locks must be held
+ * Returns the number of bytes copied, less than n only at EOF of
+ * src, or -1 in case of error
+ */
+static ssize_t so_fcopy_unlocked(SO_FILE *dst, SO_FILE *src, size_t n)
+{
+	ssize_t drained = 0;
+	ssize_t moved = -2;
+
+	if (so_ferror_unlocked(src) || so_ferror_unlocked(dst))
+		return -1;
+	if ((src->duplex != NULL && so_duplex_turn(src, LASTREAD)) ||
+		(dst->duplex != NULL && so_duplex_turn(dst, LASTWRITE)))
+		return -1;
+	if (src->last_op == LASTWRITE && so_fflush_unlocked(src) == SO_EOF)
+		return -1;
+	drained = so_copy_buffered(dst, src, n, false);
+	if (drained == -1 || (size_t)drained == n)
+		return drained;
+	/* a compressed or direct dst takes the data through its buffer */
+	if (dst->z == NULL && dst->dio == NULL &&
+		so_copy_sync_dst(dst) == -1)
+		return -1;
+
+	/* the block read ahead of a pipe cannot be given back */
+	if (src->mode_type != READMAP && !so_feof_unlocked(src) &&
+		(src->ra == NULL || so_seekable(src))) {
+		if (src->ra != NULL)
+			so_ra_cancel(src);
+		if (so_bc_sync(src)) {
+			src->found_error = 1;
+			return -1;
+		}
+		moved = so_copy_kernel(dst, src, n - drained);
+		if (moved == -1) {
+			dst->found_error = 1;
+			return -1;
+		}
+		if (moved >= 0) {
+			src->last_op = LASTREAD;
+			src->buff_pos = 0;
+			src->buff_size = 0;
+			src->pointer += moved;
+			dst->pointer += moved;
+			if ((size_t)moved < n - drained)
+				src->found_eof = true;
+		}
+	}
+	if (moved == -2)
+		moved = so_copy_buffered(dst, src, n - drained, true);
+	return moved == -1 ? -1 : drained + moved;
+}
+
+/* Same as so_fcopy_unlocked, holding the locks of both SO_FILEs,
+ * always taken in the same order
+ */
+ssize_t so_fcopy(SO_FILE *dst, SO_FILE *src, size_t n)
+{
+	SO_FILE *first = dst < src ? dst : src;
+	SO_FILE *second = dst < src ? src : dst;
+	ssize_t ret;
+
+	if (dst == src)
+		return -1;
+	so_flockfile(first);
+	so_flockfile(second);
+	ret = so_fcopy_unlocked(dst, src, n);
+	so_funlockfile(second);
+	so_funlockfile(first);
+	return ret;
+}
@@ -0,0 +1,806 @@
+#include "stdio_internal.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <wchar.h>
+
+#define FMT_LEFT	1	/* '-' */
+#define FMT_ZERO	2	/* '0' */
+#define FMT_PLUS	4	/* '+' */
+#define FMT_SPACE	8	/* ' ' */
+#define FMT_ALT		16	/* '#' */
+
+#define LEN_NONE	0
+#define LEN_HH		1
+#define LEN_H		2
+#define LEN_L		3
+#define LEN_LL		4
+#define LEN_J		5
+#define LEN_Z		6
+#define LEN_T		7
+#define LEN_BIGL	8
+
+#define FMT_MAXDIGITS	24
+#define FMT_SPECLEN	64
+
+/* Largest scaled %f value whose rounding is reliably exact */
+#define FMT_FLOAT_LIMIT	1099511627776.0
+
+/* One parsed conversion specification */
+struct fmt_spec {
+	int flags;
+	int width;
+	int prec;		/* -1 when not given */
+	int length;
+	char conv;
+};
+
+static const char so_digit_pairs[] =
+	"00010203040506070809101112131415161718192021222324"
+	"25262728293031323334353637383940414243444546474849"
+	"50515253545556575859606162636465666768697071727374"
+	"75767778798081828384858687888990919293949596979899";
+
+static const unsigned long long so_pow10[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL
+};
+
+/* Returns a pointer to at least n free bytes at the end of the
+ * SO_FILE buffer, flushing it first when they are not there
+ * Returns NULL if n exceeds the buffer capacity or in case of error
+ */
+static unsigned char *so_reserve(SO_FILE *stream, size_t n)
+{
+	if (n > stream->buff_capacity || so_get_buffer(stream) == SO_EOF)
+		return NULL;
+	if (stream->buff_capacity - stream->buff_size < n &&
+		so_write_out(stream, NULL, 0) == SO_EOF)
+		return NULL;
+	return stream->buffer + stream->buff_size;
+}
+
+/* Marks n bytes written after so_reserve as buffered data */
+static void so_commit(SO_FILE *stream, size_t n)
+{
+	stream->buff_size += n;
+	stream->buff_pos = stream->buff_size;
+}
+
+/* Appends len bytes from src to the SO_FILE buffer, flushing it
+ * whenever it fills up
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_put(SO_FILE *stream, const char *src, size_t len)
+{
+	unsigned char *dst = NULL;
+	size_t room = 0;
+
+	while (len > 0) {
+		dst = so_reserve(stream, 1);
+		if (dst == NULL)
+			return -1;
+		room = stream->buff_capacity - stream->buff_size;
+		if (room > len)
+			room = len;
+		memcpy(dst, src, room);
+		so_commit(stream, room);
+		src += room;
+		len -= room;
+	}
+	return 0;
+}
+
+/* Appends count copies of c to the SO_FILE buffer
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_pad(SO_FILE *stream, char c, size_t count)
+{
+	unsigned char *dst = NULL;
+	size_t room = 0;
+
+	while (count > 0) {
+		dst = so_reserve(stream, 1);
+		if (dst == NULL)
+			return -1;
+		room = stream->buff_capacity - stream->buff_size;
+		if (room > count)
+			room = count;
+		memset(dst, c, room);
+		so_commit(stream, room);
+		count -= room;
+	}
+	return 0;
+}
+
+/* Writes the decimal digits of value ending right before end,
+ * two at a time
+ * Returns the number of digits written
+ */
+static int so_utoa10(unsigned long long value, char *end)
+{
+	char *p = end;
+
+	while (value >= 100) {
+		p -= 2;
+		memcpy(p, so_digit_pairs + (value % 100) * 2, 2);
+		value /= 100;
+	}
+	if (value >= 10) {
+		p -= 2;
+		memcpy(p, so_digit_pairs + value * 2, 2);
+	} else {
+		*--p = '0' + value;
+	}
+	return end - p;
+}
+
+/* Writes the hexadecimal digits of value ending right before end
+ * Returns the number of digits written
+ */
+static int so_utoa16(unsigned long long value, char *end, bool upper)
+{
+	const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	char *p = end;
+
+	do {
+		*--p = digits[value & 0xf];
+		value >>= 4;
+	} while (value != 0);
+	return end - p;
+}
+
+/* Lays out a number as [pad][sign][zeros][digits][pad] honouring
+ * the width, precision and flags of spec, straight into the buffer
+ * when it fits
+ * Returns the number of characters written or -1 in case of error
+ */
+static int so_emit_number(SO_FILE *stream, const struct fmt_spec *spec,
+	char sign, const char *digits, int ndigits, int zeros)
+{
+	int body = (sign != 0) + zeros + ndigits;
+	int pad = spec->width > body ? spec->width - body : 0;
+	unsigned char *dst = NULL;
+	char *p = NULL;
+
+	if ((spec->flags & FMT_ZERO) && !(spec->flags & FMT_LEFT)) {
+		zeros += pad;
+		body += pad;
+		pad = 0;
+	}
+
+	dst = so_reserve(stream, body + pad);
+	if (dst == NULL) {
+		if (so_ferror_unlocked(stream))
+			return -1;
+		/* wider than the whole buffer: emit it piece by piece */
+		if (!(spec->flags & FMT_LEFT) && so_pad(stream, ' ', pad))
+			return -1;
+		if ((sign != 0 && so_put(stream, &sign, 1)) ||
+			so_pad(stream, '0', zeros) ||
+			so_put(stream, digits, ndigits))
+			return -1;
+		if ((spec->flags & FMT_LEFT) && so_pad(stream, ' ', pad))
+			return -1;
+		return body + pad;
+	}
+
+	p = (char *)dst;
+	if (!(spec->flags & FMT_LEFT)) {
+		memset(p, ' ', pad);
+		p += pad;
+	}
+	if (sign != 0)
+		*p++ = sign;
+	memset(p, '0', zeros);
+	p += zeros;
+	memcpy(p, digits, ndigits);
+	p += ndigits;
+	if (spec->flags & FMT_LEFT) {
+		memset(p, ' ', pad);
+		p += pad;
+	}
+	so_commit(stream, body + pad);
+	return body + pad;
+}
+
+/* Formats an integer conversion (d, i, u, x, X)
+ * Returns the number of characters written or -1 in case of error
+ */
+static int so_format_int(SO_FILE *stream, const struct fmt_spec *spec,
+	unsigned long long magnitude, bool negative)
+{
+	char buf[FMT_MAXDIGITS];
+	char sign = 0;
+	int ndigits = 0;
+	int zeros = 0;
+
+	if (negative)
+		sign = '-';
+	else if ((spec->conv == 'd' || spec->conv == 'i') &&
+		(spec->flags & FMT_PLUS))
+		sign = '+';
+	else if ((spec->conv == 'd' || spec->conv == 'i') &&
+		(spec->flags & FMT_SPACE))
+		sign = ' ';
+
+	if (spec->prec == 0 && magnitude == 0)
+		ndigits = 0;
+	else if (spec->conv == 'x' || spec->conv == 'X')
+		ndigits = so_utoa16(magnitude, buf + sizeof(buf),
+			spec->conv == 'X');
+	else
+		ndigits = so_utoa10(magnitude, buf + sizeof(buf));
+
+	if (spec->prec > ndigits)
+		zeros = spec->prec - ndigits;
+	if (spec->prec >= 0) {
+		/* an explicit precision disables zero padding */
+		struct fmt_spec plain = *spec;
+
+		plain.flags &= ~FMT_ZERO;
+		return so_emit_number(stream, &plain, sign,
+			buf + sizeof(buf) - ndigits, ndigits, zeros);
+	}
+	return so_emit_number(stream, spec, sign, buf + sizeof(buf) - ndigits,
+		ndigits, zeros);
+}
+
+/* Formats %f with at most 9 decimals through integer arithmetic
+ * Values too large, not finite, or too close to a rounding tie
+ * to be sure of the last digit are left to the C library
+ * Returns the number of characters written, -1 in case of error
+ * or -2 if the value needs the slow path
+ */
+static int so_format_fixed(SO_FILE *stream, const struct fmt_spec *spec,
+	double value)
+{
+	char buf[2 * FMT_MAXDIGITS];
+	char *end = buf + sizeof(buf);
+	int prec = spec->prec < 0 ? 6 : spec->prec;
+	unsigned long long scaled_int = 0;
+	unsigned long long frac = 0;
+	double magnitude = 0;
+	double scaled = 0;
+	double rest = 0;
+	char sign = 0;
+	int ndigits = 0;
+
+	if (prec > 9 || (spec->flags & FMT_ALT) || !isfinite(value))
+		return -2;
+	magnitude = signbit(value) ? -value : value;
+	scaled = magnitude * so_pow10[prec];
+	if (scaled >= FMT_FLOAT_LIMIT)
+		return -2;
+	scaled_int = (unsigned long long)scaled;
+	rest = scaled - scaled_int;
+	if (rest > 0.499 && rest < 0.501)
+		return -2;
+	scaled_int += rest > 0.5;
+
+	if (signbit(value))
+		sign = '-';
+	else if (spec->flags & FMT_PLUS)
+		sign = '+';
+	else if (spec->flags & FMT_SPACE)
+		sign = ' ';
+
+	if (prec > 0) {
+		frac = scaled_int % so_pow10[prec];
+		ndigits = so_utoa10(frac, end);
+		/* leading zeros of the fractional part */
+		while (ndigits < prec)
+			end[-++ndigits] = '0';
+		end[-++ndigits] = '.';
+	}
+	ndigits += so_utoa10(scaled_int / so_pow10[prec], end - ndigits);
+	return so_emit_number(stream, spec, sign, end - ndigits, ndigits, 0);
+}
+
+/* Formats %s and %c, whose text is copied straight from the
+ * argument into the buffer
+ * Returns the number of characters written or -1 in case of error
+ */
+static int so_format_text(SO_FILE *stream, const struct fmt_spec *spec,
+	const char *text, size_t len)
+{
+	size_t pad = 0;
+
+	if (spec->prec >= 0 && (size_t)spec->prec < len)
+		len = spec->prec;
+	if (spec->width > 0 && (size_t)spec->width > len)
+		pad = spec->width - len;
+	if (!(spec->flags & FMT_LEFT) && so_pad(stream, ' ', pad))
+		return -1;
+	if (so_put(stream, text, len))
+		return -1;
+	if ((spec->flags & FMT_LEFT) && so_pad(stream, ' ', pad))
+		return -1;
+	return len + pad;
+}
+
+/* Rebuilds the text of a conversion specification, with any '*'
+ * already resolved, for the C library to handle
+ */
+static void so_spec_string(const struct fmt_spec *spec, char *out,
+	const char *length)
+{
+	char *p = out;
+
+	*p++ = '%';
+	if (spec->flags & FMT_LEFT)
+		*p++ = '-';
+	if (spec->flags & FMT_ZERO)
+		*p++ = '0';
+	if (spec->flags & FMT_PLUS)
+		*p++ = '+';
+	if (spec->flags & FMT_SPACE)
+		*p++ = ' ';
+	if (spec->flags & FMT_ALT)
+		*p++ = '#';
+	if (spec->width > 0)
+		p += sprintf(p, "%d", spec->width);
+	if (spec->prec >= 0)
+		p += sprintf(p, ".%d", spec->prec);
+	p += sprintf(p, "%s%c", length, spec->conv);
+}
+
+/* Formats a conversion the fast paths do not cover (e, g, a, o, p,
+ * wide characters, ...) with snprintf, writing into the free part
+ * of the buffer; only an output larger than the whole buffer goes
+ * through a temporary allocation
+ * Returns the number of characters written or -1 in case of error
+ */
+static int so_format_slow(SO_FILE *stream, const struct fmt_spec *spec,
+	va_list *ap)
+{
+	char fmt[FMT_SPECLEN];
+	unsigned char *dst = NULL;
+	char *tmp = NULL;
+	long double ld = 0;
+	double d = 0;
+	void *ptr = NULL;
+	unsigned long long u = 0;
+	long long s = 0;
+	wint_t wc = 0;
+	wchar_t *ws = NULL;
+	size_t room = 0;
+	int kind = 0;
+	int len = 0;
+	int pass = 0;
+
+	switch (spec->conv) {
+	case 'e': case 'E': case 'f': case 'F':
+	case 'g': case 'G': case 'a': case 'A':
+		kind = spec->length == LEN_BIGL ? 1 : 2;
+		if (kind == 1)
+			ld = va_arg(*ap, long double);
+		else
+			d = va_arg(*ap, double);
+		so_spec_string(spec, fmt, kind == 1 ? "L" : "");
+		break;
+	case 'p':
+		kind = 3;
+		ptr = va_arg(*ap, void *);
+		so_spec_string(spec, fmt, "");
+		break;
+	case 'c':
+		kind = 4;
+		wc = va_arg(*ap, wint_t);
+		so_spec_string(spec, fmt, "l");
+		break;
+	case 's':
+		kind = 5;
+		ws = va_arg(*ap, wchar_t *);
+		so_spec_string(spec, fmt, "l");
+		break;
+	case 'd': case 'i':
+		kind = 6;
+		if (spec->length == LEN_LL || spec->length == LEN_J)
+			s = va_arg(*ap, long long);
+		else if (spec->length == LEN_L || spec->length == LEN_Z ||
+			spec->length == LEN_T)
+			s = va_arg(*ap, long);
+		else
+			s = va_arg(*ap, int);
+		so_spec_string(spec, fmt, "ll");
+		break;
+	default:
+		kind = 7;
+		if (spec->length == LEN_LL || spec->length == LEN_J)
+			u = va_arg(*ap, unsigned long long);
+		else if (spec->length == LEN_L || spec->length == LEN_Z ||
+			spec->length == LEN_T)
+			u = va_arg(*ap, unsigned long);
+		else
+			u = va_arg(*ap, unsigned int);
+		if (spec->length == LEN_HH)
+			u = (unsigned char)u;
+		else if (spec->length == LEN_H)
+			u = (unsigned short)u;
+		so_spec_string(spec, fmt, "ll");
+		break;
+	}
+
+	/* first try the free space left, then a flushed buffer */
+	for (pass = 0; pass < 2; pass++) {
+		dst = so_reserve(stream, 1);
+		if (dst == NULL)
+			return -1;
+		room = stream->buff_capacity - stream->buff_size;
+		tmp = (char *)dst;
+		if (pass == 1 && len >= (int)room) {
+			tmp = malloc(len + 1);
+			if (tmp == NULL)
+				return -1;
+			room = len + 1;
+		}
+
+		if (kind == 1)
+			len = snprintf(tmp, room, fmt, ld);
+		else if (kind == 2)
+			len = snprintf(tmp, room, fmt, d);
+		else if (kind == 3)
+			len = snprintf(tmp, room, fmt, ptr);
+		else if (kind == 4)
+			len = snprintf(tmp, room, fmt, wc);
+		else if (kind == 5)
+			len = snprintf(tmp, room, fmt, ws);
+		else if (kind == 6)
+			len = snprintf(tmp, room, fmt, s);
+		else
+			len = snprintf(tmp, room, fmt, u);
+		if (len < 0) {
+			if (tmp != (char *)dst)
+				free(tmp);
+			return -1;
+		}
+
+		if (tmp != (char *)dst) {
+			len = so_put(stream, tmp, len) ? -1 : len;
+			free(tmp);
+			return len;
+		}
+		if ((size_t)len < room) {
+			so_commit(stream, len);
+			return len;
+		}
+		if (pass == 0 && so_write_out(stream, NULL, 0) == SO_EOF)
+			return -1;
+	}
+	return -1;
+}
+
+/* Reads the flags, width, precision and length of a conversion
+ * specification starting right after '%'
+ * Returns a pointer to the conversion character
+ */
+static const char *so_parse_spec(const char *p, struct fmt_spec *spec,
+	va_list *ap)
+{
+	spec->flags = 0;
+	spec->width = 0;
+	spec->prec = -1;
+	spec->length = LEN_NONE;
+
+	for (;; p++) {
+		if (*p == '-')
+			spec->flags |= FMT_LEFT;
+		else if (*p == '0')
+			spec->flags |= FMT_ZERO;
+		else if (*p == '+')
+			spec->flags |= FMT_PLUS;
+		else if (*p == ' ')
+			spec->flags |= FMT_SPACE;
+		else if (*p == '#')
+			spec->flags |= FMT_ALT;
+		else
+			break;
+	}
+
+	if (*p == '*') {
+		spec->width = va_arg(*ap, int);
+		if (spec->width < 0) {
+			spec->flags |= FMT_LEFT;
+			spec->width = -spec->width;
+		}
+		p++;
+	} else {
+		while (*p >= '0' && *p <= '9')
+			spec->width = spec->width * 10 + (*p++ - '0');
+	}
+
+	if (*p == '.') {
+		p++;
+		spec->prec = 0;
+		if (*p == '*') {
+			spec->prec = va_arg(*ap, int);
+			if (spec->prec < 0)
+				spec->prec = -1;
+			p++;
+		} else {
+			while (*p >= '0' && *p <= '9')
+				spec->prec = spec->prec * 10 + (*p++ - '0');
+		}
+	}
+
+	if (p[0] == 'h' && p[1] == 'h') {
+		spec->length = LEN_HH;
+		p += 2;
+	} else if (p[0] == 'l' && p[1] == 'l') {
+		spec->length = LEN_LL;
+		p += 2;
+	} else if (*p == 'h' || *p == 'l' || *p == 'j' || *p == 'z' ||
+		*p == 't' || *p == 'L' || *p == 'q') {
+		spec->length = *p == 'h' ? LEN_H : *p == 'l' ? LEN_L :
+			*p == 'j' ? LEN_J : *p == 'z' ? LEN_Z :
+			*p == 't' ? LEN_T : *p == 'q' ? LEN_LL : LEN_BIGL;
+		p++;
+	}
+	spec->conv = *p;
+	return p;
+}
+
+/* Fetches a signed integer argument of the given length modifier */
+static long long so_arg_signed(int length, va_list *ap)
+{
+	switch (length) {
+	case LEN_HH:
+		return (signed char)va_arg(*ap, int);
+	case LEN_H:
+		return (short)va_arg(*ap, int);
+	case LEN_L:
+		return va_arg(*ap, long);
+	case LEN_LL:
+		return va_arg(*ap, long long);
+	case LEN_J:
+		return va_arg(*ap, intmax_t);
+	case LEN_Z:
+		return va_arg(*ap, ssize_t);
+	case LEN_T:
+		return va_arg(*ap, ptrdiff_t);
+	default:
+		return va_arg(*ap, int);
+	}
+}
+
+/* Fetches an unsigned integer argument of the given length modifier */
+static unsigned long long so_arg_unsigned(int length, va_list *ap)
+{
+	switch (length) {
+	case LEN_HH:
+		return (unsigned char)va_arg(*ap, unsigned int);
+	case LEN_H:
+		return (unsigned short)va_arg(*ap, unsigned int);
+	case LEN_L:
+		return va_arg(*ap, unsigned long);
+	case LEN_LL:
+		return va_arg(*ap, unsigned long long);
+	case LEN_J:
+		return va_arg(*ap, uintmax_t);
+	case LEN_Z:
+		return va_arg(*ap, size_t);
+	case LEN_T:
+		return va_arg(*ap, ptrdiff_t);
+	default:
+		return va_arg(*ap, unsigned int);
+	}
+}
+
+/* Stores the count of bytes written so far for %n, through the
+ * pointer type the length modifier selects
+ */
+static void so_store_count(int length, va_list *ap, long long total)
+{
+	switch (length) {
+	case LEN_HH:
+		*va_arg(*ap, signed char *) = total;
+		break;
+	case LEN_H:
+		*va_arg(*ap, short *) = total;
+		break;
+	case LEN_L:
+		*va_arg(*ap, long *) = total;
+		break;
+	case LEN_LL:
+		*va_arg(*ap, long long *) = total;
+		break;
+	case LEN_J:
+		*va_arg(*ap, intmax_t *) = total;
+		break;
+	case LEN_Z:
+		*va_arg(*ap, ssize_t *) = total;
+		break;
+	case LEN_T:
+		*va_arg(*ap, ptrdiff_t *) = total;
+		break;
+	default:
+		*va_arg(*ap, int *) = total;
+		break;
+	}
+}
+
+/* Formats into the SO_FILE as vfprintf does, with the SO_FILE
+ * lock already held
+ * Literal text, integers, %s, %c and plain %f are written straight
+ * into the SO_FILE buffer; the remaining conversions are rendered
+ * by snprintf into the free part of the same buffer
+ * An unbuffered SO_FILE formats into a buffer on the stack instead,
+ * written out once at the end
+ * Returns the number of characters written or a negative value
+ * in case of error
+ */
+int so_vfprintf_unlocked(SO_FILE *stream, const char *format, va_list ap)
+{
+	unsigned char local[BUFFCAPACIT];
+	unsigned char *own = NULL;
+	struct fmt_spec spec;
+	const char *p = format;
+	const char *run = NULL;
+	const char *text = NULL;
+	unsigned long long u = 0;
+	long long s = 0;
+	bool newline = false;
+	va_list args;
+	int total = 0;
+	int ret = 0;
+	char c = 0;
+
+	if (stream->mode_type == READMAP)
+		stream->found_error = 1;
+	if (so_ferror_unlocked(stream))
+		return -1;
+	if (stream->duplex != NULL && so_duplex_turn(stream, LASTWRITE))
+		return -1;
+	stream->last_op = LASTWRITE;
+	/* its 1-byte buffer would take a write per character */
+	if (stream->buff_mode == SO_IONBF) {
+		own = stream->buffer;
+		if (stream->buff_size > 0)
+			memcpy(local, own, stream->buff_size);
+		stream->buffer = local;
+		stream->buff_capacity = sizeof(local);
+	}
+
+	va_copy(args, ap);
+	while (*p != '\0' && ret >= 0) {
+		if (*p != '%' || p[1] == '%') {
+			run = p;
+			if (*p == '%')
+				run = ++p;
+			p++;
+			while (*p != '\0' && *p != '%')
+				p++;
+			if (memchr(run, '\n', p - run) != NULL)
+				newline = true;
+			ret = so_put(stream, run, p - run) ? -1 : p - run;
+			total += ret;
+			continue;
+		}
+
+		p = so_parse_spec(p + 1, &spec, &args);
+		switch (spec.conv) {
+		case 'd':
+		case 'i':
+			if (spec.flags & FMT_ALT) {
+				ret = so_format_slow(stream, &spec, &args);
+				break;
+			}
+			s = so_arg_signed(spec.length, &args);
+			u = s < 0 ? 0ULL - (unsigned long long)s :
+				(unsigned long long)s;
+			ret = so_format_int(stream, &spec, u, s < 0);
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+			if (spec.flags & FMT_ALT) {
+				ret = so_format_slow(stream, &spec, &args);
+				break;
+			}
+			u = so_arg_unsigned(spec.length, &args);
+			ret = so_format_int(stream, &spec, u, false);
+			break;
+		case 'f':
+		case 'F':
+			if (spec.length == LEN_BIGL) {
+				ret = so_format_slow(stream, &spec, &args);
+				break;
+			}
+			{
+				va_list peek;
+
+				/* keep the argument for the slow path */
+				va_copy(peek, args);
+				ret = so_format_fixed(stream, &spec,
+					va_arg(args, double));
+				if (ret == -2)
+					ret = so_format_slow(stream, &spec,
+						&peek);
+				va_end(peek);
+			}
+			break;
+		case 's':
+			if (spec.length == LEN_L) {
+				ret = so_format_slow(stream, &spec, &args);
+				break;
+			}
+			text = va_arg(args, const char *);
+			if (text == NULL)
+				text = "(null)";
+			ret = so_format_text(stream, &spec, text,
+				spec.prec >= 0 ? strnlen(text, spec.prec) :
+				strlen(text));
+			if (!newline && memchr(text, '\n', ret) != NULL)
+				newline = true;
+			break;
+		case 'c':
+			if (spec.length == LEN_L) {
+				ret = so_format_slow(stream, &spec, &args);
+				break;
+			}
+			c = (char)va_arg(args, int);
+			newline = newline || c == '\n';
+			spec.prec = -1;
+			ret = so_format_text(stream, &spec, &c, 1);
+			break;
+		case 'n':
+			so_store_count(spec.length, &args, total);
+			ret = 0;
+			break;
+		case '\0':
+			p--;
+			ret = 0;
+			break;
+		default:
+			ret = so_format_slow(stream, &spec, &args);
+			break;
+		}
+		total += ret;
+		p++;
+	}
+	va_end(args);
+
+	if (ret < 0)
+		stream->found_error = 1;
+	else if (stream->buff_mode == SO_IOLBF && newline)
+		ret = so_write_out(stream, NULL, 0);
+	if (stream->buffer == local) {
+		/* what a failed write leaves is dropped, as unbuffered */
+		if (so_write_out(stream, NULL, 0) == SO_EOF)
+			ret = -1;
+		stream->buffer = own;
+		stream->buff_capacity = 1;
+		stream->buff_size = 0;
+		stream->buff_pos = 0;
+	}
+	return ret < 0 ? -1 : total;
+}
+
+/* Same as so_vfprintf_unlocked, holding the lock of the SO_FILE */
+int so_vfprintf(SO_FILE *stream, const char *format, va_list ap)
+{
+	int ret;
+
+	so_flockfile(stream);
+	ret = so_vfprintf_unlocked(stream, format, ap);
+	so_funlockfile(stream);
+	return ret;
+}
+
+/* Writes formatted output to the SO_FILE, as fprintf does
+ * Returns the number of characters written or a negative value
+ * in case of error
+ */
+int so_fprintf(SO_FILE *stream, const char *format, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, format);
+	ret = so_vfprintf(stream, format, ap);
+	va_end(ap);
+	return ret;
+}
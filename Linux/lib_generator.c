@@ -1,20 +1,239 @@
 #include "stdio_internal.h"
 #include <string.h>
 
+/* Allocates a new SO_FILE structure around the given file descr
+ * and adds it to the list of open streams
+ * The stream starts fully buffered with a BUFFCAPACIT buffer,
+ * which is only allocated at the first I/O operation, and
+ * unlocked
+ * Returns NULL in case of error
+ */
+static SO_FILE *so_new_file(int fd, int mode_type, pid_t pid,
+	const char *name)
+{
+	SO_FILE *file = malloc(sizeof(SO_FILE));
+	pthread_mutexattr_t attr;
+
+	if (file == NULL)
+		return NULL;
+
+	/* recursive, so so_flockfile holders can call locked functions */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&file->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	file->fd = fd;
+	file->pointer = 0;
+	file->mode_type = mode_type;
+	file->buffer = NULL;
+	file->buff_capacity = BUFFCAPACIT;
+	file->buff_mode = SO_IOFBF;
+	file->buff_owned = false;
+	file->buff_size = 0;
+	file->buff_pos = 0;
+	file->last_op = -1;
+	file->found_eof = false;
+	file->pid = pid;
+	file->found_error = -1;
+	file->map_advice = MADV_NORMAL;
+	file->seekable = -1;
+	file->pipe_flags = 0;
+	file->ra = NULL;
+	file->wb = NULL;
+	file->duplex = NULL;
+	file->z = NULL;
+	file->dio = NULL;
+	file->csum_on = false;
+	file->csum = 0;
+	file->cached = false;
+	file->fd_stale = false;
+	file->line_buf = NULL;
+	file->line_cap = 0;
+	so_register(file, name);
+	return file;
+}
+
+/* Frees memory for given SO_FILE, together with its buffer
+ * when it was allocated by the library, after removing it from
+ * the list of open streams
+ */
+static void so_free_file(SO_FILE *stream)
+{
+	so_unregister(stream);
+	pthread_mutex_destroy(&stream->lock);
+	if (stream->mode_type == READMAP)
+		munmap(stream->buffer, stream->buff_capacity);
+	else if (stream->buff_owned)
+		free(stream->buffer);
+	if (stream->duplex != NULL) {
+		if (stream->duplex->wfd != -1)
+			close(stream->duplex->wfd);
+		free(stream->duplex->stash);
+		free(stream->duplex);
+	}
+	so_z_free(stream);
+	so_dio_free(stream);
+	free(stream->line_buf);
+	free(stream);
+}
+
+/* Acquires the lock of the SO_FILE, waiting for other threads
+ * Can be taken several times by the same thread, so a group of
+ * calls, locked or _unlocked, may run without interleaving
+ */
+void so_flockfile(SO_FILE *stream)
+{
+	pthread_mutex_lock(&stream->lock);
+}
+
+/* Releases the lock of the SO_FILE taken with so_flockfile */
+void so_funlockfile(SO_FILE *stream)
+{
+	pthread_mutex_unlock(&stream->lock);
+}
+
+/* Makes sure the SO_FILE has a buffer, allocating one of
+ * buff_capacity bytes at the first I/O operation
+ * Returns 0 at succes, SO_EOF in case of error
+ */
+int so_get_buffer(SO_FILE *stream)
+{
+	if (stream->buffer != NULL)
+		return 0;
+
+	if (stream->buff_mode == SO_IONBF) {
+		stream->buffer = stream->unbuf_byte;
+		return 0;
+	}
+	stream->buffer = malloc(stream->buff_capacity);
+	if (stream->buffer == NULL) {
+		stream->found_error = 1;
+		return SO_EOF;
+	}
+	stream->buff_owned = true;
+	return 0;
+}
+
+/* Changes the buffering of the SO_FILE to one of SO_IOFBF (full),
+ * SO_IOLBF (flushed at every newline) or SO_IONBF (unbuffered)
+ * A non-NULL buf of size bytes is used instead of an internal
+ * buffer; a zero size keeps the default BUFFCAPACIT capacity
+ * Must be called while no data waits in the buffer, to be written
+ * or read, and read-ahead is off; read data already handed out is
+ * dropped. It has no effect on a memory-mapped SO_FILE, and it cannot
+ * change the block buffer of a compressed one or the aligned
+ * buffer of a direct I/O one
+ * Returns 0 at succes, -1 in case of error
+ */
+int so_setvbuf_unlocked(SO_FILE *stream, char *buf, int mode, size_t size)
+{
+	if (mode != SO_IOFBF && mode != SO_IOLBF && mode != SO_IONBF)
+		return -1;
+	if (stream->mode_type == READMAP || stream->ra != NULL ||
+		stream->wb != NULL || stream->z != NULL || stream->dio != NULL)
+		return -1;
+	if (stream->last_op == LASTWRITE ? stream->buff_size != 0 :
+		stream->buff_pos != stream->buff_size)
+		return -1;
+
+	if (stream->buff_owned)
+		free(stream->buffer);
+	stream->buffer = NULL;
+	stream->buff_owned = false;
+	stream->buff_pos = 0;
+	stream->buff_size = 0;
+	stream->buff_mode = mode;
+
+	if (mode == SO_IONBF) {
+		stream->buff_capacity = 1;
+	} else if (buf != NULL && size > 0) {
+		stream->buffer = (unsigned char *)buf;
+		stream->buff_capacity = size;
+	} else {
+		stream->buff_capacity = size > 0 ? size : BUFFCAPACIT;
+	}
+	return 0;
+}
+
+/* Same as so_setvbuf_unlocked, holding the lock of the SO_FILE */
+int so_setvbuf(SO_FILE *stream, char *buf, int mode, size_t size)
+{
+	int ret;
+
+	so_flockfile(stream);
+	ret = so_setvbuf_unlocked(stream, buf, mode, size);
+	so_funlockfile(stream);
+	return ret;
+}
+
+/* Maps the whole file of a SO_FILE opened in "rm" mode, using
+ * the mapping as its buffer, so reads and seeks become pointer
+ * arithmetic; the kernel is told to expect sequential access
+ * Pipes, special files and empty files fall back to the regular
+ * buffered READ mode
+ */
+static void so_map_file(SO_FILE *stream)
+{
+	struct stat st;
+	void *map = NULL;
+
+	stream->mode_type = READ;
+	if (fstat(stream->fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+		st.st_size == 0)
+		return;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, stream->fd, 0);
+	if (map == MAP_FAILED)
+		return;
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	stream->mode_type = READMAP;
+	stream->seekable = 1;
+	stream->map_advice = MADV_SEQUENTIAL;
+	stream->buffer = map;
+	stream->buff_capacity = st.st_size;
+	stream->buff_size = st.st_size;
+	stream->buff_pos = 0;
+}
+
+/* Tells whether the file descr of the SO_FILE supports lseek,
+ * probing it only the first time the answer is needed
+ */
+bool so_seekable(SO_FILE *stream)
+{
+	if (stream->seekable == -1)
+		stream->seekable = lseek(stream->fd, 0, SEEK_CUR) != -1;
+	return stream->seekable;
+}
+
 /* Allocates and returns a new SO_FILE structure
  * Reading and writing permission coresponding to mode string
+ * Mode "rm" reads the file through a memory mapping
+ * Modes "rz" and "wz" read and write a file compressed in
+ * independent blocks, see zfile.c
+ * Modes "rd" and "wd" read and write the file with O_DIRECT,
+ * bypassing the page cache, see direct.c
+ * No system call besides open is made, and an fstat while the
+ * block cache is on; EOF is only found by the first read that
+ * reaches it
  * Returns NULL in case of error
  */
 SO_FILE *so_fopen(const char *pathname, const char *mode)
 {
 	int fd = -1;
 	int mode_type = -1;
+	int err = 0;
+	bool packed = false;
+	bool direct = false;
 	SO_FILE *file = NULL;
-	long end_position = -1;
 
 	if (strcmp(mode, "r") == 0) {
 		fd = open(pathname, O_RDONLY);
 		mode_type = READ;
+	} else if (strcmp(mode, "rm") == 0) {
+		fd = open(pathname, O_RDONLY);
+		mode_type = READMAP;
 	} else if (strcmp(mode, "r+") == 0) {
 		fd = open(pathname, O_RDWR);
 		mode_type = READPLUS;
@@ -30,33 +249,140 @@ SO_FILE *so_fopen(const char *pathname, const char *mode)
 	} else if (strcmp(mode, "a+") == 0) {
 		fd = open(pathname, O_RDWR | O_APPEND | O_CREAT, 0644);
 		mode_type = APPENDPLUS;
+	} else if (strcmp(mode, "rz") == 0) {
+		fd = open(pathname, O_RDONLY);
+		mode_type = READ;
+		packed = true;
+	} else if (strcmp(mode, "wz") == 0) {
+		fd = open(pathname, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+		mode_type = WRITE;
+		packed = true;
+	} else if (strcmp(mode, "rd") == 0) {
+		fd = so_dio_open_fd(pathname, false);
+		mode_type = READ;
+		direct = true;
+	} else if (strcmp(mode, "wd") == 0) {
+		fd = so_dio_open_fd(pathname, true);
+		mode_type = WRITE;
+		direct = true;
 	}
 
 	if (fd != -1) {
-		file = malloc(sizeof(SO_FILE));
+		file = so_new_file(fd, mode_type, -1, pathname);
 		if (file != NULL) {
-			file->fd = fd;
-			file->pointer = lseek(fd, 0, SEEK_CUR);
-			file->mode_type = mode_type;
-			memset(file->buffer, 0, sizeof(file->buffer));
-			file->last_op = -1;
-
-			end_position = lseek(fd, 0, SEEK_END);
-			if (file->pointer == end_position)
-				file->found_eof = true;
-			else
-				file->found_eof = false;
-			lseek(fd, file->pointer, SEEK_SET);
-
-			file->pid = -1;
-			file->found_error = -1;
-			file->buff_pos = 0;
-			file->buff_size = 0;
+			if (mode_type == READMAP)
+				so_map_file(file);
+			so_bc_probe(file);
+			/* truncated: cached blocks of the file are gone */
+			if (mode_type == WRITE || mode_type == WRITEPLUS)
+				so_bc_wrote(file, 0, -1);
+			if ((packed && so_z_open(file, mode_type == WRITE)) ||
+				(direct &&
+				so_dio_open(file, mode_type == WRITE))) {
+				err = errno;
+				so_free_file(file);
+				file = NULL;
+				errno = err;
+			}
+		}
+		if (file == NULL) {
+			err = errno;
+			close(fd);
+			errno = err;
 		}
 	}
 	return file;
 }
 
+/* Writes to file the content of the SO_FILE buffer, followed
+ * by len bytes from ptr, using a single writev call whenever
+ * the file accepts all of them at once
+ * Partial writes are resumed until everything is written
+ * Empties the buffer and advances the internal pointer; with
+ * write-behind, the data is only queued for the writer thread
+ * Returns 0 at succes, SO_EOF in case of error
+ */
+int so_write_out(SO_FILE *stream, const void *ptr, size_t len)
+{
+	struct iovec iov[2];
+	struct iovec *cur = iov;
+	int iovcnt = 2;
+	ssize_t bytes_written = 0;
+	size_t remaining = stream->buff_size + len;
+	size_t chunk = 0;
+	unsigned long long start = 0;
+
+	if (stream->ra != NULL)
+		so_ra_cancel(stream);
+	if (stream->wb != NULL)
+		return so_wb_write_out(stream, ptr, len);
+	if (stream->z != NULL)
+		return so_z_write_out(stream, ptr, len);
+	if (stream->dio != NULL)
+		return so_dio_write_out(stream, ptr, len);
+
+	/* the payload is vmspliced, but the buffer is reused: copy it */
+	if (len > 0 && (stream->pipe_flags & SO_PIPE_VMSPLICE)) {
+		if (stream->buff_size > 0 &&
+			so_write_out(stream, NULL, 0) == SO_EOF)
+			return SO_EOF;
+		so_csum(stream, ptr, len);
+		return so_pipe_vmsplice(stream, ptr, len);
+	}
+
+	so_csum(stream, stream->buffer, stream->buff_size);
+	so_csum(stream, ptr, len);
+
+	if (remaining > 0)
+		stream->stats.flushes++;
+
+	iov[0].iov_base = stream->buffer;
+	iov[0].iov_len = stream->buff_size;
+	iov[1].iov_base = (void *)ptr;
+	iov[1].iov_len = len;
+
+	while (iovcnt > 0) {
+		if (cur->iov_len == 0) {
+			cur++;
+			iovcnt--;
+			continue;
+		}
+		start = so_clock_ns();
+		if (stream->duplex != NULL)
+			bytes_written = so_duplex_writev(stream, cur, iovcnt);
+		else
+			bytes_written = writev(stream->fd, cur, iovcnt);
+		stream->stats.write_calls++;
+		stream->stats.syscall_ns += so_clock_ns() - start;
+		if (bytes_written <= 0) {
+			stream->found_error = 1;
+			return SO_EOF;
+		}
+		if ((size_t)bytes_written < remaining)
+			stream->stats.short_writes++;
+		remaining -= bytes_written;
+		stream->stats.bytes_written += bytes_written;
+		so_bc_wrote(stream, stream->pointer, bytes_written);
+		stream->pointer += bytes_written;
+		while (bytes_written > 0) {
+			chunk = cur->iov_len;
+			if (chunk > (size_t)bytes_written)
+				chunk = bytes_written;
+			cur->iov_base = (unsigned char *)cur->iov_base + chunk;
+			cur->iov_len -= chunk;
+			bytes_written -= chunk;
+			if (cur->iov_len == 0) {
+				cur++;
+				iovcnt--;
+			}
+		}
+	}
+
+	stream->buff_pos = 0;
+	stream->buff_size = 0;
+	return 0;
+}
+
 /* Frees memory for given SO_FILE and closes its file descr
  * The function flushes to file the remaining elements
  * in the buffer of the SO_FILE
@@ -66,99 +392,196 @@ int so_fclose(SO_FILE *stream)
 {
 	int ret = 0;
 
+	so_flockfile(stream);
+	so_ra_destroy(stream);
 	if (stream->last_op == LASTWRITE)
-		ret = so_fflush(stream);
+		ret = so_fflush_unlocked(stream);
+	so_wb_destroy(stream);
+	if (stream->z != NULL)
+		ret |= so_z_finish(stream);
 	ret |= close(stream->fd);
-	free(stream);
+	/* still listed until freed: keep so_fflush_all off it */
+	stream->last_op = -1;
+	so_funlockfile(stream);
+	so_free_file(stream);
 	return ret;
 }
 
+/* Moves the internal pointer of a memory-mapped SO_FILE
+ * Moving it anywhere else than the current position switches
+ * the mapping to random access, disabling kernel read-ahead
+ * Seeking past the end is allowed, the next read finding EOF
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_map_seek(SO_FILE *stream, long offset, int whence)
+{
+	long target = -1;
+
+	if (whence == SEEK_SET)
+		target = offset;
+	else if (whence == SEEK_CUR)
+		target = stream->pointer + offset;
+	else if (whence == SEEK_END)
+		target = stream->buff_size + offset;
+	if (target < 0) {
+		stream->found_error = 1;
+		return -1;
+	}
+
+	if (target != stream->pointer &&
+		stream->map_advice != MADV_RANDOM) {
+		madvise(stream->buffer, stream->buff_size, MADV_RANDOM);
+		stream->map_advice = MADV_RANDOM;
+	}
+	stream->pointer = target;
+	if ((size_t)target < stream->buff_size)
+		stream->buff_pos = target;
+	else
+		stream->buff_pos = stream->buff_size;
+	stream->found_eof = false;
+	return 0;
+}
+
 /* Moves SO_FILE internal pointer, based on sum of
  * offset and whence
  * Offset could be a negative number
- * In case of a previous read operation, its content
- * is invalidated
+ * After a read operation on a read-only SO_FILE, a target within
+ * the buffered bytes only moves the buffer position; any other
+ * target invalidates the buffer, as well as any block being read
+ * ahead; read-only SO_FILEs reading through the block cache need
+ * no lseek either
  * A previous write operation will determine the content
  * of the buffer to be written to the file
  * Returns 0 at succes, -1 in case of error
  */
-int so_fseek(SO_FILE *stream, long offset, int whence)
+int so_fseek_unlocked(SO_FILE *stream, long offset, int whence)
 {
-	int bytes_written = 0;
-	int bytes_written_now = 0;
+	unsigned long long start = 0;
+	long window = 0;
 
-	if (stream->last_op == LASTREAD) {
-		memset(stream->buffer, 0, sizeof(stream->buffer));
-		stream->buff_pos = 0;
-		stream->buff_size = 0;
-	} else if (stream->last_op == LASTWRITE) {
-		while (bytes_written < stream->buff_size) {
-			bytes_written_now = write(stream->fd,
-				stream->buffer + bytes_written,
-				stream->buff_size - bytes_written);
-			stream->pointer += bytes_written_now;
+	if (stream->mode_type == READMAP)
+		return so_map_seek(stream, offset, whence);
 
-			if (bytes_written_now <= 0) {
-				stream->found_error = 1;
-				return -1;
-			}
-			bytes_written += bytes_written_now;
+	if (whence == SEEK_CUR) {
+		/* the file descr may be ahead of the logical position */
+		offset += so_ftell_unlocked(stream);
+		whence = SEEK_SET;
+	}
+
+	/* a target inside the bytes read in the buffer needs no lseek;
+	 * a SO_FILE that may write next needs the file descr there
+	 */
+	if (whence == SEEK_SET && stream->last_op == LASTREAD &&
+		stream->mode_type == READ) {
+		window = stream->pointer - stream->buff_pos;
+		if (offset >= window &&
+			offset <= window + (long)stream->buff_size) {
+			stream->buff_pos = offset - window;
+			stream->pointer = offset;
+			stream->found_eof = false;
+			return 0;
 		}
-		memset(stream->buffer, 0, sizeof(stream->buffer));
+	}
+
+	if (stream->ra != NULL)
+		so_ra_cancel(stream);
+	if (stream->z != NULL)
+		return so_z_seek(stream, offset, whence);
+	if (stream->dio != NULL)
+		return so_dio_seek(stream, offset, whence);
+
+	if (stream->last_op == LASTREAD) {
+		if (stream->buff_pos != stream->buff_size)
+			stream->stats.discarding_seeks++;
 		stream->buff_pos = 0;
 		stream->buff_size = 0;
+	} else if (stream->last_op == LASTWRITE) {
+		if (so_write_out(stream, NULL, 0) == SO_EOF ||
+			so_wb_drain(stream))
+			return -1;
 	}
+	if (whence == SEEK_SET && stream->mode_type == READ &&
+		so_bc_usable(stream))
+		return so_bc_seek(stream, offset);
 
+	start = so_clock_ns();
 	stream->pointer = lseek(stream->fd, offset, whence);
+	stream->stats.seeks++;
+	stream->stats.syscall_ns += so_clock_ns() - start;
 	if (stream->pointer == -1) {
 		stream->found_error = 1;
 		return -1;
 	} else {
+		stream->fd_stale = false;
+		stream->found_eof = false;
 		return 0;
 	}
 }
 
+/* Same as so_fseek_unlocked, holding the lock of the SO_FILE */
+int so_fseek(SO_FILE *stream, long offset, int whence)
+{
+	int ret;
+
+	so_flockfile(stream);
+	ret = so_fseek_unlocked(stream, offset, whence);
+	so_funlockfile(stream);
+	return ret;
+}
+
 /* Returns the current position of the SO_FILE internal
  * pointer
  */
-long so_ftell(SO_FILE *stream)
+long so_ftell_unlocked(SO_FILE *stream)
 {
 	if (stream->last_op == LASTWRITE)
 		return (stream->pointer + stream->buff_pos);
 	return stream->pointer;
 }
 
+/* Same as so_ftell_unlocked, holding the lock of the SO_FILE */
+long so_ftell(SO_FILE *stream)
+{
+	long ret;
+
+	so_flockfile(stream);
+	ret = so_ftell_unlocked(stream);
+	so_funlockfile(stream);
+	return ret;
+}
+
 /* Available only for a previous write operation, it
  * flushes the content of the SO_FILE buffer to the file
+ * With write-behind, it also waits for the writer thread, whose
+ * failures it reports
  * Returns 0 at succes, SO_EOF in case of error
  */
-int so_fflush(SO_FILE *stream)
+int so_fflush_unlocked(SO_FILE *stream)
 {
-	int bytes_written = 0;
-	int bytes_written_now = 0;
-
 	if (stream->last_op != LASTWRITE) {
 		stream->found_error = 1;
 		return SO_EOF;
 	}
-	while (bytes_written < stream->buff_size) {
-		bytes_written_now = write(stream->fd,
-			stream->buffer + bytes_written,
-			stream->buff_size - bytes_written);
-		stream->pointer += bytes_written_now;
-
-		if (bytes_written_now <= 0) {
-			stream->found_error = 1;
-			return SO_EOF;
-		}
-		bytes_written += bytes_written_now;
-	}
-	memset(stream->buffer, 0, sizeof(stream->buffer));
-	stream->buff_pos = 0;
-	stream->buff_size = 0;
+	if (so_write_out(stream, NULL, 0) == SO_EOF || so_wb_drain(stream))
+		return SO_EOF;
 	return 0;
 }
 
+/* Same as so_fflush_unlocked, holding the lock of the SO_FILE
+ * A NULL stream flushes all open SO_FILEs, see so_fflush_all
+ */
+int so_fflush(SO_FILE *stream)
+{
+	int ret;
+
+	if (stream == NULL)
+		return so_fflush_all();
+	so_flockfile(stream);
+	ret = so_fflush_unlocked(stream);
+	so_funlockfile(stream);
+	return ret;
+}
+
 /* Returns the file descr associated with this SO_FILE */
 int so_fileno(SO_FILE *stream)
 {
@@ -166,7 +589,7 @@ int so_fileno(SO_FILE *stream)
 }
 
 /* Returns 1 if SO_FILE pointer is at EOF, 0 otherwise */
-int so_feof(SO_FILE *stream)
+int so_feof_unlocked(SO_FILE *stream)
 {
 	if (stream->found_eof == true)
 		return 1;
@@ -174,48 +597,126 @@ int so_feof(SO_FILE *stream)
 		return 0;
 }
 
+/* Same as so_feof_unlocked, holding the lock of the SO_FILE */
+int so_feof(SO_FILE *stream)
+{
+	int ret;
+
+	so_flockfile(stream);
+	ret = so_feof_unlocked(stream);
+	so_funlockfile(stream);
+	return ret;
+}
+
 /* Returns 1 if an operation on this SO_FILE determined
  * error, 0 otherwise
  */
-int so_ferror(SO_FILE *stream)
+int so_ferror_unlocked(SO_FILE *stream)
 {
+	so_wb_check(stream);
 	if (stream->found_error == -1)
 		return 0;
 	else
 		return stream->found_error;
 }
 
+/* Same as so_ferror_unlocked, holding the lock of the SO_FILE */
+int so_ferror(SO_FILE *stream)
+{
+	int ret;
+
+	so_flockfile(stream);
+	ret = so_ferror_unlocked(stream);
+	so_funlockfile(stream);
+	return ret;
+}
+
+/* Accounts for a read system call of the SO_FILE begun at start */
+static void so_count_read(SO_FILE *stream, long bytes_read,
+	unsigned long long start)
+{
+	stream->stats.read_calls++;
+	if (bytes_read > 0)
+		stream->stats.bytes_read += bytes_read;
+	stream->stats.syscall_ns += so_clock_ns() - start;
+}
+
+/* Refills the SO_FILE buffer with as much as buff_capacity
+ * characters from file, or from the block cache when it is on,
+ * discarding its previous content
+ * Sets the EOF or error flag accordingly; a memory-mapped
+ * SO_FILE has nothing left to read once its buffer is consumed
+ * Returns the number of bytes read, 0 if EOF found or
+ * -1 in case of error
+ */
+long so_refill(SO_FILE *stream)
+{
+	unsigned long long start = 0;
+	long bytes_read = 0;
+
+	if (stream->mode_type == READMAP) {
+		stream->found_eof = true;
+		return 0;
+	}
+	stream->buff_pos = 0;
+	stream->buff_size = 0;
+	if (so_get_buffer(stream) == SO_EOF)
+		return -1;
+	if (so_bc_usable(stream)) {
+		/* counts its own reads, which cache hits skip */
+		bytes_read = so_bc_read(stream);
+	} else if (so_bc_sync(stream)) {
+		/* the file descr is behind a read or seek of the cache */
+		bytes_read = -1;
+	} else {
+		start = so_clock_ns();
+		if (stream->ra != NULL)
+			bytes_read = so_ra_read(stream);
+		else if (stream->z != NULL)
+			bytes_read = so_z_read(stream);
+		else if (stream->dio != NULL)
+			bytes_read = so_dio_read(stream);
+		else if (stream->duplex != NULL)
+			bytes_read = so_duplex_read(stream);
+		else
+			bytes_read = read(stream->fd, stream->buffer,
+				stream->buff_capacity);
+		so_count_read(stream, bytes_read, start);
+	}
+	stream->stats.refills++;
+	if (bytes_read == -1) {
+		stream->found_error = 1;
+		return -1;
+	} else if (bytes_read == 0) {
+		stream->found_eof = true;
+		return 0;
+	}
+	stream->buff_size = bytes_read;
+	so_csum(stream, stream->buffer, bytes_read);
+	return bytes_read;
+}
+
 /* Reads a character from file
  * Uses the internal buffer to prefetch data
  * If there is no new data in the buffer, it reads as
- * much as BUFFCAPACIT more characters from file to buffer
+ * much as buff_capacity more characters from file to buffer
  * Returns character at succes, SO_EOF in case of error
  * or if EOF found
  */
-int so_fgetc(SO_FILE *stream)
+int so_fgetc_unlocked(SO_FILE *stream)
 {
-	long bytes_read = 0;
 	int c;
 
-	if (so_ferror(stream) || so_feof(stream))
+	if (so_ferror_unlocked(stream) || so_feof_unlocked(stream))
+		return SO_EOF;
+	if (stream->duplex != NULL && so_duplex_turn(stream, LASTREAD))
 		return SO_EOF;
 
-	if (stream->buff_size == 0 ||
-		stream->buff_pos == stream->buff_size) {
-		if (stream->buff_size != 0) {
-			memset(stream->buffer, 0, sizeof(stream->buffer));
-			stream->buff_pos = 0;
-			stream->buff_size = 0;
-		}
-		bytes_read = read(stream->fd, stream->buffer, BUFFCAPACIT);
-		if (bytes_read == -1) {
-			stream->found_error = 1;
-			return SO_EOF;
-		} else if (bytes_read == 0) {
-			stream->found_eof = true;
+	if (stream->buff_pos == stream->buff_size) {
+		if (so_refill(stream) <= 0)
 			return SO_EOF;
-		}
-		stream->buff_size = bytes_read;
+	} else {
+		stream->stats.buffer_hits++;
 	}
 
 	stream->last_op = LASTREAD;
@@ -224,180 +725,362 @@ int so_fgetc(SO_FILE *stream)
 	return c;
 }
 
+/* Same as so_fgetc_unlocked, holding the lock of the SO_FILE */
+int so_fgetc(SO_FILE *stream)
+{
+	int c;
+
+	so_flockfile(stream);
+	c = so_fgetc_unlocked(stream);
+	so_funlockfile(stream);
+	return c;
+}
+
 /* Reads size * nmemb bytes from the SO_FILE
- * Uses the internal buffer to prefetch data
- * If there is no new data in the buffer, it reads as much
- * as BUFFCAPACIT more characters from file to the buffer
+ * Bytes already in the internal buffer are copied in one go;
+ * requests of at least buff_capacity bytes are read from file
+ * straight into ptr, smaller ones, and all of them while the block
+ * cache is on, go through the buffer
  * Reads as much as the requested bytes at memory address pointed
  * by ptr at succes, returning the number of elements read
  * Returns 0 in case of error or if EOF found
  */
-size_t so_fread(void *ptr, size_t size, size_t nmemb, SO_FILE *stream)
+size_t so_fread_unlocked(void *ptr, size_t size, size_t nmemb,
+	SO_FILE *stream)
 {
 	size_t count = size * nmemb;
-	int ret = 0;
-	unsigned char c = 0;
+	size_t chunk = 0;
+	unsigned char *dest = ptr;
+	unsigned long long start = 0;
+	long bytes_read = 0;
 
-	while (count > 0) {
-		ret = so_fgetc(stream);
-		if (so_ferror(stream))
-			return 0;
-		if (ret == SO_EOF)
-			break;
-		c = (unsigned char)ret;
-		memcpy(ptr++, &c, sizeof(unsigned char));
-		count--;
+	if (count == 0)
+		return 0;
+	if (stream->duplex != NULL && so_duplex_turn(stream, LASTREAD))
+		return 0;
+
+	while (count > 0 && !so_ferror_unlocked(stream) &&
+		!so_feof_unlocked(stream)) {
+		chunk = stream->buff_size - stream->buff_pos;
+		if (chunk > 0) {
+			if (chunk > count)
+				chunk = count;
+			memcpy(dest, stream->buffer + stream->buff_pos, chunk);
+			stream->stats.buffer_hits++;
+			stream->buff_pos += chunk;
+			stream->pointer += chunk;
+			dest += chunk;
+			count -= chunk;
+		} else if (count >= stream->buff_capacity &&
+			stream->mode_type != READMAP && stream->ra == NULL &&
+			stream->duplex == NULL && stream->z == NULL &&
+			stream->dio == NULL && !so_bc_usable(stream)) {
+			/* the buffer no longer ends where the file descr is */
+			stream->buff_pos = 0;
+			stream->buff_size = 0;
+			if (so_bc_sync(stream)) {
+				stream->found_error = 1;
+				break;
+			}
+			start = so_clock_ns();
+			bytes_read = read(stream->fd, dest, count);
+			so_count_read(stream, bytes_read, start);
+			if (bytes_read == -1) {
+				stream->found_error = 1;
+			} else if (bytes_read == 0) {
+				stream->found_eof = true;
+			} else {
+				so_csum(stream, dest, bytes_read);
+				stream->pointer += bytes_read;
+				dest += bytes_read;
+				count -= bytes_read;
+			}
+		} else {
+			so_refill(stream);
+		}
 	}
 
 	stream->last_op = LASTREAD;
+	if (so_ferror_unlocked(stream))
+		return 0;
 	return ((size * nmemb - count) / size);
 }
 
+/* Same as so_fread_unlocked, holding the lock of the SO_FILE */
+size_t so_fread(void *ptr, size_t size, size_t nmemb, SO_FILE *stream)
+{
+	size_t ret;
+
+	so_flockfile(stream);
+	ret = so_fread_unlocked(ptr, size, nmemb, stream);
+	so_funlockfile(stream);
+	return ret;
+}
+
 /* Writes a character to file
  * Uses the internal buffer for buffering
  * Writes the content of the buffer to the file only
  * when buffer is full
  * Returns character at succes, SO_EOF in case of error
  */
-int so_fputc(int c, SO_FILE *stream)
+int so_fputc_unlocked(int c, SO_FILE *stream)
 {
 	unsigned char ch = (unsigned char) c;
-	int bytes_written = 0;
-	int bytes_written_now = 0;
 
-	if (so_ferror(stream))
+	if (stream->mode_type == READMAP)
+		stream->found_error = 1;
+	if (so_ferror_unlocked(stream) || so_get_buffer(stream) == SO_EOF)
+		return SO_EOF;
+	if (stream->duplex != NULL && so_duplex_turn(stream, LASTWRITE))
 		return SO_EOF;
 
-	if (stream->buff_size == BUFFCAPACIT) {
-		while (bytes_written < stream->buff_size) {
-			bytes_written_now = write(stream->fd,
-				stream->buffer + bytes_written,
-				stream->buff_size - bytes_written);
-			stream->pointer += bytes_written_now;
-
-			if (bytes_written_now <= 0) {
-				stream->found_error = 1;
-				return SO_EOF;
-			}
-			bytes_written += bytes_written_now;
-		}
-		memset(stream->buffer, 0, sizeof(stream->buffer));
-		stream->buff_pos = 0;
-		stream->buff_size = 0;
+	if (stream->buff_size == stream->buff_capacity) {
+		if (so_write_out(stream, NULL, 0) == SO_EOF)
+			return SO_EOF;
 	}
 
 	stream->last_op = LASTWRITE;
 	stream->buffer[stream->buff_pos++] = ch;
 	stream->buff_size++;
+
+	if (stream->buff_mode == SO_IONBF ||
+		(stream->buff_mode == SO_IOLBF && ch == '\n')) {
+		if (so_write_out(stream, NULL, 0) == SO_EOF)
+			return SO_EOF;
+	}
 	return c;
 }
 
+/* Same as so_fputc_unlocked, holding the lock of the SO_FILE */
+int so_fputc(int c, SO_FILE *stream)
+{
+	int ret;
+
+	so_flockfile(stream);
+	ret = so_fputc_unlocked(c, stream);
+	so_funlockfile(stream);
+	return ret;
+}
+
 /* Writes size * nmemb bytes to the SO_FILE
- * Uses the internal buffer for buffering
- * Writes the content of the buffer to the file only
- * when buffer is full
+ * Data fitting in the internal buffer is copied there in one go
+ * Smaller writes top up the buffer and flush it when full,
+ * while payloads of at least buff_capacity bytes are written
+ * together with the pending buffer content through writev
+ * A line buffered SO_FILE is also flushed when the data holds
+ * a newline
  * Writes as much as the requested bytes from memory address pointed
  * by ptr at succes, returning the number of elements written
  * Returns 0 in case of error
  */
-size_t so_fwrite(const void *ptr, size_t size,
+size_t so_fwrite_unlocked(const void *ptr, size_t size,
 	size_t nmemb, SO_FILE *stream)
 {
 	size_t count = size * nmemb;
-	int ret = 0;
-	int i = 0;
-	int c = 0;
-	unsigned char ch = 0;
-
-	while (count > 0) {
-		memcpy(&ch, (ptr + i++), sizeof(unsigned char));
-		count--;
-		c = (int)ch;
-		ret = so_fputc(c, stream);
-		if (ret == SO_EOF)
+	size_t chunk = 0;
+	const unsigned char *src = ptr;
+
+	if (stream->mode_type == READMAP)
+		stream->found_error = 1;
+	if (count == 0 || so_ferror_unlocked(stream))
+		return 0;
+	if (stream->duplex != NULL && so_duplex_turn(stream, LASTWRITE))
+		return 0;
+
+	stream->last_op = LASTWRITE;
+	if (count >= stream->buff_capacity)
+		return so_write_out(stream, src, count) == SO_EOF ? 0 : nmemb;
+
+	if (so_get_buffer(stream) == SO_EOF)
+		return 0;
+	chunk = stream->buff_capacity - stream->buff_size;
+	if (chunk > count)
+		chunk = count;
+	memcpy(stream->buffer + stream->buff_size, src, chunk);
+	stream->buff_size += chunk;
+	stream->buff_pos = stream->buff_size;
+	src += chunk;
+	count -= chunk;
+
+	if (count > 0) {
+		if (so_write_out(stream, NULL, 0) == SO_EOF)
 			return 0;
+		memcpy(stream->buffer, src, count);
+		stream->buff_size = count;
+		stream->buff_pos = count;
 	}
 
-	stream->last_op = LASTWRITE;
-	return ((size * nmemb - count) / size);
+	if (stream->buff_mode == SO_IOLBF &&
+		memchr(ptr, '\n', size * nmemb) != NULL) {
+		if (so_write_out(stream, NULL, 0) == SO_EOF)
+			return 0;
+	}
+	return nmemb;
 }
 
-/* Allocates and returns a new SO_FILE structure, creating
- * a new child process which runs the given command in terminal
- * Input OR output of child is redirected through a pipe
- * from/to the main process, based on type parameter
- * Returns NULL in case of error
+/* Same as so_fwrite_unlocked, holding the lock of the SO_FILE */
+size_t so_fwrite(const void *ptr, size_t size,
+	size_t nmemb, SO_FILE *stream)
+{
+	size_t ret;
+
+	so_flockfile(stream);
+	ret = so_fwrite_unlocked(ptr, size, nmemb, stream);
+	so_funlockfile(stream);
+	return ret;
+}
+
+extern char **environ;
+
+/* Starts the program at path with argv, with its standard output
+ * (type "r"), input (type "w") or both (type "r+") redirected to
+ * pipes, and returns a new SO_FILE for the other ends
+ * posix_spawn creates the child without copying the page tables
+ * of the parent, and the redirection is done by its file actions;
+ * all pipe ends are close-on-exec, so the child only keeps the
+ * ones duplicated onto its standard streams
+ * With "r+" the SO_FILE reads the child output from its fd and
+ * writes the child input through a nonblocking second fd
+ * path is looked up in PATH when it has no '/'
+ * Returns NULL in case of error, with errno set
  */
-SO_FILE *so_popen(const char *command, const char *type)
+static SO_FILE *so_spawn(const char *path, char *const argv[],
+	const char *type, const char *name)
 {
-	pid_t pid;
-	int ret = 0;
-	int fds[2];
+	posix_spawn_file_actions_t actions;
+	struct so_duplex *duplex = NULL;
 	SO_FILE *file = NULL;
-	int fd = -1;
-	int mode_type = -1;
+	pid_t pid = -1;
+	int out[2] = { -1, -1 };
+	int in[2] = { -1, -1 };
+	bool reads = strcmp(type, "r") == 0 || strcmp(type, "r+") == 0;
+	bool writes = strcmp(type, "w") == 0 || strcmp(type, "r+") == 0;
+	int ret = 0;
 
-	if (strcmp(type, "r") != 0 && strcmp(type, "w") != 0)
-		return file;
-
-	ret = pipe(fds);
-	if (ret != 0)
-		return file;
-
-	pid = fork();
-	switch (pid) {
-	case -1:
-		close(fds[PIPE_READ]);
-		close(fds[PIPE_WRITE]);
-		return file;
-	case 0:
-		if (strcmp(type, "r") == 0) {
-			ret = close(fds[PIPE_READ]);
-			if (fds[PIPE_WRITE] != STDOUT_FILENO) {
-				ret |= dup2(fds[PIPE_WRITE], STDOUT_FILENO);
-				ret |= close(fds[PIPE_WRITE]);
-			}
-		} else {
-			ret = close(fds[PIPE_WRITE]);
-			if (fds[PIPE_READ] != STDIN_FILENO) {
-				ret |= dup2(fds[PIPE_READ], STDIN_FILENO);
-				ret |= close(fds[PIPE_READ]);
+	if (!reads && !writes) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (writes) {
+		duplex = reads ? calloc(1, sizeof(*duplex)) : NULL;
+		if ((reads && duplex == NULL) || pipe(in) != 0) {
+			free(duplex);
+			return NULL;
+		}
+		fcntl(in[PIPE_READ], F_SETFD, FD_CLOEXEC);
+		fcntl(in[PIPE_WRITE], F_SETFD, FD_CLOEXEC);
+	}
+	if (reads) {
+		if (pipe(out) != 0) {
+			if (writes) {
+				close(in[PIPE_READ]);
+				close(in[PIPE_WRITE]);
 			}
+			free(duplex);
+			return NULL;
 		}
-		if (ret < 0)
-			exit(-1);
-		execl("/bin/sh", "/bin/sh", "-c", command, NULL);
-		exit(-1);
+		fcntl(out[PIPE_READ], F_SETFD, FD_CLOEXEC);
+		fcntl(out[PIPE_WRITE], F_SETFD, FD_CLOEXEC);
 	}
 
-	if (strcmp(type, "r") == 0) {
-		fd = fds[PIPE_READ];
-		ret = close(fds[PIPE_WRITE]);
-		mode_type = READ;
-	} else {
-		fd = fds[PIPE_WRITE];
-		ret = close(fds[PIPE_READ]);
-		mode_type = WRITE;
+	ret = posix_spawn_file_actions_init(&actions);
+	if (ret == 0) {
+		if (reads)
+			ret = posix_spawn_file_actions_adddup2(&actions,
+				out[PIPE_WRITE], STDOUT_FILENO);
+		if (ret == 0 && writes)
+			ret = posix_spawn_file_actions_adddup2(&actions,
+				in[PIPE_READ], STDIN_FILENO);
+		if (ret == 0)
+			ret = posix_spawnp(&pid, path, &actions, NULL, argv,
+				environ);
+		posix_spawn_file_actions_destroy(&actions);
 	}
-	if (ret < 0)
-		return file;
-
-	file = malloc(sizeof(SO_FILE));
-	if (file != NULL) {
-		file->fd = fd;
-		file->pointer = 0;
-		file->mode_type = mode_type;
-		memset(file->buffer, 0, sizeof(file->buffer));
-		file->last_op = -1;
-		file->found_eof = false;
-		file->pid = pid;
-		file->found_error = -1;
-		file->buff_pos = 0;
-		file->buff_size = 0;
+	if (reads)
+		close(out[PIPE_WRITE]);
+	if (writes)
+		close(in[PIPE_READ]);
+	if (ret == 0 && reads)
+		file = so_new_file(out[PIPE_READ], writes ? READPLUS : READ,
+			pid, name);
+	else if (ret == 0)
+		file = so_new_file(in[PIPE_WRITE], WRITE, pid, name);
+
+	if (file == NULL) {
+		if (reads)
+			close(out[PIPE_READ]);
+		if (writes)
+			close(in[PIPE_WRITE]);
+		free(duplex);
+		if (ret != 0)
+			errno = ret;
+		else
+			waitpid(pid, NULL, 0);
+		return NULL;
+	}
+	file->seekable = 0;
+	if (duplex != NULL) {
+		/* a full child input must not block: see so_duplex_writev */
+		fcntl(in[PIPE_WRITE], F_SETFL, O_NONBLOCK);
+		duplex->wfd = in[PIPE_WRITE];
+		file->duplex = duplex;
 	}
 	return file;
 }
 
+/* Allocates and returns a new SO_FILE structure, creating
+ * a new child process which runs the given command in terminal
+ * Input OR output of child is redirected through a pipe
+ * from/to the main process, based on type parameter;
+ * type "r+" redirects both, for a SO_FILE both readable
+ * and writable
+ * Returns NULL in case of error
+ */
+SO_FILE *so_popen(const char *command, const char *type)
+{
+	char *argv[] = { "sh", "-c", (char *)command, NULL };
+
+	return so_spawn("/bin/sh", argv, type, command);
+}
+
+/* Same as so_popen, running the program at path with argv directly
+ * instead of through /bin/sh; path is looked up in PATH when it has
+ * no '/'
+ * Returns NULL in case of error, including when the program cannot
+ * be started
+ */
+SO_FILE *so_popenv(const char *path, char *const argv[], const char *type)
+{
+	return so_spawn(path, argv, type, path);
+}
+
+/* Flushes the remaining elements in the buffer of a SO_FILE
+ * opened by so_popen, closes its pipes and frees it, without
+ * waiting for the child; the pid of the child is left in *pid
+ * Returns 0 at succes, -1 in case of error
+ */
+int so_pdetach(SO_FILE *stream, pid_t *pid)
+{
+	int ret = 0;
+
+	*pid = stream->pid;
+	if (stream->pid < 0)
+		return -1;
+
+	so_flockfile(stream);
+	so_ra_destroy(stream);
+	if (stream->duplex != NULL && stream->duplex->wfd != -1)
+		ret = so_pshutdown_unlocked(stream);
+	else if (stream->last_op == LASTWRITE)
+		ret = so_fflush_unlocked(stream);
+	so_wb_destroy(stream);
+	ret |= close(stream->fd);
+	stream->last_op = -1;
+	so_funlockfile(stream);
+	so_free_file(stream);
+	return ret == 0 ? 0 : -1;
+}
+
 /* Waits for child process associated with to terminate
  * Frees memory for given SO_FILE and closes its file descr
  * The function flushes to file the remaining elements
@@ -407,19 +1090,15 @@ SO_FILE *so_popen(const char *command, const char *type)
  */
 int so_pclose(SO_FILE *stream)
 {
-	int pid = stream->pid;
-	int backup_pid = pid;
+	pid_t pid = -1;
+	pid_t backup_pid = -1;
 	int status = 0;
 	int ret = 0;
 
-	if (pid < 0)
+	ret = so_pdetach(stream, &backup_pid);
+	if (backup_pid < 0)
 		return -1;
 
-	if (stream->last_op == LASTWRITE)
-		ret = so_fflush(stream);
-	ret |= close(stream->fd);
-	free(stream);
-
 	do {
 		pid = waitpid(backup_pid, &status, 0);
 	} while (pid == -1 && errno == EINTR);
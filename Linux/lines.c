@@ -0,0 +1,191 @@
+#include "stdio_internal.h"
+#include <string.h>
+
+/* Finds the next delim in the SO_FILE buffer, refilling it when
+ * it is empty, and consumes the bytes up to and including delim,
+ * or the whole buffer if delim is not there
+ * The delimiter is searched with memchr, which scans whole words
+ * or vector registers at a time
+ * Sets *found when delim ended the span
+ * Returns the start of the span, *len holding its length, or
+ * NULL at EOF or in case of error
+ */
+static unsigned char *so_next_span(SO_FILE *stream, int delim,
+	size_t limit, size_t *len, bool *found)
+{
+	unsigned char *start = NULL;
+	unsigned char *end = NULL;
+	size_t avail = 0;
+
+	if (so_ferror_unlocked(stream) || so_feof_unlocked(stream))
+		return NULL;
+	if (stream->duplex != NULL && so_duplex_turn(stream, LASTREAD))
+		return NULL;
+	if (stream->buff_pos == stream->buff_size) {
+		if (so_refill(stream) <= 0)
+			return NULL;
+	} else {
+		stream->stats.buffer_hits++;
+	}
+
+	start = stream->buffer + stream->buff_pos;
+	avail = stream->buff_size - stream->buff_pos;
+	if (avail > limit)
+		avail = limit;
+	end = memchr(start, delim, avail);
+	*found = end != NULL;
+	*len = end != NULL ? (size_t)(end - start) + 1 : avail;
+
+	stream->last_op = LASTREAD;
+	stream->buff_pos += *len;
+	stream->pointer += *len;
+	return start;
+}
+
+/* Makes room for at least need bytes in *buf, of capacity *cap,
+ * growing it geometrically
+ * Returns 0 at succes, -1 in case of error
+ */
+int so_grow(unsigned char **buf, size_t *cap, size_t need)
+{
+	unsigned char *bigger = NULL;
+	size_t new_cap = *cap > 0 ? *cap : 128;
+
+	if (need <= *cap)
+		return 0;
+	while (new_cap < need)
+		new_cap *= 2;
+	bigger = realloc(*buf, new_cap);
+	if (bigger == NULL)
+		return -1;
+	*buf = bigger;
+	*cap = new_cap;
+	return 0;
+}
+
+/* Reads a line of at most size - 1 characters from the SO_FILE
+ * into s, keeping the newline, and terminates it with '\0'
+ * Returns s at succes, NULL in case of error or if EOF found
+ * before any character was read
+ */
+char *so_fgets(char *s, int size, SO_FILE *stream)
+{
+	unsigned char *span = NULL;
+	size_t done = 0;
+	size_t len = 0;
+	bool found = false;
+
+	if (size <= 0)
+		return NULL;
+
+	so_flockfile(stream);
+	while (done < (size_t)size - 1) {
+		span = so_next_span(stream, '\n', size - 1 - done, &len,
+			&found);
+		if (span == NULL)
+			break;
+		memcpy(s + done, span, len);
+		done += len;
+		if (found)
+			break;
+	}
+	s[done] = '\0';
+	if (so_ferror_unlocked(stream) || (done == 0 && size > 1))
+		s = NULL;
+	so_funlockfile(stream);
+	return s;
+}
+
+/* Reads characters from the SO_FILE up to and including delim
+ * into *lineptr, reallocating it (and updating *n) as needed,
+ * and terminates them with '\0'
+ * Returns the number of characters read, without the '\0', or
+ * -1 in case of error or if EOF found before any character
+ */
+ssize_t so_getdelim(char **lineptr, size_t *n, int delim, SO_FILE *stream)
+{
+	unsigned char *span = NULL;
+	size_t done = 0;
+	size_t len = 0;
+	bool found = false;
+	ssize_t ret = -1;
+
+	if (lineptr == NULL || n == NULL)
+		return -1;
+	if (*lineptr == NULL)
+		*n = 0;
+
+	so_flockfile(stream);
+	while (!found) {
+		span = so_next_span(stream, delim, (size_t)-1, &len,
+			&found);
+		if (span == NULL)
+			break;
+		if (so_grow((unsigned char **)lineptr, n, done + len + 1)) {
+			stream->found_error = 1;
+			break;
+		}
+		memcpy(*lineptr + done, span, len);
+		done += len;
+	}
+	if (!so_ferror_unlocked(stream) && done > 0) {
+		(*lineptr)[done] = '\0';
+		ret = done;
+	}
+	so_funlockfile(stream);
+	return ret;
+}
+
+/* Same as so_getdelim, with '\n' as delimiter */
+ssize_t so_getline(char **lineptr, size_t *n, SO_FILE *stream)
+{
+	return so_getdelim(lineptr, n, '\n', stream);
+}
+
+/* Returns the next line of the SO_FILE, newline included, without
+ * copying it: the pointer goes straight into the SO_FILE buffer
+ * when the whole line is there, and into a line buffer owned by
+ * the SO_FILE only when the line crosses a refill
+ * The line is not '\0' terminated; *len holds its length
+ * It stays valid until the next operation on the SO_FILE
+ * Returns NULL in case of error or if EOF found
+ */
+const char *so_getline_view(SO_FILE *stream, size_t *len)
+{
+	unsigned char *span = NULL;
+	unsigned char *line = NULL;
+	size_t span_len = 0;
+	size_t done = 0;
+	bool found = false;
+
+	so_flockfile(stream);
+	span = so_next_span(stream, '\n', (size_t)-1, &span_len, &found);
+	if (span != NULL && found) {
+		line = span;
+		done = span_len;
+	}
+
+	/* the line crosses a refill, so gather it in the line buffer */
+	while (span != NULL && line == NULL) {
+		if (so_grow(&stream->line_buf, &stream->line_cap,
+			done + span_len)) {
+			stream->found_error = 1;
+			break;
+		}
+		memcpy(stream->line_buf + done, span, span_len);
+		done += span_len;
+		if (!found)
+			span = so_next_span(stream, '\n', (size_t)-1,
+				&span_len, &found);
+		else
+			line = stream->line_buf;
+		if (span == NULL)
+			line = stream->line_buf;
+	}
+
+	if (so_ferror_unlocked(stream))
+		line = NULL;
+	*len = line != NULL ? done : 0;
+	so_funlockfile(stream);
+	return (const char *)line;
+}
@@ -0,0 +1,197 @@
+#include "stdio_internal.h"
+#include <string.h>
+
+/* Closes all the streams of the group, flushing the ones of a "w"
+ * group, and waits for all the children, then frees the group
+ * All the pipes are closed before the first wait, so the children
+ * finish together instead of one after the other, and reaping the
+ * ones already gone costs a single waitpid each
+ * statuses, if not NULL, receives the status of each child, as
+ * so_pclose returns it, in the order of the commands, or -1 for
+ * those which could not be reaped
+ * Returns 0 at succes, -1 in case of error
+ */
+int so_pclose_all(SO_PGROUP *group, int *statuses)
+{
+	pid_t pid = -1;
+	int status = 0;
+	int ret = 0;
+	int i = 0;
+
+	for (i = 0; i < group->count; i++)
+		if (so_pdetach(group->streams[i], &pid) == -1)
+			ret = -1;
+
+	for (i = 0; i < group->count; i++) {
+		do {
+			pid = waitpid(group->pids[i], &status, 0);
+		} while (pid == -1 && errno == EINTR);
+		if (pid == -1)
+			ret = -1;
+		if (statuses != NULL)
+			statuses[i] = pid == -1 ? -1 : status;
+	}
+
+	if (group->epfd != -1)
+		close(group->epfd);
+	free(group->events);
+	free(group->pids);
+	free(group->streams);
+	free(group);
+	return ret;
+}
+
+/* Starts count commands, as so_popen does, each with its own pipe
+ * of the given type ("r" or "w")
+ * For type "r", the output of all the children can be read as it
+ * comes, with so_pgroup_next, instead of one child after the other
+ * Returns NULL in case of error, once the children already started
+ * have been waited for
+ */
+SO_PGROUP *so_popen_many(const char *const commands[], int count,
+	const char *type)
+{
+	SO_PGROUP *group = NULL;
+	SO_FILE *stream = NULL;
+	struct epoll_event ev;
+	bool reads = strcmp(type, "r") == 0;
+	int err = 0;
+
+	if (count <= 0 || (!reads && strcmp(type, "w") != 0)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	group = calloc(1, sizeof(*group));
+	if (group == NULL)
+		return NULL;
+	group->reads = reads;
+	group->last = -1;
+	group->streams = malloc(count * sizeof(*group->streams));
+	group->events = malloc(count * sizeof(*group->events));
+	group->pids = malloc(count * sizeof(*group->pids));
+	group->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (group->streams == NULL || group->events == NULL ||
+		group->pids == NULL || group->epfd == -1) {
+		err = errno;
+		so_pclose_all(group, NULL);
+		errno = err;
+		return NULL;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	while (group->count < count && err == 0) {
+		stream = so_popen(commands[group->count], type);
+		if (stream == NULL) {
+			err = errno;
+			break;
+		}
+		group->streams[group->count] = stream;
+		group->pids[group->count] = stream->pid;
+		ev.data.u32 = group->count++;
+		if (reads && epoll_ctl(group->epfd, EPOLL_CTL_ADD, stream->fd,
+			&ev) == -1)
+			err = errno;
+	}
+	if (err != 0) {
+		so_pclose_all(group, NULL);
+		errno = err;
+		return NULL;
+	}
+	group->active = reads ? count : 0;
+	return group;
+}
+
+/* Returns the SO_FILE of the index-th command of the group, or NULL
+ * if there is none
+ */
+SO_FILE *so_pgroup_stream(SO_PGROUP *group, int index)
+{
+	if (index < 0 || index >= group->count)
+		return NULL;
+	return group->streams[index];
+}
+
+/* Refills the buffer of the index-th stream of the group, which
+ * epoll found readable, so the read does not block
+ * A stream with nothing left to read leaves the epoll set
+ * Returns the number of bytes buffered, 0 at EOF or in case of
+ * error
+ */
+static size_t so_pgroup_fill(SO_PGROUP *group, int index)
+{
+	SO_FILE *stream = group->streams[index];
+	size_t avail = 0;
+
+	so_flockfile(stream);
+	if (stream->buff_pos == stream->buff_size &&
+		!so_feof_unlocked(stream) && !so_ferror_unlocked(stream))
+		so_refill(stream);
+	avail = stream->buff_size - stream->buff_pos;
+	so_funlockfile(stream);
+
+	if (avail == 0) {
+		epoll_ctl(group->epfd, EPOLL_CTL_DEL, stream->fd, NULL);
+		group->active--;
+	}
+	return avail;
+}
+
+/* Waits, at most timeout milliseconds (-1 for no limit), for one
+ * of the children of a "r" group to produce output, and returns
+ * the index of its command
+ * *avail receives the number of bytes then buffered in its SO_FILE,
+ * which can be read without blocking; 0 means that the stream has
+ * reached EOF (or failed, as so_ferror tells) and that it will not
+ * be returned again
+ * Streams come back in the order epoll reports them, the last one
+ * first as long as bytes are left in its buffer; reading more than
+ * *avail may block until that child writes again
+ * Returns -1 once all the streams have reached EOF, with errno set
+ * to 0, at timeout, with errno set to ETIMEDOUT, or in case of error
+ */
+int so_pgroup_next(SO_PGROUP *group, int timeout, size_t *avail)
+{
+	SO_FILE *stream = NULL;
+	int index = -1;
+	int ready = 0;
+
+	if (!group->reads) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (group->last != -1) {
+		stream = group->streams[group->last];
+		so_flockfile(stream);
+		*avail = stream->buff_size - stream->buff_pos;
+		so_funlockfile(stream);
+		if (*avail > 0)
+			return group->last;
+	}
+
+	while (index == -1) {
+		if (group->ev_next == group->ev_count) {
+			if (group->active == 0) {
+				errno = 0;
+				return -1;
+			}
+			ready = epoll_wait(group->epfd, group->events,
+				group->count, timeout);
+			if (ready == -1 && errno == EINTR)
+				continue;
+			if (ready <= 0) {
+				if (ready == 0)
+					errno = ETIMEDOUT;
+				return -1;
+			}
+			group->ev_count = ready;
+			group->ev_next = 0;
+		}
+		index = group->events[group->ev_next++].data.u32;
+	}
+
+	*avail = so_pgroup_fill(group, index);
+	group->last = index;
+	return index;
+}
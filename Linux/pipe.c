@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include "stdio_internal.h"
+#include <string.h>
+#include <poll.h>
+
+/* Largest buffer so_setpipe gives a SO_FILE to match its pipe */
+#define PIPE_MAXBUF	(1 << 20)
+
+/* Bytes of child output moved to the stash per read while pumping */
+#define PIPE_PUMP	(64 << 10)
+
+/* Reads the largest pipe size an unprivileged process may ask for
+ * Returns it, or 0 if it is not known
+ */
+static size_t so_pipe_max_size(void)
+{
+	char text[32];
+	ssize_t len = 0;
+	int fd = open("/proc/sys/fs/pipe-max-size", O_RDONLY);
+
+	if (fd == -1)
+		return 0;
+	len = read(fd, text, sizeof(text) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	text[len] = '\0';
+	return strtoul(text, NULL, 10);
+}
+
+/* Writes len bytes from ptr to the pipe of the SO_FILE with
+ * vmsplice, which hands the pages of ptr to the pipe instead of
+ * copying them; partial transfers are resumed
+ * Returns 0 at succes, SO_EOF in case of error
+ */
+int so_pipe_vmsplice(SO_FILE *stream, const void *ptr, size_t len)
+{
+	struct iovec iov;
+	unsigned long long start = 0;
+	ssize_t moved = 0;
+
+	iov.iov_base = (void *)ptr;
+	iov.iov_len = len;
+	stream->stats.flushes++;
+	while (iov.iov_len > 0) {
+		start = so_clock_ns();
+		moved = vmsplice(stream->fd, &iov, 1, 0);
+		stream->stats.write_calls++;
+		stream->stats.syscall_ns += so_clock_ns() - start;
+		if (moved == -1 && errno == EINTR)
+			continue;
+		if (moved <= 0) {
+			stream->found_error = 1;
+			return SO_EOF;
+		}
+		if ((size_t)moved < iov.iov_len)
+			stream->stats.short_writes++;
+		stream->stats.bytes_written += moved;
+		stream->pointer += moved;
+		iov.iov_base = (unsigned char *)iov.iov_base + moved;
+		iov.iov_len -= moved;
+	}
+	return 0;
+}
+
+/* Tunes a SO_FILE reading from or writing to a pipe, such as the
+ * ones of so_popen
+ * A non-zero size enlarges the pipe with F_SETPIPE_SZ, up to the
+ * system limit for unprivileged processes, and an internal buffer
+ * the caller did not provide grows along (up to 1 MiB), so data
+ * moves in fewer, larger system calls
+ * SO_PIPE_VMSPLICE in flags makes writes of at least the buffer
+ * capacity go through vmsplice, which passes the pages of the
+ * caller to the pipe without copying them: their content must not
+ * change until the reader has consumed it; the buffer then keeps
+ * its size, so that writes of moderate size qualify
+ * Bulk reads from the pipe into a file are done by so_fcopy, which
+ * splices them
+ * Returns the capacity of the pipe at succes, -1 in case of error
+ */
+static int so_setpipe_unlocked(SO_FILE *stream, size_t size, int flags)
+{
+	struct stat st;
+	size_t max = 0;
+	int capacity = 0;
+
+	if (fstat(stream->fd, &st) == -1 || !S_ISFIFO(st.st_mode))
+		return -1;
+	if ((flags & SO_PIPE_VMSPLICE) && stream->mode_type != WRITE)
+		return -1;
+
+	if (size > 0) {
+		capacity = fcntl(stream->fd, F_SETPIPE_SZ, size);
+		if (capacity == -1 && errno == EPERM) {
+			max = so_pipe_max_size();
+			if (max > 0 && max < size)
+				capacity = fcntl(stream->fd, F_SETPIPE_SZ, max);
+		}
+		if (capacity == -1)
+			return -1;
+		/* the child input of a duplex SO_FILE grows alike */
+		if (stream->duplex != NULL && stream->duplex->wfd != -1)
+			fcntl(stream->duplex->wfd, F_SETPIPE_SZ, capacity);
+	}
+	capacity = fcntl(stream->fd, F_GETPIPE_SZ);
+	if (capacity == -1)
+		return -1;
+
+	if (size > 0 && !(flags & SO_PIPE_VMSPLICE) &&
+		stream->buff_mode != SO_IONBF &&
+		(stream->buffer == NULL || stream->buff_owned) &&
+		stream->buff_capacity < (size_t)capacity)
+		so_setvbuf_unlocked(stream, NULL, stream->buff_mode,
+			capacity < PIPE_MAXBUF ? capacity : PIPE_MAXBUF);
+
+	stream->pipe_flags = flags;
+	return capacity;
+}
+
+/* Same as so_setpipe_unlocked, holding the lock of the SO_FILE */
+int so_setpipe(SO_FILE *stream, size_t size, int flags)
+{
+	int ret;
+
+	so_flockfile(stream);
+	ret = so_setpipe_unlocked(stream, size, flags);
+	so_funlockfile(stream);
+	return ret;
+}
+
+/* Makes room in the stash of a duplex SO_FILE for len more bytes,
+ * either after its content (at_front false) or before it
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_stash_reserve(struct so_duplex *dup, size_t len, bool at_front)
+{
+	unsigned char *bigger = NULL;
+	size_t cap = dup->stash_cap > 0 ? dup->stash_cap : PIPE_PUMP;
+
+	if (at_front && dup->stash_head >= len)
+		return 0;
+	if (!at_front &&
+		dup->stash_head + dup->stash_len + len <= dup->stash_cap)
+		return 0;
+
+	while (cap < dup->stash_len + len)
+		cap *= 2;
+	if (cap > dup->stash_cap) {
+		bigger = realloc(dup->stash, cap);
+		if (bigger == NULL)
+			return -1;
+		dup->stash = bigger;
+		dup->stash_cap = cap;
+	}
+	/* leave the free space where the new bytes go */
+	memmove(dup->stash + (at_front ? cap - dup->stash_len : 0),
+		dup->stash + dup->stash_head, dup->stash_len);
+	dup->stash_head = at_front ? cap - dup->stash_len : 0;
+	return 0;
+}
+
+/* Reads whatever the child wrote to its output into the stash, so
+ * it can go on consuming its input
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_duplex_pump(SO_FILE *stream)
+{
+	struct so_duplex *dup = stream->duplex;
+	ssize_t bytes_read = 0;
+
+	if (so_stash_reserve(dup, PIPE_PUMP, false))
+		return -1;
+	bytes_read = read(stream->fd, dup->stash + dup->stash_head +
+		dup->stash_len, PIPE_PUMP);
+	if (bytes_read == -1)
+		return errno == EINTR ? 0 : -1;
+	stream->stats.read_calls++;
+	stream->stats.bytes_read += bytes_read;
+	dup->stash_len += bytes_read;
+	return 0;
+}
+
+/* Writes to the child of a duplex SO_FILE like writev, on its
+ * nonblocking write side
+ * While the child input is full, waits with poll for it to drain
+ * or for child output, which is then read into the stash: a child
+ * blocked on a full output pipe would otherwise never read its
+ * input again
+ * Returns the number of bytes written, or -1 with errno set
+ */
+ssize_t so_duplex_writev(SO_FILE *stream, const struct iovec *iov, int cnt)
+{
+	struct so_duplex *dup = stream->duplex;
+	struct pollfd fds[2];
+	bool output_open = true;
+	ssize_t bytes_written = 0;
+
+	while (true) {
+		bytes_written = writev(dup->wfd, iov, cnt);
+		if (bytes_written >= 0 || errno != EAGAIN)
+			return bytes_written;
+
+		fds[0].fd = dup->wfd;
+		fds[0].events = POLLOUT;
+		fds[1].fd = output_open ? stream->fd : -1;
+		fds[1].events = POLLIN;
+		if (poll(fds, 2, -1) == -1 && errno != EINTR)
+			return -1;
+		if (fds[1].revents & (POLLIN | POLLHUP)) {
+			if (so_duplex_pump(stream))
+				return -1;
+			/* the child closed its output: only wait to write */
+			if (!(fds[1].revents & POLLIN))
+				output_open = false;
+		}
+	}
+}
+
+/* Fills the buffer of a duplex SO_FILE, from the stash first
+ * Returns the number of bytes now in the buffer, 0 at EOF or -1
+ * in case of error, like read
+ */
+long so_duplex_read(SO_FILE *stream)
+{
+	struct so_duplex *dup = stream->duplex;
+	size_t len = dup->stash_len;
+
+	if (len == 0)
+		return read(stream->fd, stream->buffer, stream->buff_capacity);
+	if (len > stream->buff_capacity)
+		len = stream->buff_capacity;
+	memcpy(stream->buffer, dup->stash + dup->stash_head, len);
+	dup->stash_head += len;
+	dup->stash_len -= len;
+	return len;
+}
+
+/* Switches a duplex SO_FILE between reading (op LASTREAD) and
+ * writing (LASTWRITE), which share one buffer
+ * Pending writes are flushed before reading, since the child may
+ * be waiting for them; unread bytes go back to the front of the
+ * stash before writing, to be read again afterwards
+ * Returns 0 at succes, -1 in case of error
+ */
+int so_duplex_turn(SO_FILE *stream, int op)
+{
+	struct so_duplex *dup = stream->duplex;
+	size_t unread = stream->buff_size - stream->buff_pos;
+
+	if (stream->last_op == op)
+		return 0;
+	if (op == LASTREAD && stream->last_op == LASTWRITE) {
+		if (so_fflush_unlocked(stream) == SO_EOF)
+			return -1;
+	} else if (op == LASTWRITE && stream->last_op == LASTREAD) {
+		if (unread > 0) {
+			if (so_stash_reserve(dup, unread, true)) {
+				stream->found_error = 1;
+				return -1;
+			}
+			dup->stash_head -= unread;
+			dup->stash_len += unread;
+			memcpy(dup->stash + dup->stash_head,
+				stream->buffer + stream->buff_pos, unread);
+		}
+		stream->buff_pos = 0;
+		stream->buff_size = 0;
+	}
+	stream->last_op = op;
+	return 0;
+}
+
+/* Flushes and closes the write side of a duplex SO_FILE, so the
+ * child sees EOF on its input while its output can still be read
+ * Returns 0 at succes, SO_EOF in case of error
+ */
+int so_pshutdown_unlocked(SO_FILE *stream)
+{
+	struct so_duplex *dup = stream->duplex;
+	int ret = 0;
+
+	if (dup == NULL || dup->wfd == -1)
+		return SO_EOF;
+	if (stream->last_op == LASTWRITE)
+		ret = so_fflush_unlocked(stream);
+	if (close(dup->wfd) == -1)
+		ret = SO_EOF;
+	dup->wfd = -1;
+	return ret;
+}
+
+/* Same as so_pshutdown_unlocked, holding the lock of the SO_FILE */
+int so_pshutdown(SO_FILE *stream)
+{
+	int ret;
+
+	so_flockfile(stream);
+	ret = so_pshutdown_unlocked(stream);
+	so_funlockfile(stream);
+	return ret;
+}
@@ -0,0 +1,192 @@
+#include "stdio_internal.h"
+#include <string.h>
+
+/* File offset of the first byte held in the buffer of the SO_FILE,
+ * which the pointer gives directly while writing, and past the
+ * bytes handed out while reading
+ */
+static long so_buffer_start(SO_FILE *stream)
+{
+	if (stream->last_op == LASTWRITE)
+		return stream->pointer;
+	return stream->pointer - stream->buff_pos;
+}
+
+/* Gets the SO_FILE ready for I/O at explicit offsets while its
+ * lock is held: the queue of a write-behind thread is written,
+ * and so are the buffered writes of an append SO_FILE, whose file
+ * offset is only known once written; before a write, a block
+ * being read ahead, which may miss it, is dropped
+ * Returns whether buffered data the I/O must be reconciled with
+ * is there (for a read, only data waiting to be written), so the
+ * lock must be kept over it, or -1 in case of error
+ */
+static int so_pos_prepare(SO_FILE *stream, bool writing)
+{
+	if (stream->z != NULL || stream->dio != NULL) {
+		/* compressed blocks, aligned transfers only */
+		errno = EINVAL;
+		return -1;
+	}
+	if (stream->last_op == LASTWRITE) {
+		if ((stream->mode_type == APPEND ||
+			stream->mode_type == APPENDPLUS ||
+			stream->wb != NULL) &&
+			so_fflush_unlocked(stream) == SO_EOF)
+			return -1;
+		return stream->buff_size > 0;
+	}
+	if (!writing)
+		return 0;
+	if (stream->ra != NULL)
+		so_ra_cancel(stream);
+	return stream->buff_size > 0;
+}
+
+/* Copies into ptr, holding count bytes of the file from offset of
+ * which got were read, the bytes of the range still waiting in
+ * the buffer of the SO_FILE to be written
+ * Returns the number of valid bytes in ptr, which buffered data
+ * past the end of the file extends
+ */
+static long so_pos_overlay(SO_FILE *stream, unsigned char *ptr,
+	size_t count, long offset, long got)
+{
+	long start = stream->pointer;
+	long end = start + stream->buff_size;
+	long lo = offset > start ? offset : start;
+	long hi = offset + (long)count < end ? offset + (long)count : end;
+
+	if (stream->last_op != LASTWRITE || lo >= hi)
+		return got;
+	memcpy(ptr + (lo - offset), stream->buffer + (lo - start), hi - lo);
+	/* the file ends before the buffered data: the gap is a hole */
+	if (lo - offset > got)
+		memset(ptr + got, 0, lo - offset - got);
+	return hi - offset > got ? hi - offset : got;
+}
+
+/* Reads up to count bytes at offset of a memory-mapped SO_FILE,
+ * whose mapping never changes, so no lock is needed
+ * Returns the number of bytes read, 0 past the end of the file
+ */
+static ssize_t so_map_pread(SO_FILE *stream, void *ptr, size_t count,
+	long offset)
+{
+	if ((size_t)offset >= stream->buff_size)
+		return 0;
+	if (count > stream->buff_size - offset)
+		count = stream->buff_size - offset;
+	memcpy(ptr, stream->buffer + offset, count);
+	return count;
+}
+
+/* Reads up to count bytes at offset of the file of the SO_FILE
+ * into ptr, with pread, without moving the SO_FILE position, so
+ * threads can look up different offsets of one SO_FILE at once
+ * Data written to the SO_FILE but still in its buffer is read
+ * as if it was on file. The lock is only held over the pread
+ * while such data is there; memory-mapped SO_FILEs are read
+ * without it
+ * Compressed and direct I/O SO_FILEs are not supported; neither
+ * call is counted in so_fstats, which follows the position
+ * Returns the number of bytes read, 0 past the end of the file,
+ * -1 in case of error, with errno set
+ */
+ssize_t so_fpread(SO_FILE *stream, void *ptr, size_t count, long offset)
+{
+	int overlap = 0;
+	ssize_t got = 0;
+
+	if (offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (stream->mode_type == READMAP)
+		return so_map_pread(stream, ptr, count, offset);
+
+	so_flockfile(stream);
+	overlap = so_pos_prepare(stream, false);
+	if (overlap != 1)
+		so_funlockfile(stream);
+	if (overlap == -1)
+		return -1;
+
+	got = pread(stream->fd, ptr, count, offset);
+	if (overlap == 1) {
+		if (got != -1)
+			got = so_pos_overlay(stream, ptr, count, offset, got);
+		so_funlockfile(stream);
+	}
+	return got;
+}
+
+/* Updates the copy of the file range [offset, offset + count)
+ * kept in the buffer of the SO_FILE, read from the file or waiting
+ * to be written, with ptr
+ */
+static void so_pos_patch(SO_FILE *stream, const unsigned char *ptr,
+	size_t count, long offset)
+{
+	long start = 0;
+	long end = 0;
+	long lo = 0;
+	long hi = 0;
+
+	start = so_buffer_start(stream);
+	end = start + stream->buff_size;
+	lo = offset > start ? offset : start;
+	hi = offset + (long)count < end ? offset + (long)count : end;
+	if (lo < hi)
+		memcpy(stream->buffer + (lo - start), ptr + (lo - offset),
+			hi - lo);
+}
+
+/* Writes count bytes from ptr at offset of the file of the SO_FILE,
+ * with pwrite, without moving the SO_FILE position
+ * Buffered copies of the range are updated, so later reads see
+ * the new data and a later flush does not write the old one back
+ * The lock is only held over the pwrite while there is buffered
+ * data. On append SO_FILEs, as with pwrite on Linux, the data is
+ * appended whatever the offset
+ * Returns count at succes, -1 in case of error, with errno set
+ */
+ssize_t so_fpwrite(SO_FILE *stream, const void *ptr, size_t count,
+	long offset)
+{
+	const unsigned char *src = ptr;
+	size_t done = 0;
+	ssize_t bytes_written = 0;
+	int overlap = 0;
+
+	if (offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (stream->mode_type == READMAP) {
+		errno = EBADF;
+		return -1;
+	}
+
+	so_flockfile(stream);
+	overlap = so_pos_prepare(stream, true);
+	if (overlap != 1)
+		so_funlockfile(stream);
+	if (overlap == -1)
+		return -1;
+
+	while (done < count) {
+		bytes_written = pwrite(stream->fd, src + done, count - done,
+			offset + done);
+		if (bytes_written <= 0)
+			break;
+		so_bc_wrote(stream, offset + done, bytes_written);
+		done += bytes_written;
+	}
+	if (overlap == 1) {
+		/* only what made it to the file */
+		so_pos_patch(stream, src, done, offset);
+		so_funlockfile(stream);
+	}
+	return done == count ? (ssize_t)count : -1;
+}
@@ -0,0 +1,242 @@
+#include "stdio_internal.h"
+#include <string.h>
+
+/* Body of the helper thread of a SO_FILE with read-ahead
+ * Waits for a request, then reads the next block of the file
+ * into the back buffer, while the caller consumes the front one
+ */
+static void *so_ra_worker(void *arg)
+{
+	SO_FILE *stream = arg;
+	struct so_readahead *ra = stream->ra;
+	unsigned char *buf = NULL;
+	ssize_t bytes_read = 0;
+
+	pthread_mutex_lock(&ra->lock);
+	while (true) {
+		while (!ra->quit && ra->state != RA_REQUESTED)
+			pthread_cond_wait(&ra->cond, &ra->lock);
+		if (ra->quit)
+			break;
+		buf = ra->back;
+		pthread_mutex_unlock(&ra->lock);
+
+		bytes_read = read(stream->fd, buf, stream->buff_capacity);
+
+		pthread_mutex_lock(&ra->lock);
+		ra->result = bytes_read;
+		ra->err = errno;
+		ra->state = RA_DONE;
+		pthread_cond_broadcast(&ra->cond);
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return NULL;
+}
+
+/* Asks the helper thread for the next block; lock must be held */
+static void so_ra_request(struct so_readahead *ra)
+{
+	ra->state = RA_REQUESTED;
+	pthread_cond_broadcast(&ra->cond);
+}
+
+/* Waits for the block in progress, if any; lock must be held */
+static void so_ra_wait(struct so_readahead *ra)
+{
+	while (ra->state == RA_REQUESTED)
+		pthread_cond_wait(&ra->cond, &ra->lock);
+}
+
+/* Fills the front buffer of a SO_FILE with read-ahead
+ * A block already fetched in the background is taken by swapping
+ * buffers, which counts as a hidden refill; the helper thread then
+ * immediately starts on the following block
+ * Returns the number of bytes now in the buffer, 0 at EOF or -1
+ * in case of error, with errno set, like read
+ */
+long so_ra_read(SO_FILE *stream)
+{
+	struct so_readahead *ra = stream->ra;
+	unsigned char *front = NULL;
+	long bytes_read = 0;
+
+	pthread_mutex_lock(&ra->lock);
+	ra->refills++;
+	if (ra->state == RA_IDLE) {
+		pthread_mutex_unlock(&ra->lock);
+		bytes_read = read(stream->fd, stream->buffer,
+			stream->buff_capacity);
+		if (bytes_read > 0) {
+			pthread_mutex_lock(&ra->lock);
+			so_ra_request(ra);
+			pthread_mutex_unlock(&ra->lock);
+		}
+		return bytes_read;
+	}
+
+	if (ra->state == RA_DONE)
+		ra->hidden++;
+	so_ra_wait(ra);
+
+	ra->state = RA_IDLE;
+	bytes_read = ra->result;
+	if (bytes_read > 0) {
+		front = stream->buffer;
+		stream->buffer = ra->back;
+		ra->back = front;
+		so_ra_request(ra);
+	} else {
+		errno = ra->err;
+	}
+	pthread_mutex_unlock(&ra->lock);
+	return bytes_read;
+}
+
+/* Drops the block fetched in the background, if any, and moves
+ * the file descr back to the end of the front buffer, so the
+ * SO_FILE can seek or write as if read-ahead was not there
+ * Non-seekable files keep the fetched block for the next refill
+ */
+void so_ra_cancel(SO_FILE *stream)
+{
+	struct so_readahead *ra = stream->ra;
+
+	pthread_mutex_lock(&ra->lock);
+	so_ra_wait(ra);
+	if (ra->state == RA_DONE && so_seekable(stream)) {
+		if (ra->result > 0)
+			lseek(stream->fd, -ra->result, SEEK_CUR);
+		ra->state = RA_IDLE;
+	}
+	pthread_mutex_unlock(&ra->lock);
+}
+
+/* Stops the helper thread of the SO_FILE and frees whichever of
+ * the two buffers is not in use anymore, giving back the
+ * original buffer so the SO_FILE can keep its buffered data
+ */
+static void so_ra_stop(SO_FILE *stream)
+{
+	struct so_readahead *ra = stream->ra;
+
+	so_ra_cancel(stream);
+	pthread_mutex_lock(&ra->lock);
+	ra->quit = true;
+	pthread_cond_broadcast(&ra->cond);
+	pthread_mutex_unlock(&ra->lock);
+	pthread_join(ra->thread, NULL);
+
+	if (stream->buffer == ra->own) {
+		memcpy(ra->back + stream->buff_pos,
+			stream->buffer + stream->buff_pos,
+			stream->buff_size - stream->buff_pos);
+		stream->buffer = ra->back;
+	}
+	pthread_cond_destroy(&ra->cond);
+	pthread_mutex_destroy(&ra->lock);
+	free(ra->own);
+	free(ra);
+	stream->ra = NULL;
+}
+
+/* Frees the read-ahead state of a SO_FILE that is being closed */
+void so_ra_destroy(SO_FILE *stream)
+{
+	if (stream->ra != NULL)
+		so_ra_stop(stream);
+}
+
+/* Turns background read-ahead of a SO_FILE on or off
+ * While on, a helper thread reads the next block into a second
+ * buffer, so sequential reads rarely wait for the file
+ * Unbuffered, memory-mapped, compressed, direct I/O and "r+"
+ * so_popen SO_FILEs are not supported, nor is write-behind, and it
+ * cannot be turned off on a pipe, where the block read ahead could
+ * not be pushed back
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_setreadahead_unlocked(SO_FILE *stream, int enable)
+{
+	struct so_readahead *ra = NULL;
+
+	if (!enable) {
+		if (stream->ra != NULL && !so_seekable(stream))
+			return -1;
+		so_ra_destroy(stream);
+		return 0;
+	}
+	if (stream->ra != NULL)
+		return 0;
+	if (stream->mode_type == READMAP || stream->buff_mode == SO_IONBF ||
+		stream->mode_type == WRITE || stream->mode_type == APPEND ||
+		stream->wb != NULL || stream->duplex != NULL ||
+		stream->z != NULL || stream->dio != NULL)
+		return -1;
+	if (stream->last_op == LASTWRITE &&
+		so_fflush_unlocked(stream) == SO_EOF)
+		return -1;
+	if (so_get_buffer(stream) == SO_EOF || so_bc_sync(stream))
+		return -1;
+
+	ra = calloc(1, sizeof(struct so_readahead));
+	if (ra == NULL)
+		return -1;
+	ra->own = malloc(stream->buff_capacity);
+	if (ra->own == NULL) {
+		free(ra);
+		return -1;
+	}
+	ra->back = ra->own;
+	ra->state = RA_IDLE;
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->cond, NULL);
+
+	stream->ra = ra;
+	if (pthread_create(&ra->thread, NULL, so_ra_worker, stream) != 0) {
+		pthread_cond_destroy(&ra->cond);
+		pthread_mutex_destroy(&ra->lock);
+		free(ra->own);
+		free(ra);
+		stream->ra = NULL;
+		return -1;
+	}
+
+	/* the file descr already sits right after the buffered data */
+	pthread_mutex_lock(&ra->lock);
+	so_ra_request(ra);
+	pthread_mutex_unlock(&ra->lock);
+	return 0;
+}
+
+/* Same as so_setreadahead_unlocked, holding the lock of the SO_FILE */
+int so_setreadahead(SO_FILE *stream, int enable)
+{
+	int ret;
+
+	so_flockfile(stream);
+	ret = so_setreadahead_unlocked(stream, enable);
+	so_funlockfile(stream);
+	return ret;
+}
+
+/* Fills stats with the read-ahead counters of the SO_FILE
+ * Returns 0 at succes, -1 if read-ahead is off
+ */
+int so_freadahead_stats(SO_FILE *stream, struct so_readahead_stats *stats)
+{
+	struct so_readahead *ra = NULL;
+	int ret = -1;
+
+	so_flockfile(stream);
+	ra = stream->ra;
+	if (ra != NULL) {
+		pthread_mutex_lock(&ra->lock);
+		stats->refills = ra->refills;
+		stats->hidden = ra->hidden;
+		pthread_mutex_unlock(&ra->lock);
+		ret = 0;
+	}
+	so_funlockfile(stream);
+	return ret;
+}
+
@@ -0,0 +1,656 @@
+#include "stdio_internal.h"
+#include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LEN_NONE	0
+#define LEN_HH		1
+#define LEN_H		2
+#define LEN_L		3
+#define LEN_LL		4
+#define LEN_J		5
+#define LEN_Z		6
+#define LEN_T		7
+#define LEN_BIGL	8
+
+/* Largest mantissa and power of ten a double holds exactly */
+#define SCAN_EXACT_MANT	(1ULL << 53)
+#define SCAN_EXACT_EXP	22
+
+static const double so_exact_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* State of the field being scanned: how many more characters it
+ * may take, and whether they are also gathered as text in the
+ * line buffer of the SO_FILE, for strtod
+ */
+struct so_field {
+	SO_FILE *stream;
+	size_t width;
+	size_t len;
+	bool text;
+	bool failed;
+};
+
+static inline bool so_is_space(int c)
+{
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/* Returns the value of digit c in base, or -1 if it is not one */
+static inline int so_digit(int c, int base)
+{
+	int d = 36;
+
+	if (c >= '0' && c <= '9')
+		d = c - '0';
+	else if (c >= 'a' && c <= 'z')
+		d = c - 'a' + 10;
+	else if (c >= 'A' && c <= 'Z')
+		d = c - 'A' + 10;
+	return d < base ? d : -1;
+}
+
+/* Converts the 8 decimal digits at p in a handful of word-wide
+ * operations instead of one multiplication per digit
+ * Returns false, leaving *value alone, if any of them is not a digit
+ */
+static inline bool so_eight_digits(const unsigned char *p, uint64_t *value)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t v = 0;
+
+	memcpy(&v, p, sizeof(v));
+	if ((v & 0xF0F0F0F0F0F0F0F0ULL) != 0x3030303030303030ULL ||
+		((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) !=
+		0x3030303030303030ULL)
+		return false;
+	v -= 0x3030303030303030ULL;
+	v = v * 10 + (v >> 8);
+	v = ((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32)) +
+		((v >> 16) & 0x000000FF000000FFULL) *
+		(1 + (10000ULL << 32))) >> 32;
+	*value = v;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* Returns the next character of the SO_FILE without consuming it,
+ * refilling the buffer when it is empty
+ * Returns SO_EOF at EOF or in case of error
+ */
+static int so_scan_peek(SO_FILE *stream)
+{
+	if (stream->buff_pos == stream->buff_size) {
+		if (so_ferror_unlocked(stream) || so_feof_unlocked(stream) ||
+			so_refill(stream) <= 0)
+			return SO_EOF;
+	}
+	return stream->buffer[stream->buff_pos];
+}
+
+/* Consumes n characters of the SO_FILE buffer */
+static inline void so_scan_take(SO_FILE *stream, size_t n)
+{
+	stream->buff_pos += n;
+	stream->pointer += n;
+}
+
+/* Consumes whitespace, a whole buffer at a time
+ * Returns the first character after it, not consumed, or SO_EOF
+ */
+static int so_scan_space(SO_FILE *stream)
+{
+	unsigned char *p = NULL;
+	unsigned char *end = NULL;
+	int c = 0;
+
+	while ((c = so_scan_peek(stream)) != SO_EOF) {
+		p = stream->buffer + stream->buff_pos;
+		end = stream->buffer + stream->buff_size;
+		while (p < end && so_is_space(*p))
+			p++;
+		so_scan_take(stream, p - (stream->buffer + stream->buff_pos));
+		if (p < end)
+			return *p;
+	}
+	return SO_EOF;
+}
+
+/* Returns the next character of the field, or SO_EOF at its end */
+static int so_field_peek(struct so_field *field)
+{
+	if (field->width == 0 || field->failed)
+		return SO_EOF;
+	return so_scan_peek(field->stream);
+}
+
+/* Consumes the next n characters of the field, all of them in the
+ * SO_FILE buffer, gathering them as text if needed
+ */
+static void so_field_take(struct so_field *field, size_t n)
+{
+	SO_FILE *stream = field->stream;
+
+	if (field->text) {
+		if (so_grow(&stream->line_buf, &stream->line_cap,
+			field->len + n + 1)) {
+			stream->found_error = 1;
+			field->failed = true;
+			return;
+		}
+		memcpy(stream->line_buf + field->len,
+			stream->buffer + stream->buff_pos, n);
+		field->len += n;
+	}
+	so_scan_take(stream, n);
+	field->width -= n;
+}
+
+/* Consumes c if it is the next character of the field, in either
+ * case for a letter
+ * Returns true if it was
+ */
+static bool so_field_accept(struct so_field *field, int c)
+{
+	int next = so_field_peek(field);
+
+	if (next == SO_EOF ||
+		(isalpha(c) ? tolower(next) != tolower(c) : next != c))
+		return false;
+	so_field_take(field, 1);
+	return true;
+}
+
+/* Consumes a run of digits in base, straight out of the buffer,
+ * accumulating them into *value; decimal runs are converted eight
+ * digits at a time while the buffer holds that many
+ * Sets *overflow if *value cannot hold the run
+ * Returns the number of digits consumed
+ */
+static size_t so_field_digits(struct so_field *field, int base,
+	unsigned long long *value, bool *overflow)
+{
+	SO_FILE *stream = field->stream;
+	const unsigned char *p = NULL;
+	unsigned long long acc = *value;
+	uint64_t eight = 0;
+	size_t total = 0;
+	size_t avail = 0;
+	size_t n = 0;
+	int d = 0;
+
+	while (so_field_peek(field) != SO_EOF) {
+		p = stream->buffer + stream->buff_pos;
+		avail = stream->buff_size - stream->buff_pos;
+		if (avail > field->width)
+			avail = field->width;
+
+		n = 0;
+		while (base == 10 && avail - n >= 8 &&
+			so_eight_digits(p + n, &eight)) {
+			if (__builtin_mul_overflow(acc, 100000000ULL, &acc) ||
+				__builtin_add_overflow(acc, eight, &acc))
+				*overflow = true;
+			n += 8;
+		}
+		while (n < avail && (d = so_digit(p[n], base)) >= 0) {
+			if (__builtin_mul_overflow(acc, (unsigned)base, &acc) ||
+				__builtin_add_overflow(acc, (unsigned)d, &acc))
+				*overflow = true;
+			n++;
+		}
+
+		so_field_take(field, n);
+		total += n;
+		if (n < avail)
+			break;
+	}
+	*value = acc;
+	return total;
+}
+
+/* Scans an integer in base (0 detects it from the prefix, as
+ * strtol does) into *value
+ * Out of range values saturate like strtoll does for signed
+ * conversions and strtoull does for unsigned ones
+ * Returns 0 at succes, -1 if the field holds no digits
+ */
+static int so_scan_int(struct so_field *field, int base, bool is_signed,
+	unsigned long long *value)
+{
+	unsigned long long magnitude = 0;
+	bool overflow = false;
+	bool negative = false;
+	size_t digits = 0;
+	int c = so_field_peek(field);
+
+	negative = c == '-';
+	if (c == '-' || c == '+')
+		so_field_take(field, 1);
+
+	if ((base == 0 || base == 16) && so_field_accept(field, '0')) {
+		digits = 1;
+		if (so_field_accept(field, 'x'))
+			base = 16;
+		else if (base == 0)
+			base = 8;
+	}
+	if (base == 0)
+		base = 10;
+	digits += so_field_digits(field, base, &magnitude, &overflow);
+
+	if (!is_signed)
+		*value = overflow ? ~0ULL : negative ? 0ULL - magnitude :
+			magnitude;
+	else if (negative)
+		*value = overflow || magnitude > 1ULL << 63 ? 1ULL << 63 :
+			0ULL - magnitude;
+	else
+		*value = overflow || magnitude >= 1ULL << 63 ?
+			(1ULL << 63) - 1 : magnitude;
+	return digits > 0 && !field->failed ? 0 : -1;
+}
+
+/* Scans the letters of word, case insensitive
+ * Returns true if all of them matched
+ */
+static bool so_field_word(struct so_field *field, const char *word)
+{
+	while (*word != '\0')
+		if (!so_field_accept(field, *word++))
+			return false;
+	return true;
+}
+
+/* Scans a floating point number, gathering its text in the line
+ * buffer of the SO_FILE
+ * Plain decimal numbers with at most 15-16 significant digits and
+ * a small exponent are converted exactly with one multiplication
+ * or division; everything else goes through strtod on the text
+ * Sets *exact and *value when the fast conversion applies
+ * Returns 0 at succes, -1 if the field is not a number
+ */
+static int so_scan_float(struct so_field *field, double *value, bool *exact)
+{
+	unsigned long long mantissa = 0;
+	unsigned long long exp_digits = 0;
+	bool overflow = false;
+	bool exp_overflow = false;
+	bool negative = false;
+	bool exp_negative = false;
+	size_t digits = 0;
+	long exponent = 0;
+	int c = 0;
+
+	field->text = true;
+	field->len = 0;
+	*exact = false;
+
+	c = so_field_peek(field);
+	negative = c == '-';
+	if (c == '-' || c == '+')
+		so_field_take(field, 1);
+
+	c = so_field_peek(field);
+	if (c == 'i' || c == 'I') {
+		if (!so_field_word(field, "inf"))
+			return -1;
+		so_field_word(field, "inity");
+		return field->failed ? -1 : 0;
+	}
+	if (c == 'n' || c == 'N') {
+		if (!so_field_word(field, "nan"))
+			return -1;
+		return field->failed ? -1 : 0;
+	}
+
+	if (so_field_accept(field, '0')) {
+		digits = 1;
+		if (so_field_accept(field, 'x')) {
+			/* hexadecimal float, left to strtod */
+			digits = so_field_digits(field, 16, &mantissa,
+				&overflow);
+			if (so_field_accept(field, '.'))
+				digits += so_field_digits(field, 16,
+					&mantissa, &overflow);
+			if (digits == 0)
+				return -1;
+			if (so_field_accept(field, 'p')) {
+				c = so_field_peek(field);
+				if (c == '-' || c == '+')
+					so_field_take(field, 1);
+				if (so_field_digits(field, 10, &exp_digits,
+					&exp_overflow) == 0)
+					return -1;
+			}
+			return field->failed ? -1 : 0;
+		}
+	}
+
+	digits += so_field_digits(field, 10, &mantissa, &overflow);
+	if (so_field_accept(field, '.')) {
+		size_t frac = so_field_digits(field, 10, &mantissa,
+			&overflow);
+
+		digits += frac;
+		exponent -= frac;
+	}
+	if (digits == 0)
+		return -1;
+	if (so_field_accept(field, 'e')) {
+		c = so_field_peek(field);
+		exp_negative = c == '-';
+		if (c == '-' || c == '+')
+			so_field_take(field, 1);
+		if (so_field_digits(field, 10, &exp_digits,
+			&exp_overflow) == 0)
+			return -1;
+		if (exp_overflow || exp_digits > 100000)
+			exp_digits = 100000;
+		exponent += exp_negative ? -(long)exp_digits : (long)exp_digits;
+	}
+	if (field->failed)
+		return -1;
+
+	if (!overflow && mantissa <= SCAN_EXACT_MANT &&
+		exponent >= -SCAN_EXACT_EXP && exponent <= SCAN_EXACT_EXP) {
+		*value = exponent < 0 ?
+			(double)mantissa / so_exact_pow10[-exponent] :
+			(double)mantissa * so_exact_pow10[exponent];
+		if (negative)
+			*value = -*value;
+		*exact = true;
+	}
+	return 0;
+}
+
+/* Reads the length modifier at *p, advancing past it */
+static int so_scan_length(const char **p)
+{
+	const char *s = *p;
+	int length = LEN_NONE;
+
+	if (s[0] == 'h' && s[1] == 'h') {
+		length = LEN_HH;
+		s += 2;
+	} else if (s[0] == 'l' && s[1] == 'l') {
+		length = LEN_LL;
+		s += 2;
+	} else if (*s == 'h' || *s == 'l' || *s == 'j' || *s == 'z' ||
+		*s == 't' || *s == 'L' || *s == 'q') {
+		length = *s == 'h' ? LEN_H : *s == 'l' ? LEN_L :
+			*s == 'j' ? LEN_J : *s == 'z' ? LEN_Z :
+			*s == 't' ? LEN_T : *s == 'q' ? LEN_LL : LEN_BIGL;
+		s++;
+	}
+	*p = s;
+	return length;
+}
+
+/* Stores an integer through the pointer argument matching length */
+static void so_store_int(int length, unsigned long long value, va_list *ap)
+{
+	switch (length) {
+	case LEN_HH:
+		*va_arg(*ap, signed char *) = value;
+		break;
+	case LEN_H:
+		*va_arg(*ap, short *) = value;
+		break;
+	case LEN_L:
+		*va_arg(*ap, long *) = value;
+		break;
+	case LEN_LL:
+		*va_arg(*ap, long long *) = value;
+		break;
+	case LEN_J:
+		*va_arg(*ap, intmax_t *) = value;
+		break;
+	case LEN_Z:
+		*va_arg(*ap, size_t *) = value;
+		break;
+	case LEN_T:
+		*va_arg(*ap, ptrdiff_t *) = value;
+		break;
+	default:
+		*va_arg(*ap, int *) = value;
+		break;
+	}
+}
+
+/* Stores a floating point field through the pointer argument
+ * matching length, converting its text unless the fast path
+ * already produced an exact double
+ */
+static void so_store_float(SO_FILE *stream, struct so_field *field,
+	int length, double value, bool exact, va_list *ap)
+{
+	char *text = (char *)stream->line_buf;
+
+	text[field->len] = '\0';
+	if (length == LEN_BIGL)
+		*va_arg(*ap, long double *) = strtold(text, NULL);
+	else if (length == LEN_L)
+		*va_arg(*ap, double *) = exact ? value : strtod(text, NULL);
+	else
+		*va_arg(*ap, float *) = strtof(text, NULL);
+}
+
+/* Copies a field of characters into dst, straight from the buffer
+ * %s stops at whitespace and terminates dst with '\0'
+ * Returns the number of characters copied
+ */
+static size_t so_scan_chars(struct so_field *field, char *dst,
+	bool stop_at_space)
+{
+	SO_FILE *stream = field->stream;
+	const unsigned char *p = NULL;
+	size_t total = 0;
+	size_t avail = 0;
+	size_t n = 0;
+
+	while (so_field_peek(field) != SO_EOF) {
+		p = stream->buffer + stream->buff_pos;
+		avail = stream->buff_size - stream->buff_pos;
+		if (avail > field->width)
+			avail = field->width;
+		n = 0;
+		if (stop_at_space)
+			while (n < avail && !so_is_space(p[n]))
+				n++;
+		else
+			n = avail;
+		if (dst != NULL)
+			memcpy(dst + total, p, n);
+		so_field_take(field, n);
+		total += n;
+		if (n < avail)
+			break;
+	}
+	if (stop_at_space && dst != NULL)
+		dst[total] = '\0';
+	return total;
+}
+
+/* Reads formatted input from the SO_FILE as vfscanf does, with the
+ * SO_FILE lock already held
+ * Numbers and tokens are parsed straight out of the SO_FILE buffer,
+ * refilling it as a field crosses its end
+ * Supports the d, i, u, o, x, X, p, e, f, g, a (any case), s, c, n
+ * and % conversions, with '*', field widths and the usual length
+ * modifiers; %[ is not supported and ends the scan
+ * Returns the number of fields assigned, or SO_EOF if the input
+ * ended or failed before the first conversion
+ */
+int so_vfscanf_unlocked(SO_FILE *stream, const char *format, va_list ap)
+{
+	struct so_field field;
+	unsigned long long value_int = 0;
+	const char *p = format;
+	long start = stream->pointer;
+	double value = 0;
+	bool suppress = false;
+	bool exact = false;
+	bool done = false;
+	va_list args;
+	int assigned = 0;
+	int converted = 0;
+	int length = 0;
+	int base = 0;
+	int c = 0;
+
+	if (so_ferror_unlocked(stream))
+		return SO_EOF;
+	if (stream->duplex != NULL && so_duplex_turn(stream, LASTREAD))
+		return SO_EOF;
+	stream->last_op = LASTREAD;
+
+	va_copy(args, ap);
+	while (*p != '\0' && !done) {
+		if (so_is_space(*p)) {
+			so_scan_space(stream);
+			p++;
+			continue;
+		}
+		if (*p != '%' || p[1] == '%') {
+			if (*p == '%') {
+				p++;
+				c = so_scan_space(stream);
+			} else {
+				c = so_scan_peek(stream);
+			}
+			if (c == SO_EOF && converted == 0)
+				assigned = SO_EOF;
+			if (c != (unsigned char)*p)
+				break;
+			so_scan_take(stream, 1);
+			p++;
+			continue;
+		}
+
+		p++;
+		suppress = *p == '*';
+		if (suppress)
+			p++;
+		field.stream = stream;
+		field.width = 0;
+		field.len = 0;
+		field.text = false;
+		field.failed = false;
+		while (*p >= '0' && *p <= '9')
+			field.width = field.width * 10 + (*p++ - '0');
+		length = so_scan_length(&p);
+
+		if (*p == 'n') {
+			if (!suppress)
+				so_store_int(length, stream->pointer - start,
+					&args);
+			p++;
+			continue;
+		}
+
+		if (*p != 'c' && so_scan_space(stream) == SO_EOF) {
+			if (converted == 0)
+				assigned = SO_EOF;
+			break;
+		}
+		if (*p == 'c' && field.width == 0)
+			field.width = 1;
+		else if (field.width == 0)
+			field.width = (size_t)-1;
+
+		switch (*p) {
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+		case 'p':
+			base = *p == 'i' ? 0 : *p == 'o' ? 8 :
+				(*p == 'd' || *p == 'u') ? 10 : 16;
+			if (so_scan_int(&field, base, *p == 'd' || *p == 'i',
+				&value_int)) {
+				done = true;
+				break;
+			}
+			if (suppress)
+				break;
+			if (*p == 'p')
+				*va_arg(args, void **) =
+					(void *)(uintptr_t)value_int;
+			else
+				so_store_int(length, value_int, &args);
+			assigned++;
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A':
+			if (so_scan_float(&field, &value, &exact)) {
+				done = true;
+				break;
+			}
+			if (suppress)
+				break;
+			so_store_float(stream, &field, length, value, exact,
+				&args);
+			assigned++;
+			break;
+		case 's':
+		case 'c':
+			if (so_scan_chars(&field, suppress ? NULL :
+				va_arg(args, char *), *p == 's') == 0) {
+				if (converted == 0 && so_feof_unlocked(stream))
+					assigned = SO_EOF;
+				done = true;
+				break;
+			}
+			if (!suppress)
+				assigned++;
+			break;
+		default:
+			done = true;
+			break;
+		}
+		if (!done)
+			converted++;
+		p++;
+	}
+	va_end(args);
+
+	if (so_ferror_unlocked(stream) && converted == 0)
+		return SO_EOF;
+	return assigned;
+}
+
+/* Same as so_vfscanf_unlocked, holding the lock of the SO_FILE */
+int so_vfscanf(SO_FILE *stream, const char *format, va_list ap)
+{
+	int ret;
+
+	so_flockfile(stream);
+	ret = so_vfscanf_unlocked(stream, format, ap);
+	so_funlockfile(stream);
+	return ret;
+}
+
+/* Reads formatted input from the SO_FILE, as fscanf does
+ * Returns the number of fields assigned, or SO_EOF if the input
+ * ended or failed before the first conversion
+ */
+int so_fscanf(SO_FILE *stream, const char *format, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, format);
+	ret = so_vfscanf(stream, format, ap);
+	va_end(ap);
+	return ret;
+}
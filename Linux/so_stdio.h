@@ -23,6 +23,7 @@
 #endif
 
 #include <stdlib.h>
+#include <stdarg.h>
 
 #define SEEK_SET	0	/* Seek from beginning of file.  */
 #define SEEK_CUR	1	/* Seek from current position.  */
@@ -30,6 +31,10 @@
 
 #define SO_EOF (-1)
 
+#define SO_IOFBF	0	/* Fully buffered.  */
+#define SO_IOLBF	1	/* Line buffered.  */
+#define SO_IONBF	2	/* No buffering.  */
+
 struct _so_file;
 
 typedef struct _so_file SO_FILE;
@@ -48,6 +53,9 @@ FUNC_DECL_PREFIX HANDLE so_fileno(SO_FILE *stream);
 
 FUNC_DECL_PREFIX int so_fflush(SO_FILE *stream);
 
+FUNC_DECL_PREFIX
+int so_setvbuf(SO_FILE *stream, char *buf, int mode, size_t size);
+
 FUNC_DECL_PREFIX int so_fseek(SO_FILE *stream, long offset, int whence);
 FUNC_DECL_PREFIX long so_ftell(SO_FILE *stream);
 
@@ -63,7 +71,146 @@ FUNC_DECL_PREFIX int so_fputc(int c, SO_FILE *stream);
 FUNC_DECL_PREFIX int so_feof(SO_FILE *stream);
 FUNC_DECL_PREFIX int so_ferror(SO_FILE *stream);
 
+FUNC_DECL_PREFIX char *so_fgets(char *s, int size, SO_FILE *stream);
+
+#if defined(__linux__)
+FUNC_DECL_PREFIX ssize_t so_getdelim(char **lineptr, size_t *n, int delim,
+	SO_FILE *stream);
+FUNC_DECL_PREFIX ssize_t so_getline(char **lineptr, size_t *n,
+	SO_FILE *stream);
+FUNC_DECL_PREFIX const char *so_getline_view(SO_FILE *stream, size_t *len);
+
+FUNC_DECL_PREFIX ssize_t so_fcopy(SO_FILE *dst, SO_FILE *src, size_t n);
+
+FUNC_DECL_PREFIX int so_setchecksum(SO_FILE *stream, int enable);
+FUNC_DECL_PREFIX unsigned int so_fchecksum(SO_FILE *stream);
+
+FUNC_DECL_PREFIX int so_fflush_all(void);
+
+FUNC_DECL_PREFIX ssize_t so_fpread(SO_FILE *stream, void *ptr, size_t count,
+	long offset);
+FUNC_DECL_PREFIX ssize_t so_fpwrite(SO_FILE *stream, const void *ptr,
+	size_t count, long offset);
+#endif
+
+FUNC_DECL_PREFIX int so_fprintf(SO_FILE *stream, const char *format, ...);
+FUNC_DECL_PREFIX
+int so_vfprintf(SO_FILE *stream, const char *format, va_list ap);
+
+FUNC_DECL_PREFIX int so_fscanf(SO_FILE *stream, const char *format, ...);
+FUNC_DECL_PREFIX
+int so_vfscanf(SO_FILE *stream, const char *format, va_list ap);
+
+/* Explicit locking; the _unlocked variants skip the per-call lock */
+FUNC_DECL_PREFIX void so_flockfile(SO_FILE *stream);
+FUNC_DECL_PREFIX void so_funlockfile(SO_FILE *stream);
+
+FUNC_DECL_PREFIX int so_fgetc_unlocked(SO_FILE *stream);
+FUNC_DECL_PREFIX int so_fputc_unlocked(int c, SO_FILE *stream);
+
+FUNC_DECL_PREFIX
+size_t so_fread_unlocked(void *ptr, size_t size, size_t nmemb,
+	SO_FILE *stream);
+
+FUNC_DECL_PREFIX
+size_t so_fwrite_unlocked(const void *ptr, size_t size, size_t nmemb,
+	SO_FILE *stream);
+
+FUNC_DECL_PREFIX
+int so_vfprintf_unlocked(SO_FILE *stream, const char *format, va_list ap);
+
+FUNC_DECL_PREFIX
+int so_vfscanf_unlocked(SO_FILE *stream, const char *format, va_list ap);
+
+struct so_stats {
+	unsigned long read_calls;	/* read system calls */
+	unsigned long write_calls;	/* write system calls */
+	unsigned long long bytes_read;	/* bytes returned by read */
+	unsigned long long bytes_written;	/* bytes accepted by write */
+	unsigned long refills;		/* buffer refills */
+	unsigned long buffer_hits;	/* reads served from the buffer */
+	unsigned long flushes;		/* buffer flushes */
+	unsigned long seeks;		/* lseek system calls */
+	unsigned long discarding_seeks;	/* seeks dropping unread data */
+	unsigned long short_writes;	/* writes only partly done */
+	unsigned long long syscall_ns;	/* time spent in the calls above */
+};
+
+FUNC_DECL_PREFIX int so_fstats(SO_FILE *stream, struct so_stats *stats);
+
 FUNC_DECL_PREFIX SO_FILE *so_popen(const char *command, const char *type);
 FUNC_DECL_PREFIX int so_pclose(SO_FILE *stream);
 
+#if defined(__linux__)
+FUNC_DECL_PREFIX SO_FILE *so_popenv(const char *path, char *const argv[],
+	const char *type);
+
+struct _so_pgroup;
+
+typedef struct _so_pgroup SO_PGROUP;
+
+FUNC_DECL_PREFIX SO_PGROUP *so_popen_many(const char *const commands[],
+	int count, const char *type);
+FUNC_DECL_PREFIX SO_FILE *so_pgroup_stream(SO_PGROUP *group, int index);
+FUNC_DECL_PREFIX int so_pgroup_next(SO_PGROUP *group, int timeout,
+	size_t *avail);
+FUNC_DECL_PREFIX int so_pclose_all(SO_PGROUP *group, int *statuses);
+
+struct _so_ring;
+
+typedef struct _so_ring SO_RING;
+
+struct so_completion {
+	SO_FILE *stream;
+	void *user_data;
+	long result;	/* bytes transferred or -errno */
+};
+
+#define SO_PIPE_VMSPLICE	1	/* bulk writes move pages, not bytes */
+
+FUNC_DECL_PREFIX int so_setpipe(SO_FILE *stream, size_t size, int flags);
+FUNC_DECL_PREFIX int so_pshutdown(SO_FILE *stream);
+
+struct so_readahead_stats {
+	unsigned long refills;	/* buffer refills while read-ahead was on */
+	unsigned long hidden;	/* refills served without waiting */
+};
+
+FUNC_DECL_PREFIX int so_setreadahead(SO_FILE *stream, int enable);
+FUNC_DECL_PREFIX int so_freadahead_stats(SO_FILE *stream,
+	struct so_readahead_stats *stats);
+
+struct so_writebehind_stats {
+	unsigned long handoffs;	/* buffers handed to the writer thread */
+	unsigned long waits;	/* handoffs that waited for a free buffer */
+	unsigned long long wait_ns;	/* time spent in those waits */
+};
+
+FUNC_DECL_PREFIX int so_setwritebehind(SO_FILE *stream, int enable);
+FUNC_DECL_PREFIX int so_fwritebehind_stats(SO_FILE *stream,
+	struct so_writebehind_stats *stats);
+
+struct so_blockcache_stats {
+	unsigned long hits;	/* refills served from a cached block */
+	unsigned long misses;	/* refills that read a block from file */
+	unsigned long evictions;	/* blocks dropped to make room */
+	unsigned long invalidations;	/* blocks dropped by writes */
+};
+
+FUNC_DECL_PREFIX int so_setblockcache(size_t block_size, size_t budget);
+FUNC_DECL_PREFIX int so_blockcache_stats(struct so_blockcache_stats *stats);
+
+FUNC_DECL_PREFIX SO_RING *so_ring_create(unsigned int entries);
+FUNC_DECL_PREFIX int so_ring_destroy(SO_RING *ring);
+
+FUNC_DECL_PREFIX int so_fread_async(SO_RING *ring, void *ptr, size_t count,
+	SO_FILE *stream, void *user_data);
+FUNC_DECL_PREFIX int so_fwrite_async(SO_RING *ring, const void *ptr,
+	size_t count, SO_FILE *stream, void *user_data);
+
+FUNC_DECL_PREFIX int so_submit(SO_RING *ring);
+FUNC_DECL_PREFIX int so_reap(SO_RING *ring, struct so_completion *events,
+	int max, int min_complete);
+#endif
+
 #endif /* SO_STDIO_H */
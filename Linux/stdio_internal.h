@@ -9,10 +9,15 @@
 #define WRITEPLUS	3
 #define APPEND		4
 #define APPENDPLUS	5
+#define READMAP		6
 #define LASTREAD	0
 #define LASTWRITE	1
 #define PIPE_READ	0
 #define PIPE_WRITE	1
+#define RA_IDLE		0
+#define RA_REQUESTED	1
+#define RA_DONE		2
+#define WB_SLOTS	4
 
 #include "stdio.h"
 #include "stdlib.h"
@@ -23,20 +28,297 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <time.h>
 
 typedef enum { false, true } bool;
 
+/* Double buffering state of a SO_FILE with read-ahead */
+struct so_readahead {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned char *own;
+	unsigned char *back;
+	int state;
+	long result;
+	int err;
+	bool quit;
+	unsigned long refills;
+	unsigned long hidden;
+};
+
+/* One buffer of the write-behind ring, and the bytes queued in it */
+struct so_wb_slot {
+	unsigned char *buf;
+	size_t len;
+};
+
+/* Write-behind state of a SO_FILE
+ * The writer thread drains count slots from head; the others hold
+ * free buffers, swapped with the SO_FILE buffer when it is handed
+ * over. err, the errno of the first failed write, is also read
+ * without the lock by so_wb_check
+ */
+struct so_writebehind {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct so_wb_slot slots[WB_SLOTS];
+	unsigned char *orig;
+	int head;
+	int count;
+	int err;
+	bool quit;
+	struct so_stats done;
+	unsigned long handoffs;
+	unsigned long waits;
+	unsigned long long wait_ns;
+};
+
+/* Write side of a SO_FILE opened with so_popen(..., "r+")
+ * The read side is the fd of the SO_FILE; output of the child
+ * read while a write was blocked waits in the stash, ahead of
+ * anything read later
+ */
+struct so_duplex {
+	int wfd;
+	unsigned char *stash;
+	size_t stash_cap;
+	size_t stash_head;
+	size_t stash_len;
+};
+
+/* Position of one block of a SO_FILE opened in "rz" or "wz" mode:
+ * its first uncompressed byte, and the file offset of its header
+ */
+struct so_zblock {
+	long long raw;
+	long long off;
+};
+
+/* Block compression state of a SO_FILE opened in "rz" or "wz" mode
+ * The SO_FILE buffer holds one uncompressed block; comp holds the
+ * same block compressed, with its header
+ */
+struct so_zfile {
+	bool writing;
+	unsigned char *comp;
+	size_t comp_cap;
+	unsigned int *table;
+	struct so_zblock *index;
+	size_t index_cap;
+	size_t blocks;
+	long long data_end;
+	long long raw_end;
+	size_t next;
+	size_t skip;
+};
+
+/* Direct I/O state of a SO_FILE opened in "rd" or "wd" mode
+ * When reading, off is the aligned offset of the next pread and
+ * skip the bytes at its start already handed out; when writing,
+ * synced counts the bytes of the buffer already written by a
+ * flush
+ */
+struct so_direct {
+	bool writing;
+	size_t align;
+	long long off;
+	size_t skip;
+	size_t synced;
+};
+
 struct _so_file {
 	int fd;
 	long pointer;
 	int mode_type;
-	unsigned char buffer[BUFFCAPACIT];
-	int buff_size;
+	unsigned char *buffer;
+	unsigned char unbuf_byte[1];
+	size_t buff_capacity;
+	int buff_mode;
+	bool buff_owned;
+	size_t buff_size;
 	int last_op;
 	bool found_eof;
 	pid_t pid;
 	int found_error;
-	int buff_pos;
+	size_t buff_pos;
+	int map_advice;
+	int seekable;
+	int pipe_flags;
+	struct so_readahead *ra;
+	struct so_writebehind *wb;
+	struct so_duplex *duplex;
+	struct so_zfile *z;
+	struct so_direct *dio;
+	bool csum_on;
+	unsigned int csum;
+	bool cached;
+	dev_t bc_dev;
+	ino_t bc_ino;
+	bool fd_stale;
+	pthread_mutex_t lock;
+	struct so_stats stats;
+	unsigned char *line_buf;
+	size_t line_cap;
+	char *name;
+	SO_FILE *prev;
+	SO_FILE *next;
+	int pins;
+};
+
+/* One asynchronous read or write, in flight or completed */
+struct so_async_req {
+	SO_FILE *stream;
+	void *user_data;
+	int opcode;
+	void *buf;
+	size_t len;
+	long offset;
+	long result;
+	int next;
+};
+
+struct _so_ring {
+	int fd;
+	unsigned int entries;
+	unsigned int queued;
+	unsigned int inflight;
+	struct so_async_req *reqs;
+	int free_head;
+	/* io_uring submission and completion rings */
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* requests handled with pread/pwrite when io_uring is missing */
+	int *emu_queue;
+	int *emu_done;
+	unsigned int emu_done_head;
+	unsigned int emu_done_count;
 };
 
+/* Children started together by so_popen_many; events returned by
+ * one epoll_wait are handed out one per so_pgroup_next call
+ */
+struct _so_pgroup {
+	int epfd;
+	int count;
+	int active;
+	bool reads;
+	SO_FILE **streams;
+	pid_t *pids;
+	struct epoll_event *events;
+	int ev_count;
+	int ev_next;
+	int last;
+};
+
+int so_get_buffer(SO_FILE *stream);
+bool so_seekable(SO_FILE *stream);
+long so_refill(SO_FILE *stream);
+
+void so_register(SO_FILE *stream, const char *name);
+void so_unregister(SO_FILE *stream);
+
+int so_ring_push(SO_RING *ring, int opcode, void *ptr, size_t count,
+	SO_FILE *stream, void *user_data, long offset);
+
+static inline unsigned long long so_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned int so_crc32c(unsigned int crc, const void *ptr, size_t len);
+
+/* Extends the checksum of the SO_FILE, if it is on, with len bytes
+ * moving between ptr and the file
+ */
+static inline void so_csum(SO_FILE *stream, const void *ptr, size_t len)
+{
+	if (stream->csum_on && len > 0)
+		stream->csum = so_crc32c(stream->csum, ptr, len);
+}
+
+int so_setvbuf_unlocked(SO_FILE *stream, char *buf, int mode, size_t size);
+int so_fseek_unlocked(SO_FILE *stream, long offset, int whence);
+long so_ftell_unlocked(SO_FILE *stream);
+int so_fflush_unlocked(SO_FILE *stream);
+int so_feof_unlocked(SO_FILE *stream);
+int so_ferror_unlocked(SO_FILE *stream);
+
+long so_ra_read(SO_FILE *stream);
+void so_ra_cancel(SO_FILE *stream);
+void so_ra_destroy(SO_FILE *stream);
+
+int so_write_out(SO_FILE *stream, const void *ptr, size_t len);
+int so_wb_write_out(SO_FILE *stream, const void *ptr, size_t len);
+int so_wb_drain(SO_FILE *stream);
+void so_wb_collect(SO_FILE *stream);
+void so_wb_destroy(SO_FILE *stream);
+
+/* Marks the SO_FILE in error once a write of its write-behind
+ * thread failed, so the next call on it reports the failure
+ * Returns true if it did
+ */
+static inline bool so_wb_check(SO_FILE *stream)
+{
+	if (stream->wb == NULL ||
+		__atomic_load_n(&stream->wb->err, __ATOMIC_ACQUIRE) == 0)
+		return false;
+	stream->found_error = 1;
+	return true;
+}
+
+int so_grow(unsigned char **buf, size_t *cap, size_t need);
+
+int so_pipe_vmsplice(SO_FILE *stream, const void *ptr, size_t len);
+int so_duplex_turn(SO_FILE *stream, int op);
+ssize_t so_duplex_writev(SO_FILE *stream, const struct iovec *iov, int cnt);
+long so_duplex_read(SO_FILE *stream);
+int so_pshutdown_unlocked(SO_FILE *stream);
+int so_pdetach(SO_FILE *stream, pid_t *pid);
+
+int so_z_open(SO_FILE *stream, bool writing);
+long so_z_read(SO_FILE *stream);
+int so_z_write_out(SO_FILE *stream, const void *ptr, size_t len);
+int so_z_seek(SO_FILE *stream, long offset, int whence);
+int so_z_finish(SO_FILE *stream);
+void so_z_free(SO_FILE *stream);
+
+int so_dio_open_fd(const char *pathname, bool writing);
+int so_dio_open(SO_FILE *stream, bool writing);
+long so_dio_read(SO_FILE *stream);
+int so_dio_write_out(SO_FILE *stream, const void *ptr, size_t len);
+int so_dio_seek(SO_FILE *stream, long offset, int whence);
+size_t so_dio_synced(SO_FILE *stream);
+void so_dio_free(SO_FILE *stream);
+
+bool so_bc_usable(SO_FILE *stream);
+void so_bc_probe(SO_FILE *stream);
+long so_bc_read(SO_FILE *stream);
+int so_bc_seek(SO_FILE *stream, long offset);
+int so_bc_sync(SO_FILE *stream);
+void so_bc_wrote(SO_FILE *stream, long off, long len);
+
 #endif /* STDIO_INTERNAL_H */
@@ -0,0 +1,313 @@
+#include "stdio_internal.h"
+#include <string.h>
+#include <stdint.h>
+
+/* Dirty SO_FILEs whose buffers so_fflush_all writes in one batch */
+#define FLUSH_BATCH	256
+
+/* All open SO_FILE structures, most recently opened first */
+static SO_FILE *so_streams;
+static pthread_mutex_t so_streams_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Signalled when the last pin of a SO_FILE is dropped */
+static pthread_cond_t so_streams_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t so_streams_once = PTHREAD_ONCE_INIT;
+static bool so_stats_dump;
+/* SO_RING of so_fflush_all, kept between calls; so_flush_ring_lock */
+static pthread_mutex_t so_flush_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static SO_RING *so_flush_ring;
+static bool so_flush_ring_tried;
+
+/* Prints the statistics of the SO_FILE as one line on stderr */
+static void so_stats_print(SO_FILE *stream, const char *when)
+{
+	struct so_stats *st = &stream->stats;
+
+	fprintf(stderr, "so_stats %s name=%s fd=%d read_calls=%lu "
+		"write_calls=%lu bytes_read=%llu bytes_written=%llu "
+		"refills=%lu buffer_hits=%lu flushes=%lu seeks=%lu "
+		"discarding_seeks=%lu short_writes=%lu syscall_ns=%llu\n",
+		when, stream->name != NULL ? stream->name : "?", stream->fd,
+		st->read_calls, st->write_calls, st->bytes_read,
+		st->bytes_written, st->refills, st->buffer_hits, st->flushes,
+		st->seeks, st->discarding_seeks, st->short_writes,
+		st->syscall_ns);
+}
+
+/* Dumps the statistics of the SO_FILEs still open at exit */
+static void so_stats_atexit(void)
+{
+	SO_FILE *stream = NULL;
+
+	pthread_mutex_lock(&so_streams_lock);
+	for (stream = so_streams; stream != NULL; stream = stream->next)
+		so_stats_print(stream, "exit");
+	pthread_mutex_unlock(&so_streams_lock);
+}
+
+static int so_flush_all(bool wait);
+
+/* Writes the buffers of the SO_FILEs still open at exit, so data
+ * is not lost when the process ends without closing them; SO_FILEs
+ * locked by another thread are left alone
+ */
+static void so_flush_atexit(void)
+{
+	so_flush_all(false);
+}
+
+/* Reads SO_STDIO_STATS once; any non-empty value turns on the
+ * statistics dump, at so_fclose/so_pclose and at exit
+ * Also arranges for open SO_FILEs to be flushed at exit, before
+ * their statistics are dumped
+ */
+static void so_streams_init(void)
+{
+	const char *env = getenv("SO_STDIO_STATS");
+
+	so_stats_dump = env != NULL && env[0] != '\0';
+	if (so_stats_dump)
+		atexit(so_stats_atexit);
+	atexit(so_flush_atexit);
+}
+
+/* Adds a new SO_FILE to the list of open streams
+ * The name (path or command) is only kept for the statistics dump
+ */
+void so_register(SO_FILE *stream, const char *name)
+{
+	pthread_once(&so_streams_once, so_streams_init);
+	memset(&stream->stats, 0, sizeof(stream->stats));
+	stream->name = so_stats_dump ? strdup(name) : NULL;
+
+	pthread_mutex_lock(&so_streams_lock);
+	stream->pins = 0;
+	stream->prev = NULL;
+	stream->next = so_streams;
+	if (so_streams != NULL)
+		so_streams->prev = stream;
+	so_streams = stream;
+	pthread_mutex_unlock(&so_streams_lock);
+}
+
+/* Removes a SO_FILE that is being closed from the list of open
+ * streams, dumping its statistics if requested
+ * Waits until so_fflush_all, which may have pinned it while writing
+ * it or waiting for its lock, lets go of it
+ */
+void so_unregister(SO_FILE *stream)
+{
+	pthread_mutex_lock(&so_streams_lock);
+	while (stream->pins > 0)
+		pthread_cond_wait(&so_streams_cond, &so_streams_lock);
+	if (stream->prev != NULL)
+		stream->prev->next = stream->next;
+	else
+		so_streams = stream->next;
+	if (stream->next != NULL)
+		stream->next->prev = stream->prev;
+	pthread_mutex_unlock(&so_streams_lock);
+
+	if (so_stats_dump)
+		so_stats_print(stream, "close");
+	free(stream->name);
+}
+
+/* Copies the I/O statistics gathered so far for the SO_FILE
+ * Returns 0 at succes
+ */
+int so_fstats(SO_FILE *stream, struct so_stats *stats)
+{
+	so_flockfile(stream);
+	so_wb_collect(stream);
+	memcpy(stats, &stream->stats, sizeof(*stats));
+	so_funlockfile(stream);
+	return 0;
+}
+
+/* Tells whether the pending data of the SO_FILE is all in its
+ * buffer, to be written as is at the position of its file descr,
+ * so so_fflush_all can batch it
+ */
+static bool so_flush_plain(SO_FILE *stream)
+{
+	return stream->wb == NULL && stream->ra == NULL &&
+		stream->z == NULL && stream->dio == NULL &&
+		stream->duplex == NULL &&
+		(stream->pipe_flags & SO_PIPE_VMSPLICE) == 0;
+}
+
+/* Accounts for the batched write of the buffer of a SO_FILE that
+ * returned result; what a short write left is flushed the usual way
+ * Returns 0 at succes, SO_EOF in case of error
+ */
+static int so_flush_done(SO_FILE *stream, long result)
+{
+	if (result < 0) {
+		stream->found_error = 1;
+		errno = -result;
+		return SO_EOF;
+	}
+	so_csum(stream, stream->buffer, result);
+	stream->stats.write_calls++;
+	stream->stats.bytes_written += result;
+	stream->stats.flushes++;
+	stream->pointer += result;
+	stream->buff_size -= result;
+	stream->buff_pos = stream->buff_size;
+	if (stream->buff_size == 0)
+		return 0;
+
+	stream->stats.short_writes++;
+	memmove(stream->buffer, stream->buffer + result, stream->buff_size);
+	return so_fflush_unlocked(stream);
+}
+
+/* Writes the buffers of count locked, dirty SO_FILEs, handing all
+ * of them to the kernel with a single io_uring_enter, then unlocks
+ * them; without a SO_RING they are flushed one by one
+ * The SO_RING is made for the first batch of several SO_FILEs
+ * Returns 0 at succes, SO_EOF in case of error
+ */
+static int so_flush_batch(SO_FILE **batch, int count)
+{
+	struct so_completion events[FLUSH_BATCH];
+	bool pending[FLUSH_BATCH];
+	unsigned long long start = so_clock_ns();
+	SO_RING *ring = NULL;
+	int queued = 0;
+	int got = 0;
+	int ret = 0;
+	int i = 0;
+
+	if (count == 0)
+		return 0;
+	pthread_mutex_lock(&so_flush_ring_lock);
+	/* io_uring runs buffered file writes on its workers: a single
+	 * processor cannot overlap them, only switch
+	 */
+	if (count > 1 && !so_flush_ring_tried) {
+		if (sysconf(_SC_NPROCESSORS_ONLN) > 1)
+			so_flush_ring = so_ring_create(FLUSH_BATCH);
+		so_flush_ring_tried = true;
+	}
+	ring = so_flush_ring;
+	for (i = 0; i < count; i++) {
+		pending[i] = ring != NULL && so_ring_push(ring,
+			IORING_OP_WRITE, batch[i]->buffer,
+			batch[i]->buff_size, batch[i],
+			(void *)(intptr_t)i, -1) == 0;
+		if (pending[i])
+			queued++;
+		else
+			ret |= so_fflush_unlocked(batch[i]);
+	}
+	while (queued > 0) {
+		got = so_reap(ring, events, FLUSH_BATCH, queued);
+		if (got == -1)
+			break;
+		for (i = 0; i < got; i++) {
+			pending[(intptr_t)events[i].user_data] = false;
+			ret |= so_flush_done(events[i].stream,
+				events[i].result);
+		}
+		queued -= got;
+	}
+
+	for (i = 0; i < count; i++) {
+		/* lost track of the write: its data may be on file */
+		if (pending[i]) {
+			batch[i]->found_error = 1;
+			ret = SO_EOF;
+		}
+		batch[i]->stats.syscall_ns += (so_clock_ns() - start) / count;
+		so_funlockfile(batch[i]);
+	}
+	pthread_mutex_unlock(&so_flush_ring_lock);
+	return ret;
+}
+
+/* Pins the SO_FILE and lets go of the list of open streams, around
+ * I/O or a wait for a SO_FILE lock; so_unregister keeps a pinned
+ * SO_FILE listed, so its next link is still valid afterwards
+ */
+static void so_streams_leave(SO_FILE *stream)
+{
+	stream->pins++;
+	pthread_mutex_unlock(&so_streams_lock);
+}
+
+/* Takes the list of open streams back and unpins the SO_FILE */
+static void so_streams_return(SO_FILE *stream)
+{
+	pthread_mutex_lock(&so_streams_lock);
+	if (--stream->pins == 0)
+		pthread_cond_broadcast(&so_streams_cond);
+}
+
+/* Flushes every open SO_FILE with pending writes
+ * The SO_FILEs whose data is all in their buffer are written in
+ * batches of FLUSH_BATCH, each handed to io_uring at once (one
+ * system call, the kernel working through them in parallel where
+ * it can, so only on several processors); the others are flushed
+ * one by one with so_fflush
+ * When wait is false, SO_FILEs locked by another thread are
+ * skipped; otherwise they are waited for, so the caller must not
+ * hold the lock of a SO_FILE another thread needs to get there
+ * The list lock is never held during writes or waits, which would
+ * stall so_fopen and so_fclose in every thread, or deadlock with
+ * the owner of a SO_FILE opening or closing another one
+ * Returns 0 at succes, SO_EOF in case of error
+ */
+static int so_flush_all(bool wait)
+{
+	SO_FILE *batch[FLUSH_BATCH];
+	SO_FILE *stream = NULL;
+	int count = 0;
+	int ret = 0;
+
+	pthread_mutex_lock(&so_streams_lock);
+	for (stream = so_streams; stream != NULL; stream = stream->next) {
+		if (pthread_mutex_trylock(&stream->lock) != 0) {
+			if (!wait)
+				continue;
+			/* hold no other SO_FILE while waiting for it */
+			so_streams_leave(stream);
+			ret |= so_flush_batch(batch, count);
+			count = 0;
+			so_flockfile(stream);
+			so_streams_return(stream);
+		}
+		if (stream->last_op != LASTWRITE ||
+			(stream->buff_size == 0 && so_flush_plain(stream))) {
+			so_funlockfile(stream);
+			continue;
+		}
+		if (!so_flush_plain(stream)) {
+			so_streams_leave(stream);
+			ret |= so_fflush_unlocked(stream);
+			so_funlockfile(stream);
+			so_streams_return(stream);
+			continue;
+		}
+
+		batch[count++] = stream;
+		if (count == FLUSH_BATCH) {
+			so_streams_leave(stream);
+			ret |= so_flush_batch(batch, count);
+			count = 0;
+			so_streams_return(stream);
+		}
+	}
+	pthread_mutex_unlock(&so_streams_lock);
+	ret |= so_flush_batch(batch, count);
+	return ret == 0 ? 0 : SO_EOF;
+}
+
+/* Same as so_flush_all, waiting for SO_FILEs used by other threads
+ * A checkpoint of all the output of the process: every byte given
+ * to an open SO_FILE so far reaches its file
+ */
+int so_fflush_all(void)
+{
+	return so_flush_all(true);
+}
@@ -0,0 +1,337 @@
+#include "stdio_internal.h"
+#include <string.h>
+
+/* Writes len bytes from buf at the position of the file descr,
+ * resuming partial writes; counters go to wb->done, since the
+ * SO_FILE statistics belong to the caller thread
+ * Returns 0 at succes, the errno of the failed write otherwise
+ */
+static int so_wb_write_all(SO_FILE *stream, const unsigned char *buf,
+	size_t len)
+{
+	struct so_writebehind *wb = stream->wb;
+	unsigned long long start = 0;
+	ssize_t bytes_written = 0;
+
+	while (len > 0) {
+		start = so_clock_ns();
+		bytes_written = write(stream->fd, buf, len);
+		pthread_mutex_lock(&wb->lock);
+		wb->done.write_calls++;
+		wb->done.syscall_ns += so_clock_ns() - start;
+		if (bytes_written > 0) {
+			so_bc_wrote(stream, -1, bytes_written);
+			wb->done.bytes_written += bytes_written;
+			if ((size_t)bytes_written < len)
+				wb->done.short_writes++;
+		}
+		pthread_mutex_unlock(&wb->lock);
+		if (bytes_written <= 0)
+			return bytes_written == 0 ? EIO : errno;
+		buf += bytes_written;
+		len -= bytes_written;
+	}
+	return 0;
+}
+
+/* Body of the writer thread of a SO_FILE with write-behind
+ * Writes the queued buffers in order, while the caller fills the
+ * next one; after a failed write the rest of the queue is dropped,
+ * since the file would have a hole in it anyway
+ */
+static void *so_wb_worker(void *arg)
+{
+	SO_FILE *stream = arg;
+	struct so_writebehind *wb = stream->wb;
+	struct so_wb_slot *slot = NULL;
+	int err = 0;
+
+	pthread_mutex_lock(&wb->lock);
+	while (true) {
+		while (!wb->quit && wb->count == 0)
+			pthread_cond_wait(&wb->cond, &wb->lock);
+		if (wb->count == 0)
+			break;
+		slot = &wb->slots[wb->head];
+		err = wb->err;
+		pthread_mutex_unlock(&wb->lock);
+
+		if (err == 0)
+			err = so_wb_write_all(stream, slot->buf, slot->len);
+
+		pthread_mutex_lock(&wb->lock);
+		if (err != 0 && wb->err == 0)
+			__atomic_store_n(&wb->err, err, __ATOMIC_RELEASE);
+		wb->head = (wb->head + 1) % WB_SLOTS;
+		wb->count--;
+		pthread_cond_broadcast(&wb->cond);
+	}
+	pthread_mutex_unlock(&wb->lock);
+	return NULL;
+}
+
+/* Adds the counters of the writer thread to the SO_FILE statistics;
+ * lock must be held
+ */
+static void so_wb_merge(SO_FILE *stream)
+{
+	struct so_writebehind *wb = stream->wb;
+
+	stream->stats.write_calls += wb->done.write_calls;
+	stream->stats.bytes_written += wb->done.bytes_written;
+	stream->stats.short_writes += wb->done.short_writes;
+	stream->stats.syscall_ns += wb->done.syscall_ns;
+	memset(&wb->done, 0, sizeof(wb->done));
+}
+
+/* Reports a failure of the writer thread on the SO_FILE, with
+ * errno set; lock must be held
+ * Returns 0 if there was none, -1 otherwise
+ */
+static int so_wb_failed(SO_FILE *stream)
+{
+	if (stream->wb->err == 0)
+		return 0;
+	stream->found_error = 1;
+	errno = stream->wb->err;
+	return -1;
+}
+
+/* Queues the buffer of the SO_FILE for the writer thread, taking
+ * the free buffer of the next slot in exchange, so the caller
+ * only waits when all WB_SLOTS buffers are still queued
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_wb_hand(SO_FILE *stream)
+{
+	struct so_writebehind *wb = stream->wb;
+	struct so_wb_slot *slot = NULL;
+	unsigned char *free_buf = NULL;
+	unsigned long long start = 0;
+
+	so_csum(stream, stream->buffer, stream->buff_size);
+	pthread_mutex_lock(&wb->lock);
+	if (wb->count == WB_SLOTS) {
+		wb->waits++;
+		start = so_clock_ns();
+		while (wb->count == WB_SLOTS)
+			pthread_cond_wait(&wb->cond, &wb->lock);
+		wb->wait_ns += so_clock_ns() - start;
+	}
+	so_wb_merge(stream);
+	if (so_wb_failed(stream)) {
+		pthread_mutex_unlock(&wb->lock);
+		return -1;
+	}
+
+	slot = &wb->slots[(wb->head + wb->count) % WB_SLOTS];
+	free_buf = slot->buf;
+	slot->buf = stream->buffer;
+	slot->len = stream->buff_size;
+	wb->count++;
+	wb->handoffs++;
+	pthread_cond_broadcast(&wb->cond);
+	pthread_mutex_unlock(&wb->lock);
+
+	stream->buffer = free_buf;
+	stream->stats.flushes++;
+	stream->pointer += stream->buff_size;
+	stream->buff_size = 0;
+	stream->buff_pos = 0;
+	return 0;
+}
+
+/* Hands the buffer of a SO_FILE with write-behind, followed by
+ * len bytes from ptr, to the writer thread
+ * ptr belongs to the caller, so it is copied through the buffers;
+ * as with "wz", a tail shorter than the buffer is kept in it
+ * Failures of earlier writes are reported here
+ * Returns 0 at succes, SO_EOF in case of error
+ */
+int so_wb_write_out(SO_FILE *stream, const void *ptr, size_t len)
+{
+	const unsigned char *src = ptr;
+	size_t chunk = 0;
+
+	if (stream->buff_size > 0 && so_wb_hand(stream))
+		return SO_EOF;
+	while (len > 0) {
+		chunk = len < stream->buff_capacity ? len :
+			stream->buff_capacity;
+		memcpy(stream->buffer, src, chunk);
+		stream->buff_size = chunk;
+		stream->buff_pos = chunk;
+		if (chunk == stream->buff_capacity && so_wb_hand(stream))
+			return SO_EOF;
+		src += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+/* Waits until the writer thread of the SO_FILE, if any, has
+ * written every queued buffer, so the file descr is at the
+ * logical position of the SO_FILE
+ * Returns 0 at succes, -1 if a write failed, with errno set
+ */
+int so_wb_drain(SO_FILE *stream)
+{
+	struct so_writebehind *wb = stream->wb;
+	int ret = 0;
+
+	if (wb == NULL)
+		return 0;
+	pthread_mutex_lock(&wb->lock);
+	while (wb->count > 0)
+		pthread_cond_wait(&wb->cond, &wb->lock);
+	so_wb_merge(stream);
+	ret = so_wb_failed(stream);
+	pthread_mutex_unlock(&wb->lock);
+	return ret;
+}
+
+/* Adds the counters of the writer thread, if any, to the SO_FILE
+ * statistics
+ */
+void so_wb_collect(SO_FILE *stream)
+{
+	if (stream->wb == NULL)
+		return;
+	pthread_mutex_lock(&stream->wb->lock);
+	so_wb_merge(stream);
+	pthread_mutex_unlock(&stream->wb->lock);
+}
+
+/* Stops the writer thread of the SO_FILE once its queue is empty,
+ * and gives the SO_FILE back its original buffer, with the data
+ * still pending in the current one
+ */
+static void so_wb_stop(SO_FILE *stream)
+{
+	struct so_writebehind *wb = stream->wb;
+	int i = 0;
+
+	so_wb_drain(stream);
+	pthread_mutex_lock(&wb->lock);
+	wb->quit = true;
+	pthread_cond_broadcast(&wb->cond);
+	pthread_mutex_unlock(&wb->lock);
+	pthread_join(wb->thread, NULL);
+
+	if (stream->buffer != wb->orig) {
+		memcpy(wb->orig, stream->buffer, stream->buff_size);
+		for (i = 0; i < WB_SLOTS; i++)
+			if (wb->slots[i].buf == wb->orig)
+				wb->slots[i].buf = stream->buffer;
+		stream->buffer = wb->orig;
+	}
+	for (i = 0; i < WB_SLOTS; i++)
+		free(wb->slots[i].buf);
+	pthread_cond_destroy(&wb->cond);
+	pthread_mutex_destroy(&wb->lock);
+	free(wb);
+	stream->wb = NULL;
+}
+
+/* Frees the write-behind state of a SO_FILE that is being closed */
+void so_wb_destroy(SO_FILE *stream)
+{
+	if (stream->wb != NULL)
+		so_wb_stop(stream);
+}
+
+/* Turns write-behind of a SO_FILE on or off
+ * While on, a full buffer is handed to a writer thread, and the
+ * caller goes on filling one of WB_SLOTS spare buffers; it only
+ * waits for the file when all of them are queued. A failed write
+ * is reported by the next call on the SO_FILE (so_ferror, or the
+ * next write), so_fflush or so_fclose, which wait for the queue
+ * to be written
+ * The buffers have the capacity of the SO_FILE buffer, so a larger
+ * one set with so_setvbuf beforehand absorbs longer stalls
+ * Read-only, unbuffered, compressed, direct I/O and "r+" so_popen
+ * SO_FILEs are not supported, nor is read-ahead, which would move
+ * the same file descr
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_setwritebehind_unlocked(SO_FILE *stream, int enable)
+{
+	struct so_writebehind *wb = NULL;
+	int ret = 0;
+	int i = 0;
+
+	if (!enable) {
+		if (stream->wb != NULL)
+			ret = so_wb_drain(stream);
+		so_wb_destroy(stream);
+		return ret;
+	}
+	if (stream->wb != NULL)
+		return 0;
+	if (stream->mode_type == READ || stream->mode_type == READMAP ||
+		stream->buff_mode == SO_IONBF || stream->ra != NULL ||
+		stream->duplex != NULL || stream->z != NULL ||
+		stream->dio != NULL)
+		return -1;
+	if (so_get_buffer(stream) == SO_EOF)
+		return -1;
+
+	wb = calloc(1, sizeof(struct so_writebehind));
+	if (wb == NULL)
+		return -1;
+	for (i = 0; i < WB_SLOTS; i++) {
+		wb->slots[i].buf = malloc(stream->buff_capacity);
+		if (wb->slots[i].buf == NULL)
+			ret = -1;
+	}
+	wb->orig = stream->buffer;
+	pthread_mutex_init(&wb->lock, NULL);
+	pthread_cond_init(&wb->cond, NULL);
+
+	stream->wb = wb;
+	if (ret == 0 &&
+		pthread_create(&wb->thread, NULL, so_wb_worker, stream) == 0)
+		return 0;
+
+	pthread_cond_destroy(&wb->cond);
+	pthread_mutex_destroy(&wb->lock);
+	for (i = 0; i < WB_SLOTS; i++)
+		free(wb->slots[i].buf);
+	free(wb);
+	stream->wb = NULL;
+	return -1;
+}
+
+/* Same as so_setwritebehind_unlocked, holding the lock of the SO_FILE */
+int so_setwritebehind(SO_FILE *stream, int enable)
+{
+	int ret;
+
+	so_flockfile(stream);
+	ret = so_setwritebehind_unlocked(stream, enable);
+	so_funlockfile(stream);
+	return ret;
+}
+
+/* Fills stats with the write-behind counters of the SO_FILE
+ * Returns 0 at succes, -1 if write-behind is off
+ */
+int so_fwritebehind_stats(SO_FILE *stream,
+	struct so_writebehind_stats *stats)
+{
+	struct so_writebehind *wb = NULL;
+	int ret = -1;
+
+	so_flockfile(stream);
+	wb = stream->wb;
+	if (wb != NULL) {
+		pthread_mutex_lock(&wb->lock);
+		stats->handoffs = wb->handoffs;
+		stats->waits = wb->waits;
+		stats->wait_ns = wb->wait_ns;
+		pthread_mutex_unlock(&wb->lock);
+		ret = 0;
+	}
+	so_funlockfile(stream);
+	return ret;
+}
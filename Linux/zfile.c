@@ -0,0 +1,673 @@
+#define _GNU_SOURCE
+#include "stdio_internal.h"
+#include <string.h>
+
+/* Uncompressed size of a block, so match offsets fit in 16 bits */
+#define Z_BLOCK		(64 << 10)
+/* Worst case size of a compressed block of n bytes */
+#define Z_BOUND(n)	((n) + (n) / 255 + 16)
+
+#define Z_MAGIC		"SOZ1"	/* file header, with the block size */
+#define Z_INDEX_MAGIC	"SOZX"	/* end of the footer of the index */
+#define Z_FILE_HDR	8
+#define Z_HDR		8	/* block header: stored size, raw size */
+#define Z_ENTRY		16	/* index entry: raw and file offsets */
+#define Z_FOOTER	24
+#define Z_STORED	0x80000000u	/* block kept uncompressed */
+
+/* LZ4 block format: 4 byte minimum match, last 5 bytes literals,
+ * no match starting in the last 12 bytes
+ */
+#define Z_MIN_MATCH	4
+#define Z_LAST_LITERALS	5
+#define Z_MF_LIMIT	12
+#define Z_HASH_LOG	12
+
+static unsigned int so_z_get32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+static void so_z_put32(unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static long long so_z_get64(const unsigned char *p)
+{
+	return so_z_get32(p) | (long long)so_z_get32(p + 4) << 32;
+}
+
+static void so_z_put64(unsigned char *p, long long v)
+{
+	so_z_put32(p, v);
+	so_z_put32(p + 4, (unsigned long long)v >> 32);
+}
+
+static unsigned int so_lz_read32(const unsigned char *p)
+{
+	unsigned int v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned long long so_lz_read64(const unsigned char *p)
+{
+	unsigned long long v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* Writes a length of n beyond the 15 of a token, as a run of 255
+ * bytes closed by a smaller one
+ */
+static unsigned char *so_lz_put_length(unsigned char *op, size_t n)
+{
+	while (n >= 255) {
+		*op++ = 255;
+		n -= 255;
+	}
+	*op++ = n;
+	return op;
+}
+
+/* Reads a length written by so_lz_put_length, adding it to *len
+ * Returns 0 at succes, -1 if the input ends first
+ */
+static int so_lz_get_length(const unsigned char **ip,
+	const unsigned char *iend, size_t *len)
+{
+	unsigned char b = 255;
+
+	while (b == 255) {
+		if (*ip == iend)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	}
+	return 0;
+}
+
+/* Writes one sequence: a token, litlen literals from lit, then,
+ * unless mlen is 0 (the closing sequence), a match of mlen bytes
+ * offset bytes back
+ * Returns the end of the sequence, or NULL if it does not fit
+ * before oend
+ */
+static unsigned char *so_lz_sequence(unsigned char *op, unsigned char *oend,
+	const unsigned char *lit, size_t litlen, size_t offset, size_t mlen)
+{
+	unsigned char *token = op;
+
+	if ((size_t)(oend - op) < litlen + litlen / 255 + mlen / 255 + 5)
+		return NULL;
+	op++;
+	*token = (litlen >= 15 ? 15 : litlen) << 4;
+	if (litlen >= 15)
+		op = so_lz_put_length(op, litlen - 15);
+	memcpy(op, lit, litlen);
+	op += litlen;
+	if (mlen == 0)
+		return op;
+
+	*op++ = offset;
+	*op++ = offset >> 8;
+	mlen -= Z_MIN_MATCH;
+	*token |= mlen >= 15 ? 15 : mlen;
+	if (mlen >= 15)
+		op = so_lz_put_length(op, mlen - 15);
+	return op;
+}
+
+/* Compresses len bytes (at most Z_BLOCK) from src into dst, in the
+ * LZ4 block format: a single pass looks up the last position of
+ * each 4 byte sequence in a hash table, and moves faster over data
+ * where nothing matches
+ * table holds 1 << Z_HASH_LOG entries
+ * Returns the compressed size, or 0 if it would exceed cap
+ */
+static size_t so_lz_compress(const unsigned char *src, size_t len,
+	unsigned char *dst, size_t cap, unsigned int *table)
+{
+	const unsigned char *ip = src;
+	const unsigned char *anchor = src;
+	const unsigned char *ref = NULL;
+	const unsigned char *mflimit = NULL;
+	const unsigned char *matchlimit = NULL;
+	unsigned char *op = dst;
+	unsigned int seq = 0;
+	unsigned int h = 0;
+	size_t mlen = 0;
+
+	memset(table, 0, sizeof(*table) << Z_HASH_LOG);
+	if (len > Z_MF_LIMIT) {
+		mflimit = src + len - Z_MF_LIMIT;
+		matchlimit = src + len - Z_LAST_LITERALS;
+	}
+	while (mflimit != NULL && ip < mflimit) {
+		seq = so_lz_read32(ip);
+		h = (seq * 2654435761u) >> (32 - Z_HASH_LOG);
+		ref = src + table[h];
+		table[h] = ip - src;
+		if (ref >= ip || so_lz_read32(ref) != seq) {
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+		mlen = Z_MIN_MATCH;
+		while (ip + mlen + 8 <= matchlimit &&
+			so_lz_read64(ip + mlen) == so_lz_read64(ref + mlen))
+			mlen += 8;
+		while (ip + mlen < matchlimit && ip[mlen] == ref[mlen])
+			mlen++;
+		op = so_lz_sequence(op, dst + cap, anchor, ip - anchor,
+			ip - ref, mlen);
+		if (op == NULL)
+			return 0;
+		ip += mlen;
+		anchor = ip;
+	}
+	op = so_lz_sequence(op, dst + cap, anchor, src + len - anchor, 0, 0);
+	return op == NULL ? 0 : (size_t)(op - dst);
+}
+
+/* Decompresses len bytes of LZ4 block from src into dst, checking
+ * every length and offset against both buffers, so damaged data
+ * cannot make it read or write out of them
+ * Away from the ends of the buffers, short literal runs are moved
+ * as one 16 byte copy, and matches 8 bytes at a time, even when
+ * that writes a little past them
+ * Returns the decompressed size, or -1 if the data is invalid or
+ * does not fit in cap bytes
+ */
+static long so_lz_decompress(const unsigned char *src, size_t len,
+	unsigned char *dst, size_t cap)
+{
+	const unsigned char *ip = src;
+	const unsigned char *iend = src + len;
+	const unsigned char *ref = NULL;
+	unsigned char *op = dst;
+	unsigned char *oend = dst + cap;
+	unsigned char *end = NULL;
+	unsigned char token = 0;
+	size_t lit = 0;
+	size_t mlen = 0;
+	size_t offset = 0;
+
+	while (ip < iend) {
+		token = *ip++;
+		lit = token >> 4;
+		if (lit == 15 && so_lz_get_length(&ip, iend, &lit))
+			return -1;
+		if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			return -1;
+		if (lit <= 16 && iend - ip >= 16 && oend - op >= 16)
+			memcpy(op, ip, 16);
+		else
+			memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		mlen = token & 15;
+		if (mlen == 15 && so_lz_get_length(&ip, iend, &mlen))
+			return -1;
+		mlen += Z_MIN_MATCH;
+		if (offset == 0 || offset > (size_t)(op - dst) ||
+			mlen > (size_t)(oend - op))
+			return -1;
+		ref = op - offset;
+		if (offset >= 8 && (size_t)(oend - op) >= mlen + 8) {
+			/* each copy only reads bytes already in place */
+			end = op + mlen;
+			do {
+				memcpy(op, ref, 8);
+				op += 8;
+				ref += 8;
+			} while (op < end);
+			op = end;
+		} else {
+			/* the match overlaps the bytes it produces */
+			while (mlen-- > 0)
+				*op++ = *ref++;
+		}
+	}
+	return op - dst;
+}
+
+/* Appends the block starting at raw offset raw and file offset off
+ * to the index of the SO_FILE
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_z_index_add(struct so_zfile *z, long long raw, long long off)
+{
+	if (so_grow((unsigned char **)&z->index, &z->index_cap,
+		(z->blocks + 1) * sizeof(*z->index)))
+		return -1;
+	z->index[z->blocks].raw = raw;
+	z->index[z->blocks].off = off;
+	z->blocks++;
+	return 0;
+}
+
+/* Writes alen bytes from a, then blen bytes from b, at the end of
+ * the compressed file, resuming partial writes
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_z_emit(SO_FILE *stream, const void *a, size_t alen,
+	const void *b, size_t blen)
+{
+	struct so_zfile *z = stream->z;
+	struct iovec iov[2];
+	struct iovec *cur = iov;
+	int iovcnt = blen > 0 ? 2 : 1;
+	unsigned long long start = 0;
+	ssize_t written = 0;
+
+	iov[0].iov_base = (void *)a;
+	iov[0].iov_len = alen;
+	iov[1].iov_base = (void *)b;
+	iov[1].iov_len = blen;
+	while (iovcnt > 0) {
+		start = so_clock_ns();
+		written = pwritev(stream->fd, cur, iovcnt, z->data_end);
+		stream->stats.write_calls++;
+		stream->stats.syscall_ns += so_clock_ns() - start;
+		if (written == -1 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return -1;
+		stream->stats.bytes_written += written;
+		so_bc_wrote(stream, z->data_end, written);
+		z->data_end += written;
+		if ((size_t)written < cur[0].iov_len + (iovcnt > 1 ?
+			cur[1].iov_len : 0))
+			stream->stats.short_writes++;
+		while (iovcnt > 0 && (size_t)written >= cur->iov_len) {
+			written -= cur->iov_len;
+			cur++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			cur->iov_base = (unsigned char *)cur->iov_base +
+				written;
+			cur->iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+/* Writes the file header, before the first block or the index */
+static int so_z_start(SO_FILE *stream)
+{
+	unsigned char head[Z_FILE_HDR];
+
+	if (stream->z->data_end > 0)
+		return 0;
+	memcpy(head, Z_MAGIC, 4);
+	so_z_put32(head + 4, Z_BLOCK);
+	return so_z_emit(stream, head, sizeof(head), NULL, 0);
+}
+
+/* Compresses n bytes (at most Z_BLOCK) from data into one block
+ * at the end of the file, stored as is when they do not shrink,
+ * and adds it to the index
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_z_block(SO_FILE *stream, const unsigned char *data, size_t n)
+{
+	struct so_zfile *z = stream->z;
+	long long off = 0;
+	size_t clen = 0;
+	int ret = 0;
+
+	if (so_z_start(stream))
+		return -1;
+	so_csum(stream, data, n);
+	off = z->data_end;
+	clen = so_lz_compress(data, n, z->comp + Z_HDR, n, z->table);
+	so_z_put32(z->comp + 4, n);
+	if (clen == 0 || clen >= n) {
+		so_z_put32(z->comp, n | Z_STORED);
+		ret = so_z_emit(stream, z->comp, Z_HDR, data, n);
+	} else {
+		so_z_put32(z->comp, clen);
+		ret = so_z_emit(stream, z->comp, Z_HDR + clen, NULL, 0);
+	}
+	if (ret == 0)
+		ret = so_z_index_add(z, z->raw_end, off);
+	z->raw_end += n;
+	return ret;
+}
+
+/* Rebuilds the index of a compressed file whose writer did not
+ * close it, from the headers of its blocks; a block cut short at
+ * the end is left out
+ * Returns 0 at succes, -1 in case of error
+ */
+static int so_z_scan(SO_FILE *stream, long long size)
+{
+	struct so_zfile *z = stream->z;
+	unsigned char head[Z_HDR];
+	long long off = Z_FILE_HDR;
+	size_t clen = 0;
+	size_t rlen = 0;
+
+	while (off + Z_HDR <= size) {
+		if (pread(stream->fd, head, Z_HDR, off) != Z_HDR)
+			return -1;
+		clen = so_z_get32(head) & ~Z_STORED;
+		rlen = so_z_get32(head + 4);
+		if (rlen == 0 || rlen > Z_BLOCK || clen > Z_BOUND(Z_BLOCK) ||
+			off + Z_HDR + (long long)clen > size)
+			break;
+		if (so_z_index_add(z, z->raw_end, off))
+			return -1;
+		z->raw_end += rlen;
+		off += Z_HDR + clen;
+	}
+	z->data_end = off;
+	return 0;
+}
+
+/* Loads the block index of a compressed file, written after its
+ * blocks when it was closed, or rebuilds it when it is missing
+ * Returns 0 at succes, -1 in case of error, with errno set
+ */
+static int so_z_load(SO_FILE *stream)
+{
+	struct so_zfile *z = stream->z;
+	unsigned char foot[Z_FOOTER];
+	unsigned char *raw = NULL;
+	struct stat st;
+	long long index_off = 0;
+	size_t count = 0;
+	size_t i = 0;
+	int ret = 0;
+
+	if (fstat(stream->fd, &st) == -1)
+		return -1;
+	if (pread(stream->fd, foot, Z_FILE_HDR, 0) != Z_FILE_HDR ||
+		memcmp(foot, Z_MAGIC, 4) != 0 ||
+		so_z_get32(foot + 4) > Z_BLOCK) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (st.st_size < Z_FILE_HDR + Z_FOOTER ||
+		pread(stream->fd, foot, Z_FOOTER, st.st_size - Z_FOOTER) !=
+		Z_FOOTER || memcmp(foot + 20, Z_INDEX_MAGIC, 4) != 0)
+		return so_z_scan(stream, st.st_size);
+	index_off = so_z_get64(foot);
+	count = so_z_get32(foot + 16);
+	if (index_off < Z_FILE_HDR ||
+		index_off + (long long)count * Z_ENTRY + Z_FOOTER !=
+		st.st_size)
+		return so_z_scan(stream, st.st_size);
+
+	raw = malloc(count * Z_ENTRY + 1);
+	if (raw == NULL)
+		return -1;
+	if (pread(stream->fd, raw, count * Z_ENTRY, index_off) !=
+		(ssize_t)(count * Z_ENTRY))
+		ret = -1;
+	for (i = 0; ret == 0 && i < count; i++)
+		ret = so_z_index_add(z, so_z_get64(raw + i * Z_ENTRY),
+			so_z_get64(raw + i * Z_ENTRY + 8));
+	free(raw);
+	z->data_end = index_off;
+	z->raw_end = so_z_get64(foot + 8);
+	return ret;
+}
+
+/* Sets up a SO_FILE opened in "rz" or "wz" mode: its buffer holds
+ * one uncompressed block, and for reading the block index is
+ * loaded
+ * Returns 0 at succes, -1 in case of error, with errno set
+ */
+int so_z_open(SO_FILE *stream, bool writing)
+{
+	struct so_zfile *z = calloc(1, sizeof(*z));
+
+	if (z == NULL)
+		return -1;
+	stream->z = z;
+	z->writing = writing;
+	z->comp_cap = Z_HDR + Z_BOUND(Z_BLOCK);
+	z->comp = malloc(z->comp_cap);
+	stream->buffer = malloc(Z_BLOCK);
+	/* so_free_file frees it, even when the rest failed */
+	stream->buff_owned = true;
+	stream->buff_capacity = Z_BLOCK;
+	if (z->comp == NULL || stream->buffer == NULL)
+		return -1;
+
+	if (!writing)
+		return so_z_load(stream);
+	z->table = malloc(sizeof(*z->table) << Z_HASH_LOG);
+	return z->table == NULL ? -1 : 0;
+}
+
+/* Decompresses the next block of a "rz" SO_FILE into its buffer,
+ * reading it with a single pread; after a seek, the bytes of the
+ * block before the target are dropped
+ * Returns the number of bytes placed in the buffer, 0 at EOF or
+ * -1 in case of error
+ */
+long so_z_read(SO_FILE *stream)
+{
+	struct so_zfile *z = stream->z;
+	struct so_zblock *blk = NULL;
+	long long end = 0;
+	size_t span = 0;
+	size_t clen = 0;
+	size_t rlen = 0;
+	ssize_t got = 0;
+
+	if (z->writing) {
+		errno = EBADF;
+		return -1;
+	}
+	if (z->next >= z->blocks)
+		return 0;
+	blk = &z->index[z->next];
+	end = z->next + 1 < z->blocks ? blk[1].off : z->data_end;
+	span = end - blk->off;
+	if (end > blk->off && span >= Z_HDR && span <= z->comp_cap)
+		got = pread(stream->fd, z->comp, span, blk->off);
+	if (got == -1)
+		return -1;
+	if (got == (ssize_t)span && got > 0) {
+		clen = so_z_get32(z->comp) & ~Z_STORED;
+		rlen = so_z_get32(z->comp + 4);
+	}
+	if (clen != span - Z_HDR || rlen > stream->buff_capacity ||
+		z->skip >= rlen)
+		rlen = 0;
+	else if (so_z_get32(z->comp) & Z_STORED)
+		memcpy(stream->buffer, z->comp + Z_HDR, rlen);
+	else if (so_lz_decompress(z->comp + Z_HDR, clen, stream->buffer,
+		stream->buff_capacity) != (long)rlen)
+		rlen = 0;
+	if (rlen == 0) {
+		/* damaged or truncated block */
+		errno = EIO;
+		return -1;
+	}
+
+	if (z->skip > 0)
+		memmove(stream->buffer, stream->buffer + z->skip,
+			rlen - z->skip);
+	rlen -= z->skip;
+	z->skip = 0;
+	z->next++;
+	return rlen;
+}
+
+/* Compresses the buffer of a "wz" SO_FILE, followed by len bytes
+ * from ptr, into blocks at the end of the file
+ * The buffer is first topped up from ptr, so blocks stay full;
+ * ptr is then compressed in place, and a tail shorter than a
+ * block is kept in the buffer
+ * Returns 0 at succes, SO_EOF in case of error
+ */
+int so_z_write_out(SO_FILE *stream, const void *ptr, size_t len)
+{
+	const unsigned char *src = ptr;
+	size_t fill = 0;
+
+	if (!stream->z->writing) {
+		stream->found_error = 1;
+		return SO_EOF;
+	}
+	if (stream->buff_size + len > 0)
+		stream->stats.flushes++;
+
+	if (len > 0 && stream->buff_size > 0) {
+		fill = stream->buff_capacity - stream->buff_size;
+		if (fill > len)
+			fill = len;
+		memcpy(stream->buffer + stream->buff_size, src, fill);
+		stream->buff_size += fill;
+		src += fill;
+		len -= fill;
+	}
+	if (stream->buff_size > 0) {
+		if (so_z_block(stream, stream->buffer, stream->buff_size)) {
+			stream->found_error = 1;
+			return SO_EOF;
+		}
+		stream->pointer += stream->buff_size;
+	}
+	while (len >= stream->buff_capacity) {
+		if (so_z_block(stream, src, stream->buff_capacity)) {
+			stream->found_error = 1;
+			return SO_EOF;
+		}
+		stream->pointer += stream->buff_capacity;
+		src += stream->buff_capacity;
+		len -= stream->buff_capacity;
+	}
+
+	if (len > 0)
+		memcpy(stream->buffer, src, len);
+	stream->buff_size = len;
+	stream->buff_pos = len;
+	return 0;
+}
+
+/* Moves the position of a compressed SO_FILE
+ * When reading, the block holding the target is found in the
+ * index, and the next refill decompresses it; when writing, the
+ * blocks already written cannot change, so only the current
+ * position is accepted
+ * Returns 0 at succes, -1 in case of error
+ */
+int so_z_seek(SO_FILE *stream, long offset, int whence)
+{
+	struct so_zfile *z = stream->z;
+	long long target = offset;
+	size_t lo = 0;
+	size_t hi = z->blocks;
+	size_t mid = 0;
+
+	if (z->writing) {
+		if ((whence == SEEK_SET &&
+			offset == so_ftell_unlocked(stream)) ||
+			(whence == SEEK_END && offset == 0))
+			return 0;
+		errno = ESPIPE;
+		return -1;
+	}
+	if (whence == SEEK_END)
+		target += z->raw_end;
+	else if (whence != SEEK_SET)
+		target = -1;
+	if (target < 0) {
+		stream->found_error = 1;
+		return -1;
+	}
+
+	stream->stats.seeks++;
+	if (stream->buff_pos != stream->buff_size)
+		stream->stats.discarding_seeks++;
+	stream->buff_pos = 0;
+	stream->buff_size = 0;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (z->index[mid].raw <= target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (target >= z->raw_end || lo == 0) {
+		z->next = z->blocks;
+		z->skip = 0;
+	} else {
+		z->next = lo - 1;
+		z->skip = target - z->index[lo - 1].raw;
+	}
+	stream->pointer = target;
+	stream->found_eof = false;
+	return 0;
+}
+
+/* Ends a "wz" SO_FILE whose buffer was flushed: writes the block
+ * index, and a footer locating it, after the last block
+ * Returns 0 at succes, SO_EOF in case of error
+ */
+int so_z_finish(SO_FILE *stream)
+{
+	struct so_zfile *z = stream->z;
+	unsigned char *tail = NULL;
+	size_t len = z->blocks * Z_ENTRY + Z_FOOTER;
+	size_t i = 0;
+	int ret = 0;
+
+	if (!z->writing)
+		return 0;
+	if (so_z_start(stream))
+		return SO_EOF;
+	tail = malloc(len);
+	if (tail == NULL)
+		return SO_EOF;
+	for (i = 0; i < z->blocks; i++) {
+		so_z_put64(tail + i * Z_ENTRY, z->index[i].raw);
+		so_z_put64(tail + i * Z_ENTRY + 8, z->index[i].off);
+	}
+	so_z_put64(tail + len - Z_FOOTER, z->data_end);
+	so_z_put64(tail + len - Z_FOOTER + 8, z->raw_end);
+	so_z_put32(tail + len - Z_FOOTER + 16, z->blocks);
+	memcpy(tail + len - 4, Z_INDEX_MAGIC, 4);
+	ret = so_z_emit(stream, tail, len, NULL, 0);
+	free(tail);
+	return ret == 0 ? 0 : SO_EOF;
+}
+
+/* Frees the compression state of a SO_FILE that is being closed */
+void so_z_free(SO_FILE *stream)
+{
+	struct so_zfile *z = stream->z;
+
+	if (z == NULL)
+		return;
+	free(z->comp);
+	free(z->table);
+	free(z->index);
+	free(z);
+	stream->z = NULL;
+}